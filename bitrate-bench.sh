@@ -0,0 +1,82 @@
+#!/bin/bash
+# Measure bitrate against quality of the software encoders, the numbers behind the bitrate model
+# (BITRATE_BPP and codec_efficiency in gst-app.c).
+# Every clip is scaled to the size and rate, encoded by x264enc, vp8enc and vp9enc at each bitrate,
+# and compared with the raw reference by the psnr and ssim filters of ffmpeg.
+# Without -f the clip is a moving videotestsrc pattern.
+
+export script_name="$(basename "${0}")"
+usage(){
+    echo "Usage:"
+    echo "${script_name} -W [width] -H [height] -r [fps] -s [seconds] -b [kbps list] -f [clip] ..."
+    echo "  e.g. ${script_name} -W 800 -H 600 -b \"250 500 1000 2000\" -f /tmp/door.mp4"
+}
+
+clips=()
+while getopts W:H:r:s:b:f:h flag
+do
+    case "${flag}" in
+        W) width=${OPTARG};;
+        H) height=${OPTARG};;
+        r) fps=${OPTARG};;
+        s) seconds=${OPTARG};;
+        b) rates=${OPTARG};;
+        f) clips+=("${OPTARG}");;
+        *) usage; exit 1;;
+    esac
+done
+
+for tool in gst-launch-1.0 ffmpeg; do
+    if ! command -v ${tool} >/dev/null; then
+        echo "${tool} is required"
+        exit 1
+    fi
+done
+
+width=${width:-1280}
+height=${height:-720}
+fps=${fps:-30}
+seconds=${seconds:-10}
+rates=${rates:-"250 500 1000 2000 4000"}
+frames=$((fps * seconds))
+[ ${#clips[@]} -eq 0 ] && clips=("videotestsrc")
+
+workdir=$(mktemp -d)
+trap 'rm -rf ${workdir}' EXIT
+
+raw_caps="video/x-raw,format=I420,width=${width},height=${height},framerate=${fps}/1"
+
+encoder_args(){
+    local codec=$1 kbps=$2
+    case ${codec} in
+        x264) echo "x264enc bitrate=${kbps} speed-preset=4 tune=zerolatency ! h264parse";;
+        vp8) echo "vp8enc target-bitrate=$((kbps * 1000)) deadline=1 end-usage=cbr";;
+        vp9) echo "vp9enc target-bitrate=$((kbps * 1000)) deadline=1 end-usage=cbr row-mt=true";;
+    esac
+}
+
+printf "%-24s %-5s %8s %10s %8s %8s %7s\n" clip codec kbps real-kbps psnr ssim bpp
+for clip in "${clips[@]}"; do
+    ref=${workdir}/ref.y4m
+    if [ "${clip}" = "videotestsrc" ]; then
+        src="videotestsrc num-buffers=${frames} pattern=smpte horizontal-speed=4"
+    else
+        src="filesrc location=${clip} ! decodebin ! videorate ! videoconvert ! videoscale"
+    fi
+    gst-launch-1.0 -q ${src} ! ${raw_caps} ! identity eos-after=$((frames + 1)) ! y4menc ! filesink location=${ref} || continue
+
+    for codec in x264 vp8 vp9; do
+        for kbps in ${rates}; do
+            out=${workdir}/${codec}-${kbps}.mkv
+            gst-launch-1.0 -q filesrc location=${ref} ! y4mdec ! $(encoder_args ${codec} ${kbps}) \
+                ! matroskamux ! filesink location=${out} >/dev/null 2>&1 || continue
+            log=$(ffmpeg -hide_banner -nostats -i ${out} -i ${ref} \
+                -lavfi "[0:v][1:v]psnr;[0:v][1:v]ssim" -f null - 2>&1)
+            psnr=$(echo "${log}" | sed -n 's/.*PSNR.*average:\([0-9.inf]*\).*/\1/p')
+            ssim=$(echo "${log}" | sed -n 's/.*SSIM.*All:\([0-9.]*\).*/\1/p')
+            real=$(( $(stat -c %s ${out}) * 8 / 1000 / seconds ))
+            bpp=$(echo "scale=4; ${real} * 1000 / (${width} * ${height} * ${fps})" | bc)
+            printf "%-24s %-5s %8s %10s %8s %8s %7s\n" "$(basename ${clip})" ${codec} ${kbps} ${real} ${psnr} ${ssim} ${bpp}
+        done
+    done
+done
@@ -1,4 +1,5 @@
 #include "common_priv.h"
+#include <sys/resource.h>
 
 gchar *get_filepath_by_name(const gchar *name)
 {
@@ -20,4 +21,12 @@ gchar *get_filepath_by_name(const gchar *name)
     }
 
     return full_path;
+}
+
+gdouble get_process_cpu_seconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
 }
\ No newline at end of file
@@ -28,5 +28,8 @@
 
 gchar *get_filepath_by_name(const gchar *name);
 
+/* user + system cpu time of the process. */
+gdouble get_process_cpu_seconds(void);
+
 
 #endif // _COMMON_PRIV_H
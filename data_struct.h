@@ -29,6 +29,9 @@
 #define HAS_JETSON_NANO
 #endif
 
+// capture size plus the smaller rungs of the encoding ladder.
+#define MAX_RENDITIONS 4
+
 struct _webrtc {
     gboolean enable;
     struct _turnserver {
@@ -38,6 +41,14 @@ struct _webrtc {
         gboolean enable;
     } turn;
     const gchar *stun;
+    gboolean keyframe_drop;    // lagging viewers skip to the next keyframe.
+    gboolean request_keyframe; // ask the encoder for a keyframe when they do.
+    gboolean forward;          // send the shared rtp packets without depay/parse/pay per viewer.
+    gint pool_size;            // appsrc session pipelines pre-built in READY state.
+    struct _ladder {
+        gint count;
+        gint height[MAX_RENDITIONS - 1]; // smaller renditions, in descending order.
+    } ladder;
     struct _udpsink {
         gboolean multicast;
         int32_t port;
@@ -67,16 +78,25 @@ typedef struct  {
 struct _GstConfigData {
     _v4l2src_data v4l2src_data;
     int32_t clients;             // How many clients can be allowed to connect to the server.
-    gchar *videnc;           // i.e; h264,h265,vp9
+    gchar *videnc;           // i.e; h264,h265,vp8,vp9,av1
+    int32_t bitrate;         // bps of the capture size, 0 is the bitrate model of videnc.
+    int32_t quality;         // constant quality (crf/qp) instead of bitrate, 0 is off.
+    gboolean intra_refresh;  // periodic intra refresh instead of periodic keyframes, not with the keyframe drop policy.
+    gboolean encoder_idle;   // stop feeding the encoders while nothing consumes the stream.
+    int32_t roi_delta_qp;    // qp offset of the motion and face regions, 0 is off.
+    int32_t mjpeg_workers;   // jpegdec workers of an image/jpeg capture, 0 and 1 are one jpegdec in the pipeline.
+    gboolean shared_convert; // convert the capture once per format for all branches.
     gchar *root_dir;         // streams output root path;
     gchar *webroot;
     gboolean showdot; // generate gstreamer pipeline graphs;
+    gboolean metrics; // pad push tracer for the /metrics endpoint.
+    gboolean encoder_probe; // pick the fastest working encoder by a cached startup probe.
     struct _splitfile_sink {
         gboolean enable;
         int32_t max_files;
         int64_t max_size_time; // seconds of video split.
     } splitfile_sink;        // splitmuxsink save multipart file.
-    gboolean app_sink;       // appsink for filesink save.
+    gboolean app_sink;       // appsrc transport for webrtc and record, otherwise loopback udp multicast.
     struct _hls_onoff {
         gboolean av_hlssink;         // audio and video hls output.
         gboolean motion_hlssink;     // motioncells video hls output.
@@ -84,6 +104,11 @@ struct _GstConfigData {
         gboolean edge_hlssink;       // edge detect video hls output.
         gboolean cvtracker_hlssink;  // cvtracker video hls output.
     } hls_onoff;
+    struct _analysis_data { // the stream of the opencv branches and their hls outputs, with shared_convert.
+        int32_t width;      // 0 keeps the aspect of the capture with height, else is the capture width.
+        int32_t height;     // 0 keeps the aspect of the capture with width, else is the capture height.
+        int32_t framerate;  // 0 is the capture rate.
+    } analysis;
     struct _http_data http;
     struct _udp_data { // udp multicastsink hls output.
         gboolean enable;
@@ -149,6 +174,8 @@ static AppData gs_app = {
     .v4l2src_data.type = "image/jpeg",
     .root_dir = "./",
     .showdot = FALSE,
+    .metrics = FALSE,
+    .encoder_probe = TRUE,
     .splitfile_sink = FALSE,
     .app_sink = FALSE,
     .hls_onoff.av_hlssink = FALSE,
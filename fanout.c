@@ -0,0 +1,969 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * fanout.c:  zero-copy rtp fan-out hub for appsrc subscribers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "fanout.h"
+#include "common_priv.h"
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include <string.h>
+
+// log2 buckets of nanoseconds, the last one is about 2^47ns (39 hours).
+#define FANOUT_LAT_BUCKETS 48
+
+// flags of every queued rtp packet.
+#define FANOUT_PKT_AU_END (1 << 0) // rtp marker, last packet of an access unit.
+#define FANOUT_PKT_KEY (1 << 1)    // first packet of a keyframe.
+
+// longest gop kept for new subscribers, longer gop falls back to a keyframe request.
+#define FANOUT_GOP_CACHE_SIZE 2048
+// pts distance of the cached frames when they are burst to a new subscriber.
+#define FANOUT_BURST_FRAME_STEP GST_MSECOND
+
+struct _FanoutSub {
+    gint ref_count;
+    GstElement *appsrc;
+    GMutex lock;
+    GCond cond;
+    GstBuffer **ring;
+    GstClockTime *stamp; // enqueue time of every slot.
+    guint8 *flags;
+    guint capacity;
+    guint head;
+    guint count;
+    gboolean running;
+    gboolean wait_key;
+    GThread *thread;
+
+    // the hub the packets come from, and the hub it switches to at its next keyframe.
+    FanoutHub *source;
+    FanoutHub *next;
+    gboolean au_end; // the last packet of source ended an access unit.
+
+    // rtp rewrite of forward mode, clock_rate 0 means pass through.
+    guint clock_rate;
+    guint32 ssrc;
+    guint16 seq;
+    guint32 ts_base;
+    GstClockTime pts_base;
+    guint32 in_ts_base;
+
+    guint64 pushed;
+    guint64 dropped;
+    guint64 dropped_frames;
+    guint64 keyframe_skips;
+    guint64 switches;
+    guint max_depth;
+    guint64 lat_max;
+    guint64 lat_hist[FANOUT_LAT_BUCKETS];
+};
+
+struct _FanoutHub {
+    gchar *name;
+    /**
+     * @note The lock only guards the swap of the subscribers snapshot, the publisher
+     * takes a reference of the current snapshot and walks it without any lock.
+     */
+    GMutex lock;
+    GPtrArray *subs;
+    guint64 packets;
+    guint64 publish_ns;
+
+    gchar *encoding; // NULL means drop the oldest packet on overflow.
+    gboolean au_start;
+    FanoutKeyframeFunc keyframe_func;
+    gpointer keyframe_data;
+    guint64 key_requests;
+
+    // rtp packets since the last keyframe, guarded by lock.
+    GPtrArray *gop;
+    GByteArray *gop_flags;
+    gboolean gop_valid;
+    guint64 gop_bursts;
+
+    // counters of the subscribers already gone.
+    guint64 closed_pushed;
+    guint64 closed_dropped;
+    guint64 closed_dropped_frames;
+};
+
+static FanoutSub *fanout_sub_ref(FanoutSub *sub) {
+    g_atomic_int_inc(&sub->ref_count);
+    return sub;
+}
+
+static void fanout_sub_unref(FanoutSub *sub) {
+    if (!g_atomic_int_dec_and_test(&sub->ref_count))
+        return;
+
+    while (sub->count > 0) {
+        gst_buffer_unref(sub->ring[sub->head]);
+        sub->head = (sub->head + 1) % sub->capacity;
+        sub->count--;
+    }
+    g_free(sub->ring);
+    g_free(sub->stamp);
+    g_free(sub->flags);
+    gst_object_unref(sub->appsrc);
+    g_mutex_clear(&sub->lock);
+    g_cond_clear(&sub->cond);
+    g_free(sub);
+}
+
+static guint64 hist_percentile(const guint64 *hist, guint64 total, gdouble pct) {
+    guint64 sum = 0;
+    guint64 want = (guint64)(total * pct);
+    if (total == 0)
+        return 0;
+    for (int i = 0; i < FANOUT_LAT_BUCKETS; i++) {
+        sum += hist[i];
+        if (sum > want)
+            return i == 0 ? 0 : (G_GUINT64_CONSTANT(1) << i);
+    }
+    return G_GUINT64_CONSTANT(1) << (FANOUT_LAT_BUCKETS - 1);
+}
+
+/**
+ * @brief Give the packet the ssrc, a continuous sequence number and a timestamp derived from
+ * the pts of this subscriber. Only the rtp header is copied, the payload memory is still shared.
+ */
+static GstBuffer *fanout_sub_rewrite_rtp(FanoutSub *sub, GstBuffer *buffer) {
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    GstBuffer *header;
+    GstMapInfo map;
+    guint hdrlen;
+    guint32 ts;
+    GstClockTime pts = GST_BUFFER_PTS(buffer);
+
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+        return buffer;
+    hdrlen = gst_rtp_buffer_get_header_len(&rtp);
+    ts = gst_rtp_buffer_get_timestamp(&rtp);
+    gst_rtp_buffer_unmap(&rtp);
+
+    if (!GST_CLOCK_TIME_IS_VALID(sub->pts_base)) {
+        sub->pts_base = pts;
+        sub->in_ts_base = ts;
+    }
+    if (GST_CLOCK_TIME_IS_VALID(pts) && GST_CLOCK_TIME_IS_VALID(sub->pts_base))
+        ts = sub->ts_base + (guint32)gst_util_uint64_scale_int(pts > sub->pts_base ? pts - sub->pts_base : 0,
+                                                               sub->clock_rate, GST_SECOND);
+    else
+        ts = sub->ts_base + (ts - sub->in_ts_base);
+
+    header = gst_buffer_new_allocate(NULL, hdrlen, NULL);
+    gst_buffer_map(header, &map, GST_MAP_WRITE);
+    gst_buffer_extract(buffer, 0, map.data, hdrlen);
+    GST_WRITE_UINT16_BE(map.data + 2, sub->seq++);
+    GST_WRITE_UINT32_BE(map.data + 4, ts);
+    GST_WRITE_UINT32_BE(map.data + 8, sub->ssrc);
+    gst_buffer_unmap(header, &map);
+
+    gst_buffer_copy_into(header, buffer, GST_BUFFER_COPY_METADATA, 0, -1);
+    header = gst_buffer_append(header, gst_buffer_copy_region(buffer, GST_BUFFER_COPY_MEMORY, hdrlen, -1));
+    gst_buffer_unref(buffer);
+    return header;
+}
+
+static gpointer fanout_sub_thread(gpointer user_data) {
+    FanoutSub *sub = (FanoutSub *)user_data;
+    GstBuffer *buffer;
+    GstClockTime stamp, lat = GST_CLOCK_TIME_NONE;
+
+    for (;;) {
+        g_mutex_lock(&sub->lock);
+        // the stats of the last push, read by fanout_sub_get_stats under the lock.
+        if (GST_CLOCK_TIME_IS_VALID(lat)) {
+            sub->lat_hist[MIN(g_bit_storage(lat), FANOUT_LAT_BUCKETS - 1)]++;
+            if (lat > sub->lat_max)
+                sub->lat_max = lat;
+            sub->pushed++;
+            lat = GST_CLOCK_TIME_NONE;
+        }
+        while (sub->running && sub->count == 0)
+            g_cond_wait(&sub->cond, &sub->lock);
+        if (!sub->running) {
+            g_mutex_unlock(&sub->lock);
+            break;
+        }
+        buffer = sub->ring[sub->head];
+        stamp = sub->stamp[sub->head];
+        sub->ring[sub->head] = NULL;
+        sub->head = (sub->head + 1) % sub->capacity;
+        sub->count--;
+        g_mutex_unlock(&sub->lock);
+
+        if (sub->clock_rate)
+            buffer = fanout_sub_rewrite_rtp(sub, buffer);
+
+        // appsrc takes the ownership, it may block here when it is full.
+        gst_app_src_push_buffer(GST_APP_SRC(sub->appsrc), buffer);
+
+        lat = gst_util_get_timestamp() - stamp;
+    }
+    return NULL;
+}
+
+/** every request goes to keyframe_func, its owner merges the requests of all hubs and viewers. */
+static void fanout_hub_request_keyframe(FanoutHub *hub) {
+    if (hub->keyframe_func == NULL)
+        return;
+    g_mutex_lock(&hub->lock);
+    hub->key_requests++;
+    g_mutex_unlock(&hub->lock);
+    hub->keyframe_func(hub->keyframe_data);
+}
+
+static void fanout_sub_drop_head(FanoutSub *sub) {
+    if (sub->flags[sub->head] & FANOUT_PKT_AU_END)
+        sub->dropped_frames++;
+    gst_buffer_unref(sub->ring[sub->head]);
+    sub->ring[sub->head] = NULL;
+    sub->head = (sub->head + 1) % sub->capacity;
+    sub->count--;
+    sub->dropped++;
+}
+
+/**
+ * @brief Drop the queued access units before the newest queued keyframe, if there is no
+ * keyframe queued drop all of them and wait for the next one. Returns TRUE for the later.
+ */
+static gboolean fanout_sub_skip_to_keyframe(FanoutSub *sub) {
+    guint key = 0;
+    gboolean found = FALSE;
+    for (guint i = sub->count; i > 1; i--) {
+        if (sub->flags[(sub->head + i - 1) % sub->capacity] & FANOUT_PKT_KEY) {
+            key = i - 1;
+            found = TRUE;
+            break;
+        }
+    }
+    sub->keyframe_skips++;
+    if (!found) {
+        while (sub->count > 0)
+            fanout_sub_drop_head(sub);
+        sub->wait_key = TRUE;
+        return TRUE;
+    }
+    while (key-- > 0)
+        fanout_sub_drop_head(sub);
+    return FALSE;
+}
+
+static void fanout_hub_remove_stale(FanoutHub *hub, FanoutSub *sub);
+
+static void fanout_sub_enqueue(FanoutHub *hub, FanoutSub *sub, GstBuffer *buffer,
+                               guint8 flags, GstClockTime now) {
+    guint tail;
+    gboolean need_key = FALSE;
+    FanoutHub *old = NULL;
+    g_mutex_lock(&sub->lock);
+    if (!sub->running) {
+        g_mutex_unlock(&sub->lock);
+        return;
+    }
+    if (hub != sub->source) {
+        /**
+         * @note Switching hubs, the new hub takes over at its first keyframe after the old one
+         * finished an access unit, so the decoder never sees a partial frame.
+         */
+        if (hub != sub->next || !(flags & FANOUT_PKT_KEY) || !sub->au_end) {
+            g_mutex_unlock(&sub->lock);
+            return;
+        }
+        old = sub->source;
+        sub->source = hub;
+        sub->next = NULL;
+        sub->wait_key = FALSE;
+        sub->switches++;
+    }
+    sub->au_end = (flags & FANOUT_PKT_AU_END) != 0;
+    if (sub->count == sub->capacity) {
+        // the subscriber is too slow.
+        if (hub->encoding)
+            need_key = fanout_sub_skip_to_keyframe(sub);
+        else
+            fanout_sub_drop_head(sub);
+    }
+    if (sub->wait_key) {
+        if (!(flags & FANOUT_PKT_KEY)) {
+            sub->dropped++;
+            if (flags & FANOUT_PKT_AU_END)
+                sub->dropped_frames++;
+            g_mutex_unlock(&sub->lock);
+            return;
+        }
+        sub->wait_key = FALSE;
+        need_key = FALSE;
+    }
+    tail = (sub->head + sub->count) % sub->capacity;
+    sub->ring[tail] = gst_buffer_ref(buffer);
+    sub->stamp[tail] = now;
+    sub->flags[tail] = flags;
+    sub->count++;
+    if (sub->count > sub->max_depth)
+        sub->max_depth = sub->count;
+    g_cond_signal(&sub->cond);
+    g_mutex_unlock(&sub->lock);
+
+    if (old != NULL)
+        fanout_hub_remove_stale(old, sub);
+    if (need_key)
+        fanout_hub_request_keyframe(hub);
+}
+
+static void fanout_sub_dump(FanoutHub *hub, FanoutSub *sub) {
+    gchar *name = gst_element_get_name(sub->appsrc);
+    guint64 total = 0;
+    for (int i = 0; i < FANOUT_LAT_BUCKETS; i++)
+        total += sub->lat_hist[i];
+    gst_print("fanout %s -> %s: pushed: %" G_GUINT64_FORMAT ", dropped: %" G_GUINT64_FORMAT
+              " (%" G_GUINT64_FORMAT " frames, %" G_GUINT64_FORMAT " keyframe skips), switches: %" G_GUINT64_FORMAT
+              ", depth: %u, max depth: %u/%u"
+              ", latency p50: %" G_GUINT64_FORMAT "ns, p99: %" G_GUINT64_FORMAT "ns, max: %" G_GUINT64_FORMAT "ns\n",
+              hub->name, name, sub->pushed, sub->dropped, sub->dropped_frames, sub->keyframe_skips,
+              sub->switches, sub->count, sub->max_depth, sub->capacity,
+              hist_percentile(sub->lat_hist, total, 0.5),
+              hist_percentile(sub->lat_hist, total, 0.99),
+              sub->lat_max);
+    g_free(name);
+}
+
+FanoutHub *fanout_hub_new(const gchar *name) {
+    FanoutHub *hub = g_new0(FanoutHub, 1);
+    hub->name = g_strdup(name);
+    g_mutex_init(&hub->lock);
+    hub->subs = g_ptr_array_new_with_free_func((GDestroyNotify)fanout_sub_unref);
+    hub->au_start = TRUE;
+    hub->gop = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
+    hub->gop_flags = g_byte_array_new();
+    return hub;
+}
+
+void fanout_hub_set_keyframe_policy(FanoutHub *hub, const gchar *encoding,
+                                    FanoutKeyframeFunc func, gpointer user_data) {
+    if (hub == NULL)
+        return;
+    g_free(hub->encoding);
+    hub->encoding = g_strdup(encoding);
+    hub->keyframe_func = func;
+    hub->keyframe_data = user_data;
+}
+
+void fanout_hub_free(FanoutHub *hub) {
+    if (hub == NULL)
+        return;
+    g_ptr_array_unref(hub->subs);
+    g_ptr_array_unref(hub->gop);
+    g_byte_array_unref(hub->gop_flags);
+    g_mutex_clear(&hub->lock);
+    g_free(hub->encoding);
+    g_free(hub->name);
+    g_free(hub);
+}
+
+/**
+ * @brief Queue a shallow copy of the cached gop to a new subscriber, the frames are packed
+ * FANOUT_BURST_FRAME_STEP apart and end at the pts of the newest cached packet,
+ * so the viewer decodes them at once and continues with the live packets.
+ */
+static void fanout_sub_burst_gop(FanoutHub *hub, FanoutSub *sub, GstClockTime now) {
+    guint frames = 0, frame = 0;
+    GstClockTime last = GST_BUFFER_PTS(g_ptr_array_index(hub->gop, hub->gop->len - 1));
+
+    for (guint i = 0; i < hub->gop->len; i++) {
+        if (hub->gop_flags->data[i] & FANOUT_PKT_AU_END)
+            frames++;
+    }
+    for (guint i = 0; i < hub->gop->len; i++) {
+        // the payload memory is shared, only the metadata is copied.
+        GstBuffer *buffer = gst_buffer_copy(g_ptr_array_index(hub->gop, i));
+        if (GST_CLOCK_TIME_IS_VALID(last)) {
+            GstClockTime offset = (frames - frame) * FANOUT_BURST_FRAME_STEP;
+            GST_BUFFER_PTS(buffer) = last > offset ? last - offset : 0;
+            if (GST_CLOCK_TIME_IS_VALID(GST_BUFFER_DTS(buffer)))
+                GST_BUFFER_DTS(buffer) = GST_BUFFER_PTS(buffer);
+        }
+        sub->ring[i] = buffer;
+        sub->stamp[i] = now;
+        sub->flags[i] = hub->gop_flags->data[i];
+        if (hub->gop_flags->data[i] & FANOUT_PKT_AU_END)
+            frame++;
+    }
+    sub->count = hub->gop->len;
+    sub->max_depth = sub->count;
+    hub->gop_bursts++;
+}
+
+/**
+ * @brief Copy on write add, the publisher may still walk the old snapshot,
+ * returns the old snapshot which must be unreferenced out of the lock.
+ */
+static GPtrArray *fanout_hub_add_sub_locked(FanoutHub *hub, FanoutSub *sub) {
+    GPtrArray *old = hub->subs;
+    GPtrArray *subs = g_ptr_array_new_full(old->len + 1, (GDestroyNotify)fanout_sub_unref);
+    for (guint i = 0; i < old->len; i++) {
+        FanoutSub *s = g_ptr_array_index(old, i);
+        if (s == sub) {
+            g_ptr_array_unref(subs);
+            return g_ptr_array_ref(old);
+        }
+        g_ptr_array_add(subs, fanout_sub_ref(s));
+    }
+    g_ptr_array_add(subs, fanout_sub_ref(sub));
+    hub->subs = subs;
+    return old;
+}
+
+static GPtrArray *fanout_hub_remove_sub_locked(FanoutHub *hub, FanoutSub *sub) {
+    GPtrArray *old = hub->subs;
+    GPtrArray *subs = g_ptr_array_new_full(old->len, (GDestroyNotify)fanout_sub_unref);
+    for (guint i = 0; i < old->len; i++) {
+        FanoutSub *s = g_ptr_array_index(old, i);
+        if (s != sub)
+            g_ptr_array_add(subs, fanout_sub_ref(s));
+    }
+    hub->subs = subs;
+    return old;
+}
+
+static void fanout_hub_remove_sub(FanoutHub *hub, FanoutSub *sub) {
+    GPtrArray *old;
+    g_mutex_lock(&hub->lock);
+    old = fanout_hub_remove_sub_locked(hub, sub);
+    g_mutex_unlock(&hub->lock);
+    g_ptr_array_unref(old);
+}
+
+/** removes sub from hub unless it is again the source or the next hub of sub. */
+static void fanout_hub_remove_stale(FanoutHub *hub, FanoutSub *sub) {
+    GPtrArray *old = NULL;
+    g_mutex_lock(&hub->lock);
+    g_mutex_lock(&sub->lock);
+    if (hub != sub->source && hub != sub->next)
+        old = fanout_hub_remove_sub_locked(hub, sub);
+    g_mutex_unlock(&sub->lock);
+    g_mutex_unlock(&hub->lock);
+    if (old != NULL)
+        g_ptr_array_unref(old);
+}
+
+static FanoutSub *fanout_hub_subscribe_full(FanoutHub *hub, GstElement *appsrc, guint capacity,
+                                            guint clock_rate, guint32 ssrc) {
+    FanoutSub *sub;
+    GPtrArray *old;
+    gchar *name;
+    gboolean need_key = FALSE;
+    GstClockTime now = gst_util_get_timestamp();
+    if (hub == NULL || appsrc == NULL)
+        return NULL;
+
+    sub = g_new0(FanoutSub, 1);
+    sub->ref_count = 1;
+    sub->appsrc = gst_object_ref(appsrc);
+    sub->running = TRUE;
+    sub->clock_rate = clock_rate;
+    sub->ssrc = ssrc;
+    sub->seq = g_random_int_range(0, G_MAXUINT16);
+    sub->ts_base = g_random_int();
+    sub->pts_base = GST_CLOCK_TIME_NONE;
+    sub->source = hub;
+    sub->au_end = TRUE;
+    g_mutex_init(&sub->lock);
+    g_cond_init(&sub->cond);
+
+    /**
+     * @note The gop cache and the snapshot are updated together under the lock by the publisher,
+     * so every packet reaches the new subscriber exactly once, either by the burst or by push.
+     */
+    g_mutex_lock(&hub->lock);
+    if (hub->encoding && hub->gop_valid && hub->gop->len > 0)
+        capacity += hub->gop->len;
+    sub->capacity = capacity;
+    sub->ring = g_new0(GstBuffer *, capacity);
+    sub->stamp = g_new0(GstClockTime, capacity);
+    sub->flags = g_new0(guint8, capacity);
+    if (hub->encoding) {
+        if (hub->gop_valid && hub->gop->len > 0) {
+            fanout_sub_burst_gop(hub, sub, now);
+        } else {
+            sub->wait_key = TRUE;
+            need_key = TRUE;
+        }
+    }
+
+    old = fanout_hub_add_sub_locked(hub, sub);
+    g_mutex_unlock(&hub->lock);
+    g_ptr_array_unref(old);
+
+    name = g_strdup_printf("fanout_%s", hub->name);
+    sub->thread = g_thread_new(name, fanout_sub_thread, sub);
+    g_free(name);
+
+    if (need_key)
+        fanout_hub_request_keyframe(hub);
+    return sub;
+}
+
+FanoutSub *fanout_hub_subscribe(FanoutHub *hub, GstElement *appsrc, guint capacity) {
+    return fanout_hub_subscribe_full(hub, appsrc, capacity, 0, 0);
+}
+
+FanoutSub *fanout_hub_subscribe_rtp(FanoutHub *hub, GstElement *appsrc, guint capacity,
+                                    guint clock_rate, guint32 ssrc) {
+    return fanout_hub_subscribe_full(hub, appsrc, capacity, clock_rate, ssrc);
+}
+
+void fanout_sub_switch(FanoutSub *sub, FanoutHub *to) {
+    FanoutHub *prev;
+    GPtrArray *old;
+    gboolean cancel;
+    if (sub == NULL || to == NULL)
+        return;
+
+    g_mutex_lock(&sub->lock);
+    if (to == sub->next) {
+        g_mutex_unlock(&sub->lock);
+        return;
+    }
+    prev = sub->next;
+    // switching back to the source cancels the pending switch.
+    cancel = to == sub->source;
+    sub->next = cancel ? NULL : to;
+    g_mutex_unlock(&sub->lock);
+
+    if (prev != NULL)
+        fanout_hub_remove_stale(prev, sub);
+    if (cancel)
+        return;
+
+    g_mutex_lock(&to->lock);
+    old = fanout_hub_add_sub_locked(to, sub);
+    g_mutex_unlock(&to->lock);
+    g_ptr_array_unref(old);
+    fanout_hub_request_keyframe(to);
+}
+
+void fanout_hub_unsubscribe(FanoutHub *hub, FanoutSub *sub) {
+    FanoutHub *source, *next;
+    if (hub == NULL || sub == NULL)
+        return;
+
+    g_mutex_lock(&sub->lock);
+    source = sub->source;
+    next = sub->next;
+    g_mutex_unlock(&sub->lock);
+    fanout_hub_remove_sub(hub, sub);
+    if (source != hub)
+        fanout_hub_remove_sub(source, sub);
+    if (next != NULL && next != hub)
+        fanout_hub_remove_sub(next, sub);
+
+    /**
+     * @note The appsrc must be stopped before unsubscribe, otherwise the thread
+     * may be blocked in gst_app_src_push_buffer forever.
+     */
+    g_mutex_lock(&sub->lock);
+    sub->running = FALSE;
+    g_cond_signal(&sub->cond);
+    g_mutex_unlock(&sub->lock);
+    g_thread_join(sub->thread);
+
+    // the counters go to the hub the sub was on at the end, hub may be the one before a switch.
+    source = sub->source;
+    g_mutex_lock(&source->lock);
+    source->closed_pushed += sub->pushed;
+    source->closed_dropped += sub->dropped;
+    source->closed_dropped_frames += sub->dropped_frames;
+    g_mutex_unlock(&source->lock);
+
+    fanout_sub_dump(source, sub);
+    fanout_sub_unref(sub);
+}
+
+void fanout_sub_get_stats(FanoutSub *sub, FanoutSubStats *stats) {
+    memset(stats, 0, sizeof(FanoutSubStats));
+    if (sub == NULL)
+        return;
+    g_mutex_lock(&sub->lock);
+    stats->pushed = sub->pushed;
+    stats->dropped = sub->dropped;
+    stats->dropped_frames = sub->dropped_frames;
+    stats->keyframe_skips = sub->keyframe_skips;
+    stats->switches = sub->switches;
+    stats->depth = sub->count;
+    stats->max_depth = sub->max_depth;
+    g_mutex_unlock(&sub->lock);
+}
+
+static gboolean h264_nal_is_key(guint8 type) {
+    // IDR and SPS, the encoder always sends SPS/PPS before IDR.
+    return type == 5 || type == 7;
+}
+
+static gboolean h265_nal_is_key(guint8 type) {
+    // IRAP pictures and VPS/SPS/PPS.
+    return (type >= 16 && type <= 21) || (type >= 32 && type <= 34);
+}
+
+/**
+ * @brief Check if the first rtp packet of an access unit carries a keyframe,
+ * payload formats are RFC 6184 (h264), RFC 7798 (h265), RFC 7741 (vp8), the vp9 draft
+ * and the AOM av1 rtp specification.
+ */
+static gboolean rtp_payload_is_keyframe(const gchar *encoding, const guint8 *data, guint len) {
+    if (len < 1)
+        return FALSE;
+    if (!g_strcmp0(encoding, "h264")) {
+        guint8 type = data[0] & 0x1f;
+        if (type == 24) {
+            // STAP-A, walk all aggregated nal units.
+            guint off = 1;
+            while (off + 3 <= len) {
+                guint size = (data[off] << 8) | data[off + 1];
+                if (h264_nal_is_key(data[off + 2] & 0x1f))
+                    return TRUE;
+                off += 2 + size;
+            }
+            return FALSE;
+        }
+        if (type == 28)
+            return len > 1 && (data[1] & 0x80) && h264_nal_is_key(data[1] & 0x1f);
+        return h264_nal_is_key(type);
+    } else if (!g_strcmp0(encoding, "h265")) {
+        guint8 type;
+        if (len < 3)
+            return FALSE;
+        type = (data[0] >> 1) & 0x3f;
+        if (type == 48) {
+            // AP, walk all aggregated nal units.
+            guint off = 2;
+            while (off + 3 <= len) {
+                guint size = (data[off] << 8) | data[off + 1];
+                if (h265_nal_is_key((data[off + 2] >> 1) & 0x3f))
+                    return TRUE;
+                off += 2 + size;
+            }
+            return FALSE;
+        }
+        if (type == 49)
+            return (data[2] & 0x80) && h265_nal_is_key(data[2] & 0x3f);
+        return h265_nal_is_key(type);
+    } else if (!g_strcmp0(encoding, "vp8")) {
+        guint off = 1;
+        // S bit and partition index 0.
+        if (!(data[0] & 0x10) || (data[0] & 0x0f))
+            return FALSE;
+        if (data[0] & 0x80) {
+            guint8 ext;
+            if (len < 2)
+                return FALSE;
+            ext = data[1];
+            off = 2;
+            if (ext & 0x80) // I, picture id
+                off += (off < len && (data[off] & 0x80)) ? 2 : 1;
+            if (ext & 0x40) // L, TL0PICIDX
+                off++;
+            if (ext & 0x30) // T or K
+                off++;
+        }
+        // P bit of the vp8 payload header is 0 for keyframe.
+        return off < len && !(data[off] & 0x01);
+    } else if (!g_strcmp0(encoding, "vp9")) {
+        // B bit set and P bit clear.
+        return (data[0] & 0x08) && !(data[0] & 0x40);
+    } else if (!g_strcmp0(encoding, "av1")) {
+        // N bit of the aggregation header, the first packet of a coded video sequence.
+        return (data[0] & 0x08) != 0;
+    }
+    // unknown payload, every access unit is a sync point.
+    return TRUE;
+}
+
+static guint8 fanout_packet_flags(FanoutHub *hub, GstBuffer *buffer) {
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    guint8 flags = 0;
+    gboolean marker = FALSE;
+
+    if (hub->encoding == NULL)
+        return FANOUT_PKT_AU_END | FANOUT_PKT_KEY;
+
+    if (gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp)) {
+        marker = gst_rtp_buffer_get_marker(&rtp);
+        if (hub->au_start && rtp_payload_is_keyframe(hub->encoding,
+                                                     gst_rtp_buffer_get_payload(&rtp),
+                                                     gst_rtp_buffer_get_payload_len(&rtp)))
+            flags |= FANOUT_PKT_KEY;
+        gst_rtp_buffer_unmap(&rtp);
+    }
+    if (marker)
+        flags |= FANOUT_PKT_AU_END;
+    hub->au_start = marker;
+    return flags;
+}
+
+static void fanout_hub_cache_packet(FanoutHub *hub, GstBuffer *buffer, guint8 flags) {
+    if (flags & FANOUT_PKT_KEY) {
+        g_ptr_array_set_size(hub->gop, 0);
+        g_byte_array_set_size(hub->gop_flags, 0);
+        hub->gop_valid = TRUE;
+    }
+    if (!hub->gop_valid)
+        return;
+    if (hub->gop->len >= FANOUT_GOP_CACHE_SIZE) {
+        // too long gop, new subscribers will ask for a keyframe.
+        g_ptr_array_set_size(hub->gop, 0);
+        g_byte_array_set_size(hub->gop_flags, 0);
+        hub->gop_valid = FALSE;
+        return;
+    }
+    g_ptr_array_add(hub->gop, gst_buffer_ref(buffer));
+    g_byte_array_append(hub->gop_flags, &flags, 1);
+}
+
+void fanout_hub_clear_gop(FanoutHub *hub) {
+    if (hub == NULL)
+        return;
+    g_mutex_lock(&hub->lock);
+    g_ptr_array_set_size(hub->gop, 0);
+    g_byte_array_set_size(hub->gop_flags, 0);
+    hub->gop_valid = FALSE;
+    g_mutex_unlock(&hub->lock);
+}
+
+void fanout_hub_push(FanoutHub *hub, GstBuffer *buffer) {
+    GPtrArray *subs;
+    GstClockTime now = gst_util_get_timestamp();
+    guint8 flags = fanout_packet_flags(hub, buffer);
+
+    g_mutex_lock(&hub->lock);
+    if (hub->encoding)
+        fanout_hub_cache_packet(hub, buffer, flags);
+    subs = g_ptr_array_ref(hub->subs);
+    g_mutex_unlock(&hub->lock);
+
+    for (guint i = 0; i < subs->len; i++)
+        fanout_sub_enqueue(hub, g_ptr_array_index(subs, i), buffer, flags, now);
+    g_ptr_array_unref(subs);
+    gst_buffer_unref(buffer);
+
+    hub->packets++;
+    hub->publish_ns += gst_util_get_timestamp() - now;
+}
+
+guint fanout_hub_get_totals(FanoutHub *hub, FanoutSubStats *total) {
+    GPtrArray *subs;
+    guint len;
+    memset(total, 0, sizeof(FanoutSubStats));
+    if (hub == NULL)
+        return 0;
+    g_mutex_lock(&hub->lock);
+    subs = g_ptr_array_ref(hub->subs);
+    total->pushed = hub->closed_pushed;
+    total->dropped = hub->closed_dropped;
+    total->dropped_frames = hub->closed_dropped_frames;
+    g_mutex_unlock(&hub->lock);
+
+    for (guint i = 0; i < subs->len; i++) {
+        FanoutSubStats stats;
+        fanout_sub_get_stats(g_ptr_array_index(subs, i), &stats);
+        total->pushed += stats.pushed;
+        total->dropped += stats.dropped;
+        total->dropped_frames += stats.dropped_frames;
+        total->keyframe_skips += stats.keyframe_skips;
+        total->depth += stats.depth;
+        total->max_depth = MAX(total->max_depth, stats.max_depth);
+    }
+    len = subs->len;
+    g_ptr_array_unref(subs);
+    return len;
+}
+
+guint fanout_hub_get_subscribers(FanoutHub *hub) {
+    guint len;
+    if (hub == NULL)
+        return 0;
+    g_mutex_lock(&hub->lock);
+    len = hub->subs->len;
+    g_mutex_unlock(&hub->lock);
+    return len;
+}
+
+void fanout_hub_dump_stats(FanoutHub *hub) {
+    GPtrArray *subs;
+    if (hub == NULL)
+        return;
+    g_mutex_lock(&hub->lock);
+    subs = g_ptr_array_ref(hub->subs);
+    g_mutex_unlock(&hub->lock);
+
+    gst_print("fanout %s: subscribers: %u, packets: %" G_GUINT64_FORMAT ", publish: %" G_GUINT64_FORMAT
+              " ns/packet, keyframe requests: %" G_GUINT64_FORMAT ", gop bursts: %" G_GUINT64_FORMAT "\n",
+              hub->name, subs->len, hub->packets,
+              hub->packets ? hub->publish_ns / hub->packets : 0, hub->key_requests, hub->gop_bursts);
+    for (guint i = 0; i < subs->len; i++)
+        fanout_sub_dump(hub, g_ptr_array_index(subs, i));
+    g_ptr_array_unref(subs);
+}
+
+static gboolean has_factory(const gchar *name) {
+    GstElementFactory *factory = gst_element_factory_find(name);
+    if (factory == NULL)
+        return FALSE;
+    gst_object_unref(factory);
+    return TRUE;
+}
+
+static GPtrArray *bench_encode_packets(const gchar **encoding) {
+    GstElement *encpipe, *appsink;
+    GstSample *sample;
+    GError *error = NULL;
+    GPtrArray *packets = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
+    gboolean h264 = has_factory("x264enc");
+    const gchar *enc = h264 ? "x264enc tune=zerolatency speed-preset=ultrafast key-int-max=30 ! rtph264pay config-interval=-1 aggregate-mode=1"
+                            : "vp8enc deadline=1 ! rtpvp8pay";
+    gchar *cmdline = g_strdup_printf("videotestsrc num-buffers=300 pattern=ball ! video/x-raw,width=1280,height=720,framerate=30/1 ! "
+                                     " videoconvert ! %s ! appsink name=sink sync=false enable-last-sample=false max-buffers=0",
+                                     enc);
+    *encoding = h264 ? "h264" : "vp8";
+    encpipe = gst_parse_launch(cmdline, &error);
+    g_free(cmdline);
+    if (error) {
+        g_printerr("Unable to build bench pipeline: %s\n", error->message);
+        g_error_free(error);
+        return packets;
+    }
+    appsink = gst_bin_get_by_name(GST_BIN(encpipe), "sink");
+    gst_element_set_state(encpipe, GST_STATE_PLAYING);
+    while ((sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink))) != NULL) {
+        g_ptr_array_add(packets, gst_buffer_ref(gst_sample_get_buffer(sample)));
+        gst_sample_unref(sample);
+    }
+    gst_element_set_state(encpipe, GST_STATE_NULL);
+    gst_object_unref(appsink);
+    gst_object_unref(encpipe);
+    return packets;
+}
+
+static void bench_run(GPtrArray *packets, const gchar *encoding, gboolean forward, guint n) {
+    FanoutHub *hub = fanout_hub_new("bench");
+    GstElement **pipes = g_new0(GstElement *, n);
+    FanoutSub **subs = g_new0(FanoutSub *, n);
+    guint64 hist[FANOUT_LAT_BUCKETS] = {0};
+    guint64 total = 0, lat_max = 0, dropped = 0;
+    GstClockTime first = GST_BUFFER_PTS(g_ptr_array_index(packets, 0));
+    GstClockTime last = GST_BUFFER_PTS(g_ptr_array_index(packets, packets->len - 1));
+    gdouble media_sec = (last > first ? last - first : GST_SECOND) / (gdouble)GST_SECOND;
+    gdouble cpu;
+    gchar *upenc = g_ascii_strup(encoding, -1);
+    gchar *cmdline;
+
+    /* the repay mode is what every session did before, the forward mode only rewrites the rtp header. */
+    if (forward)
+        cmdline = g_strdup("appsrc name=src format=3 block=true ! fakesink sync=false");
+    else
+        cmdline = g_strdup_printf("appsrc name=src format=3 block=true ! "
+                                  " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
+                                  " rtp%sdepay ! %s rtp%spay ! fakesink sync=false",
+                                  upenc, encoding, g_strcmp0(encoding, "h264") ? "" : "h264parse !", encoding);
+    g_free(upenc);
+
+    for (guint i = 0; i < n; i++) {
+        GstElement *appsrc;
+        pipes[i] = gst_parse_launch(cmdline, NULL);
+        appsrc = gst_bin_get_by_name(GST_BIN(pipes[i]), "src");
+        gst_element_set_state(pipes[i], GST_STATE_PLAYING);
+        subs[i] = forward ? fanout_hub_subscribe_rtp(hub, appsrc, FANOUT_VIDEO_RING_SIZE, 90000, g_random_int())
+                          : fanout_hub_subscribe(hub, appsrc, FANOUT_VIDEO_RING_SIZE);
+        gst_object_unref(appsrc);
+    }
+    g_free(cmdline);
+
+    cpu = get_process_cpu_seconds();
+    for (guint i = 0; i < packets->len; i++)
+        fanout_hub_push(hub, gst_buffer_ref(g_ptr_array_index(packets, i)));
+
+    // wait for all rings drained.
+    for (guint i = 0; i < n; i++) {
+        for (int retry = 0; retry < 1000; retry++) {
+            guint count;
+            g_mutex_lock(&subs[i]->lock);
+            count = subs[i]->count;
+            g_mutex_unlock(&subs[i]->lock);
+            if (count == 0)
+                break;
+            g_usleep(1000);
+        }
+    }
+    cpu = get_process_cpu_seconds() - cpu;
+
+    for (guint i = 0; i < n; i++) {
+        FanoutSub *sub = subs[i];
+        for (int b = 0; b < FANOUT_LAT_BUCKETS; b++) {
+            hist[b] += sub->lat_hist[b];
+            total += sub->lat_hist[b];
+        }
+        lat_max = MAX(lat_max, sub->lat_max);
+        dropped += sub->dropped;
+    }
+
+    gst_print("%8s %6u %12" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT
+              " %12" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT " %12.2f\n",
+              forward ? "forward" : "repay", n, hub->publish_ns / hub->packets,
+              hist_percentile(hist, total, 0.5),
+              hist_percentile(hist, total, 0.99),
+              hist_percentile(hist, total, 0.999),
+              lat_max, dropped, cpu * 100.0 / media_sec / n);
+
+    for (guint i = 0; i < n; i++) {
+        gst_element_set_state(pipes[i], GST_STATE_NULL);
+        fanout_hub_unsubscribe(hub, subs[i]);
+        gst_object_unref(pipes[i]);
+    }
+    g_free(pipes);
+    g_free(subs);
+    fanout_hub_free(hub);
+}
+
+/**
+ * @brief Replay the rtp packets of a videotestsrc clip through a hub with 1..max_subs subscribers,
+ * once with the old depay/parse/pay chain per subscriber and once with the forward mode,
+ * print the publish cost, the enqueue to push-buffer latency and the cpu of one core per client.
+ */
+int fanout_bench(guint max_subs) {
+    const gchar *encoding;
+    GPtrArray *packets = bench_encode_packets(&encoding);
+    if (packets->len == 0) {
+        g_ptr_array_unref(packets);
+        return -1;
+    }
+    gst_print("fanout bench: %u %s rtp packets of 720p30 videotestsrc\n", packets->len, encoding);
+    gst_print("%8s %6s %12s %12s %12s %12s %12s %10s %12s\n", "mode", "subs", "ns/packet", "p50(ns)", "p99(ns)",
+              "p99.9(ns)", "max(ns)", "dropped", "cpu%/client");
+
+    for (int forward = 0; forward < 2; forward++) {
+        for (guint n = 1; n <= max_subs; n *= 2)
+            bench_run(packets, encoding, forward, n);
+    }
+    g_ptr_array_unref(packets);
+    return 0;
+}
@@ -0,0 +1,96 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * fanout.h:  zero-copy rtp fan-out hub for appsrc subscribers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _FANOUT_H
+#define _FANOUT_H
+#include <glib.h>
+#include <gst/gst.h>
+
+// ring size in rtp packets of every subscriber.
+#define FANOUT_VIDEO_RING_SIZE 512
+#define FANOUT_AUDIO_RING_SIZE 128
+
+typedef struct _FanoutHub FanoutHub;
+typedef struct _FanoutSub FanoutSub;
+
+typedef void (*FanoutKeyframeFunc)(gpointer user_data);
+
+typedef struct {
+    guint64 pushed;
+    guint64 dropped;        // rtp packets.
+    guint64 dropped_frames; // whole access units.
+    guint64 keyframe_skips; // times the subscriber skipped to the next keyframe.
+    guint64 switches;       // completed fanout_sub_switch.
+    guint depth;
+    guint max_depth;
+} FanoutSubStats;
+
+FanoutHub *fanout_hub_new(const gchar *name);
+void fanout_hub_free(FanoutHub *hub);
+
+/**
+ * @brief When encoding is not NULL, a subscriber whose ring overflows drops whole access units
+ * up to the next keyframe of encoding (h264, h265, vp8, vp9) instead of single rtp packets,
+ * func is called to ask the encoder for a new keyframe if there is no keyframe queued.
+ * The hub does not throttle func, every request reaches it.
+ */
+void fanout_hub_set_keyframe_policy(FanoutHub *hub, const gchar *encoding,
+                                    FanoutKeyframeFunc func, gpointer user_data);
+
+/**
+ * @brief Every subscriber owns a bounded ring and a thread which feeds its appsrc,
+ * so one slow appsrc never delays the publisher or the other subscribers.
+ * With the keyframe policy a new subscriber starts with the cached gop of the hub.
+ */
+FanoutSub *fanout_hub_subscribe(FanoutHub *hub, GstElement *appsrc, guint capacity);
+
+/** forgets the cached gop, the next subscriber waits for a new keyframe. */
+void fanout_hub_clear_gop(FanoutHub *hub);
+
+/**
+ * @brief Forward mode, the packets go to appsrc ! webrtcbin without repay, so the subscriber
+ * rewrites the ssrc, sequence number and timestamp (from pts at clock_rate) of every packet.
+ */
+FanoutSub *fanout_hub_subscribe_rtp(FanoutHub *hub, GstElement *appsrc, guint capacity,
+                                    guint clock_rate, guint32 ssrc);
+/** removes sub from hub and from the hubs of a switch in progress. */
+void fanout_hub_unsubscribe(FanoutHub *hub, FanoutSub *sub);
+
+/**
+ * @brief Moves sub to the hub to, e.g. another rendition of the same source. The packets of
+ * the current hub keep flowing until to sends a keyframe at an access unit boundary of the
+ * current hub, so the switch is seamless for the decoder. A keyframe is requested from to.
+ */
+void fanout_sub_switch(FanoutSub *sub, FanoutHub *to);
+void fanout_sub_get_stats(FanoutSub *sub, FanoutSubStats *stats);
+
+/** takes the ownership of buffer, the buffer is shared by refcount and never copied. */
+void fanout_hub_push(FanoutHub *hub, GstBuffer *buffer);
+
+guint fanout_hub_get_subscribers(FanoutHub *hub);
+/** sums the counters of all subscribers since start, returns the current subscribers. */
+guint fanout_hub_get_totals(FanoutHub *hub, FanoutSubStats *total);
+void fanout_hub_dump_stats(FanoutHub *hub);
+
+int fanout_bench(guint max_subs);
+
+#endif // _FANOUT_H
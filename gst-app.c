@@ -22,10 +22,20 @@
 
 #include "gst-app.h"
 #include "data_struct.h"
+#include "common_priv.h"
+#include "fanout.h"
+#include "metrics.h"
+#include "mjpegdec.h"
 #include "soup.h"
 #include <gst/app/gstappsink.h>
 #include <gst/app/gstappsrc.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include <gst/video/gstvideometa.h>
 #include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/inotify.h>
 #include <sys/types.h>
 
@@ -49,17 +59,427 @@ static pthread_mutex_t cmd_mtx = PTHREAD_MUTEX_INITIALIZER;
 static GThreadPool *play_thread_pool = NULL;
 static GMutex _play_pool_lock;
 
+#define TRANSPORT_STATS_INTERVAL 10
+
+static FanoutHub *video_hub = NULL;
+static FanoutHub *audio_hub = NULL;
+// appsink or udpsink of the shared rtp streams.
+static GstElement *video_rtp_sink = NULL;
+static GstElement *audio_rtp_sink = NULL;
+
+// the encoder element behind the video_encoder tee.
+static GstElement *video_encoder_element = NULL;
+
+/**
+ * @brief One rung of the encoding ladder, every rung is encoded once and shared by all
+ * the viewers attached to it. Rung 0 is the capture size, the others go down in size.
+ */
 typedef struct {
-    GstElement *video_src;
-    GstElement *audio_src;
-} AppSrcAVPair;
+    gint width;
+    gint height;
+    guint bitrate; // nominal bps
+    GstElement *encoder;
+    GstElement *rtp_sink;
+    FanoutHub *hub;
+    guint current_bitrate; // set by the congestion controller.
+    gint raise_votes;      // polls in a row with room for a higher bitrate.
+    // keyframe broker, guarded by keyframe_lock.
+    GstClockTime last_keyframe;
+    guint keyframe_timer;
+} Rendition;
+
+static Rendition renditions[MAX_RENDITIONS];
+static gint n_renditions = 0;
+// width, height, bitrate and current_bitrate once the pipeline runs, set_video_mode changes them.
+static GMutex rendition_lock;
+
+// get-stats poll of every connected session, drives the rendition choice.
+#define BWE_INTERVAL 2
+// polls in a row with room for a higher rung before moving up.
+#define BWE_UP_POLLS 3
+#define BWE_MIN_BITRATE 100000
+// polls in a row with a higher target before an encoder bitrate goes up.
+#define BWE_RAISE_POLLS 3
+
+// sessions with a running get-stats poll.
+static GMutex bwe_lock;
+static GList *bwe_sessions = NULL;
+
+// at most one forced keyframe per encoder in this interval, the requests in between share it.
+#define KEYFRAME_MIN_INTERVAL (500 * GST_MSECOND)
+
+typedef enum {
+    KEYFRAME_PLI,     // PLI or FIR of a viewer.
+    KEYFRAME_JOIN,    // a viewer without the cached gop starts.
+    KEYFRAME_LAGGING, // a lagging fanout subscriber skipped to the next keyframe.
+    KEYFRAME_RECORD,  // a recording starts.
+    KEYFRAME_RESUME,  // the idle encoder gets its first consumer.
+    KEYFRAME_MODE,    // the size or rate of the encoder changes.
+    KEYFRAME_REASONS
+} KeyframeReason;
+
+static const gchar *keyframe_reason_names[KEYFRAME_REASONS] = {"pli", "join", "lagging", "record", "resume", "mode"};
+static GMutex keyframe_lock;
+static guint64 keyframe_requests[KEYFRAME_REASONS];
+static guint64 keyframes_forced = 0;
+
+static void send_keyframe_event(Rendition *rendition) {
+    GstPad *pad = gst_element_get_static_pad(rendition->encoder, "src");
+    GstEvent *event = gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM,
+                                           gst_structure_new("GstForceKeyUnit",
+                                                             "all-headers", G_TYPE_BOOLEAN, TRUE, NULL));
+    // sent to the src pad, the encoder handles it before any element upstream sees it.
+    gst_pad_send_event(pad, event);
+    gst_object_unref(pad);
+}
+
+static gboolean flush_keyframe_request(gpointer user_data) {
+    Rendition *rendition = (Rendition *)user_data;
+    g_mutex_lock(&keyframe_lock);
+    rendition->keyframe_timer = 0;
+    rendition->last_keyframe = gst_util_get_timestamp();
+    keyframes_forced++;
+    g_mutex_unlock(&keyframe_lock);
+    send_keyframe_event(rendition);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief The single way to ask an encoder for a keyframe. A request within KEYFRAME_MIN_INTERVAL
+ * of the last keyframe is deferred to the end of the interval, and all the requests meanwhile
+ * are answered by that one keyframe, so N viewers reporting the same loss cost one keyframe.
+ */
+static void request_keyframe(Rendition *rendition, KeyframeReason reason) {
+    GstClockTime now = gst_util_get_timestamp();
+    if (rendition->encoder == NULL)
+        return;
 
-static GMutex G_appsrc_lock;
-static GList *G_AppsrcList;
+    g_mutex_lock(&keyframe_lock);
+    keyframe_requests[reason]++;
+    if (rendition->keyframe_timer != 0) {
+        g_mutex_unlock(&keyframe_lock);
+        return;
+    }
+    if (!GST_CLOCK_TIME_IS_VALID(rendition->last_keyframe) || rendition->last_keyframe == 0 ||
+        now - rendition->last_keyframe >= KEYFRAME_MIN_INTERVAL) {
+        rendition->last_keyframe = now;
+        keyframes_forced++;
+        g_mutex_unlock(&keyframe_lock);
+        send_keyframe_event(rendition);
+        return;
+    }
+    rendition->keyframe_timer = g_timeout_add((KEYFRAME_MIN_INTERVAL - (now - rendition->last_keyframe)) / GST_MSECOND + 1,
+                                              flush_keyframe_request, rendition);
+    g_mutex_unlock(&keyframe_lock);
+}
+
+static void report_keyframe_requests() {
+    guint64 total = 0;
+    GString *line = g_string_new("keyframe requests:");
+    g_mutex_lock(&keyframe_lock);
+    for (gint i = 0; i < KEYFRAME_REASONS; i++) {
+        total += keyframe_requests[i];
+        g_string_append_printf(line, " %s %" G_GUINT64_FORMAT ",", keyframe_reason_names[i], keyframe_requests[i]);
+    }
+    g_string_append_printf(line, " forced keyframes: %" G_GUINT64_FORMAT "\n", keyframes_forced);
+    g_mutex_unlock(&keyframe_lock);
+    if (total > 0)
+        gst_print("%s", line->str);
+    g_string_free(line, TRUE);
+}
+
+void keyframe_stats_to_prometheus(GString *out) {
+    g_mutex_lock(&keyframe_lock);
+    g_string_append(out, "# TYPE gwc_keyframe_requests_total counter\n");
+    for (gint i = 0; i < KEYFRAME_REASONS; i++)
+        g_string_append_printf(out, "gwc_keyframe_requests_total{reason=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                               keyframe_reason_names[i], keyframe_requests[i]);
+    g_string_append(out, "# TYPE gwc_keyframes_forced_total counter\n");
+    g_string_append_printf(out, "gwc_keyframes_forced_total %" G_GUINT64_FORMAT "\n", keyframes_forced);
+    g_mutex_unlock(&keyframe_lock);
+}
 
 GstConfigData config_data;
 GHashTable *capture_htable = NULL;
 
+/**
+ * @brief Valves on the raw video in front of the encoders, closed while nothing consumes the
+ * encoded stream: no session, no recording and no hls, split-file or udp multicast on it.
+ * Guarded by gate_lock, the cpu is split into the idle and the active periods.
+ */
+static GMutex gate_lock;
+static GPtrArray *gate_valves = NULL;
+static gint gate_consumers = 0;
+static gboolean gate_open = TRUE;
+static gint64 gate_since = 0;
+static gdouble gate_since_cpu = 0;
+static gdouble gate_seconds[2]; // idle, active
+static gdouble gate_cpu_seconds[2];
+
+/** a valve for the raw video in front of an encoder, NULL on failure. */
+static GstElement *add_encoder_gate() {
+    GstElement *valve = gst_element_factory_make("valve", NULL);
+    if (valve == NULL)
+        return NULL;
+    // keep the caps flowing while closed, so the payloader caps are known before the first session.
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(valve), "drop-mode"))
+        gst_util_set_object_arg(G_OBJECT(valve), "drop-mode", "forward-sticky-events");
+    gst_bin_add(GST_BIN(pipeline), valve);
+    g_mutex_lock(&gate_lock);
+    if (gate_valves == NULL)
+        gate_valves = g_ptr_array_new();
+    g_ptr_array_add(gate_valves, valve);
+    g_object_set(valve, "drop", !gate_open, NULL);
+    g_mutex_unlock(&gate_lock);
+    return valve;
+}
+
+/** with gate_lock. */
+static void set_encoder_gate(gboolean open) {
+    gint64 now = g_get_monotonic_time();
+    gdouble cpu = get_process_cpu_seconds();
+    gdouble seconds = (now - gate_since) / (gdouble)G_USEC_PER_SEC;
+
+    if (open == gate_open || !config_data.encoder_idle)
+        return;
+    if (gate_since != 0) {
+        gate_seconds[gate_open] += seconds;
+        gate_cpu_seconds[gate_open] += cpu - gate_since_cpu;
+        gst_print("encoder %s after %.1f s %s at %.1f%% cpu, idle %.1f%% / active %.1f%% cpu in total\n",
+                  open ? "resumes" : "idles", seconds, gate_open ? "active" : "idle",
+                  seconds > 0 ? (cpu - gate_since_cpu) * 100 / seconds : 0,
+                  gate_seconds[0] > 0 ? gate_cpu_seconds[0] * 100 / gate_seconds[0] : 0,
+                  gate_seconds[1] > 0 ? gate_cpu_seconds[1] * 100 / gate_seconds[1] : 0);
+    }
+    gate_since = now;
+    gate_since_cpu = cpu;
+    gate_open = open;
+    for (guint i = 0; gate_valves != NULL && i < gate_valves->len; i++)
+        g_object_set(g_ptr_array_index(gate_valves, i), "drop", !open, NULL);
+    // the cached gop gets old while idle, the first viewer after it waits for the resume keyframe.
+    if (!open) {
+        for (gint i = 0; i < n_renditions; i++)
+            fanout_hub_clear_gop(renditions[i].hub);
+    }
+}
+
+/** a session, recording or sink starts to consume the encoded video. */
+static void encoder_consumer_acquire() {
+    gboolean resume;
+    g_mutex_lock(&gate_lock);
+    resume = gate_consumers++ == 0 && !gate_open;
+    set_encoder_gate(TRUE);
+    g_mutex_unlock(&gate_lock);
+    // the first frames after the gap are no sync point for anybody.
+    if (resume) {
+        for (gint i = 0; i < n_renditions; i++)
+            request_keyframe(&renditions[i], KEYFRAME_RESUME);
+    }
+}
+
+static void encoder_consumer_release() {
+    g_mutex_lock(&gate_lock);
+    if (gate_consumers > 0 && --gate_consumers == 0)
+        set_encoder_gate(FALSE);
+    g_mutex_unlock(&gate_lock);
+}
+
+/**
+ * @brief Regions of interest of the motioncells and facedetect branches in capture pixels.
+ * They are attached as GstVideoRegionOfInterestMeta to the raw frames in front of the live
+ * encoders, vaapi, va and msdk lower the qp inside them by roi_delta_qp, the others ignore them.
+ */
+#define ROI_MAX 32
+#define ROI_HOLD_MS 1000 // a region is kept this long after its last detection.
+
+typedef struct {
+    GQuark type; // face or motion.
+    gint x, y, width, height;
+    gint64 until; // monotonic time.
+} RoiRegion;
+
+static GMutex roi_lock;
+static RoiRegion roi_regions[ROI_MAX];
+static gint n_roi_regions = 0;
+static guint64 roi_frames = 0, roi_tagged_frames = 0;
+
+/** replaces the regions of type by regions. */
+static void set_roi_regions(GQuark type, RoiRegion *regions, gint n) {
+    gint64 until = g_get_monotonic_time() + ROI_HOLD_MS * 1000;
+    gint kept = 0;
+
+    g_mutex_lock(&roi_lock);
+    for (gint i = 0; i < n_roi_regions; i++) {
+        if (roi_regions[i].type != type)
+            roi_regions[kept++] = roi_regions[i];
+    }
+    for (gint i = 0; i < n && kept < ROI_MAX; i++) {
+        roi_regions[kept] = regions[i];
+        roi_regions[kept].type = type;
+        roi_regions[kept++].until = until;
+    }
+    n_roi_regions = kept;
+    g_mutex_unlock(&roi_lock);
+}
+
+/** one region per row of motion cells, from the first to the last moving column. */
+static gint get_motion_regions(GstElement *motioncells, const gchar *indices, RoiRegion *regions) {
+    gint gridx = 10, gridy = 10;
+    gint first[ROI_MAX], last[ROI_MAX];
+    gchar **cells;
+    gint n = 0;
+
+    g_object_get(motioncells, "gridx", &gridx, "gridy", &gridy, NULL);
+    gridy = MIN(gridy, ROI_MAX);
+    for (gint i = 0; i < gridy; i++)
+        first[i] = -1;
+    cells = g_strsplit(indices, ",", -1);
+    for (gchar **cell = cells; *cell != NULL; cell++) {
+        gint line, column;
+        if (sscanf(*cell, "%d:%d", &line, &column) != 2 || line < 0 || line >= gridy)
+            continue;
+        if (first[line] < 0) {
+            first[line] = last[line] = column;
+            continue;
+        }
+        first[line] = MIN(first[line], column);
+        last[line] = MAX(last[line], column);
+    }
+    g_strfreev(cells);
+
+    // the grid divides the frame, whatever its size, the cells are taken in capture pixels.
+    for (gint i = 0; i < gridy; i++) {
+        gint cell_width = config_data.v4l2src_data.width / gridx;
+        gint cell_height = config_data.v4l2src_data.height / gridy;
+        if (first[i] < 0)
+            continue;
+        regions[n++] = (RoiRegion){0, first[i] * cell_width, i * cell_height,
+                                   (last[i] - first[i] + 1) * cell_width, cell_height};
+    }
+    return n;
+}
+
+/** size and rate of the stream the opencv branches analyse, the capture without shared_convert. */
+static void get_analysis_size(gint *width, gint *height, gint *framerate) {
+    gint capture_width = config_data.v4l2src_data.width;
+    gint capture_height = config_data.v4l2src_data.height;
+
+    *width = capture_width;
+    *height = capture_height;
+    *framerate = config_data.v4l2src_data.framerate;
+#if !defined(HAS_JETSON_NANO)
+    if (!config_data.shared_convert || capture_width <= 0 || capture_height <= 0)
+        return;
+    // the dimension not set follows the aspect of the capture.
+    if (config_data.analysis.width > 0)
+        *width = MIN(config_data.analysis.width, capture_width) & ~1;
+    if (config_data.analysis.height > 0)
+        *height = MIN(config_data.analysis.height, capture_height) & ~1;
+    if (config_data.analysis.width > 0 && config_data.analysis.height <= 0)
+        *height = (gint)((gint64)capture_height * *width / capture_width) & ~1;
+    else if (config_data.analysis.height > 0 && config_data.analysis.width <= 0)
+        *width = (gint)((gint64)capture_width * *height / capture_height) & ~1;
+    if (config_data.analysis.framerate > 0)
+        *framerate = MIN(config_data.analysis.framerate, *framerate);
+#endif
+}
+
+static void on_analytics_message(GstBus *bus, GstMessage *message, gpointer user_data) {
+    const GstStructure *structure = gst_message_get_structure(message);
+    RoiRegion regions[ROI_MAX];
+    gint n = 0;
+
+    if (structure == NULL)
+        return;
+    if (gst_structure_has_name(structure, "facedetect")) {
+        const GValue *faces = gst_structure_get_value(structure, "faces");
+        gint width, height, framerate;
+        gdouble sx, sy;
+        // the faces are found on the analysis stream, the regions are in capture pixels.
+        get_analysis_size(&width, &height, &framerate);
+        sx = (gdouble)config_data.v4l2src_data.width / width;
+        sy = (gdouble)config_data.v4l2src_data.height / height;
+        for (guint i = 0; faces != NULL && i < gst_value_list_get_size(faces) && n < ROI_MAX; i++) {
+            const GstStructure *face = gst_value_get_structure(gst_value_list_get_value(faces, i));
+            guint x, y, w, h;
+            if (gst_structure_get_uint(face, "x", &x) && gst_structure_get_uint(face, "y", &y) &&
+                gst_structure_get_uint(face, "width", &w) && gst_structure_get_uint(face, "height", &h))
+                regions[n++] = (RoiRegion){0, x * sx, y * sy, w * sx, h * sy};
+        }
+        set_roi_regions(g_quark_from_static_string("face"), regions, n);
+    } else if (gst_structure_has_name(structure, "motion")) {
+        const gchar *indices = gst_structure_get_string(structure, "motion_cells_indices");
+        if (indices != NULL && !gst_structure_has_field(structure, "motion_finished"))
+            n = get_motion_regions(GST_ELEMENT(GST_MESSAGE_SRC(message)), indices, regions);
+        set_roi_regions(g_quark_from_static_string("motion"), regions, n);
+    }
+}
+
+/** the analytics post their results on the bus of the pipeline, read in the streaming threads. */
+static void watch_analytics_regions() {
+    GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+    gst_bus_enable_sync_message_emission(bus);
+    g_signal_connect(bus, "sync-message::element", G_CALLBACK(on_analytics_message), NULL);
+    gst_object_unref(bus);
+}
+
+/** tags the frame with the current regions, scaled to the size of the rendition. */
+static GstPadProbeReturn roi_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    Rendition *rendition = (Rendition *)user_data;
+    gint64 now = g_get_monotonic_time();
+    gdouble sx, sy;
+    GstBuffer *buffer = NULL;
+
+    g_mutex_lock(&rendition_lock);
+    sx = (gdouble)rendition->width / config_data.v4l2src_data.width;
+    sy = (gdouble)rendition->height / config_data.v4l2src_data.height;
+    g_mutex_unlock(&rendition_lock);
+
+    g_mutex_lock(&roi_lock);
+    for (gint i = 0; i < n_roi_regions; i++) {
+        RoiRegion *region = &roi_regions[i];
+        GstVideoRegionOfInterestMeta *meta;
+        if (region->until < now)
+            continue;
+        if (buffer == NULL) {
+            // the frame is shared by the tee, the copy only refs its memory.
+            buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+            GST_PAD_PROBE_INFO_DATA(info) = buffer;
+        }
+        meta = gst_buffer_add_video_region_of_interest_meta_id(buffer, region->type,
+                                                                region->x * sx, region->y * sy,
+                                                                region->width * sx, region->height * sy);
+        gst_video_region_of_interest_meta_add_param(meta, gst_structure_new("roi/vaapi", "delta-qp", G_TYPE_INT, config_data.roi_delta_qp, NULL));
+        gst_video_region_of_interest_meta_add_param(meta, gst_structure_new("roi/va", "delta-qp", G_TYPE_INT, config_data.roi_delta_qp, NULL));
+        gst_video_region_of_interest_meta_add_param(meta, gst_structure_new("roi/msdk", "delta-qp", G_TYPE_INT, config_data.roi_delta_qp, NULL));
+    }
+    if (rendition == &renditions[0]) {
+        roi_frames++;
+        roi_tagged_frames += buffer != NULL;
+    }
+    g_mutex_unlock(&roi_lock);
+    return GST_PAD_PROBE_OK;
+}
+
+static void watch_encoder_roi(GstElement *encoder, Rendition *rendition) {
+    GstPad *pad;
+    if (config_data.roi_delta_qp == 0)
+        return;
+    pad = gst_element_get_static_pad(encoder, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, roi_probe, rendition, NULL);
+    gst_object_unref(pad);
+}
+
+static void report_roi() {
+    if (config_data.roi_delta_qp == 0)
+        return;
+    g_mutex_lock(&roi_lock);
+    gst_print("roi: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " frames tagged (%.1f%%), %d regions\n",
+              roi_tagged_frames, roi_frames, roi_frames ? roi_tagged_frames * 100.0 / roi_frames : 0,
+              n_roi_regions);
+    g_mutex_unlock(&roi_lock);
+}
+
 #define MAKE_ELEMENT_AND_ADD(elem, name)                          \
     G_STMT_START {                                                \
         GstElement *_elem = gst_element_factory_make(name, NULL); \
@@ -262,23 +682,284 @@ static const gchar *get_link_error(GstPadLinkReturn ret) {
     return types[type];
 }
 
+// "msdk%senc", may occur follow errror.
+// msdkenc gstmsdkenc.c:673:gst_msdkenc_init_encoder:<msdkvp9enc0> Video Encode Query failed (undeveloped feature)
+static gchar *hw_enc[] = {
+    "va%slpenc", // VA-API H.265 Low Power Encoder in Intel(R) Gen Graphics
+    "va%senc",
+    "vaapi%senc",
+    "qsv%senc",
+    "nvv4l2%senc",
+    "v4l2%senc",
+    "omx%senc"};
+
+static gchar *sf_enc[] = {
+    "%senc",
+    "avenc_%s_omx",
+    "open%senc"};
+
+// av1 software encoders by real-time speed, av1enc is libaom.
+static gchar *av1_sf_enc[] = {
+    "svtav1enc",
+    "rav1enc",
+    "av1enc"};
+
+// the order of get_hardware_h264_encoder, which sets the properties of each of them.
+static const gchar *h264_enc[] = {
+    "vah264lpenc",
+    "vaapih264enc",
+    "nvh264enc",
+    "nvcudah264enc",
+    "nvv4l2h264enc",
+    "v4l2h264enc",
+    "x264enc"};
+
+#define ENCODER_PROBE_TIMEOUT (10 * GST_SECOND)
+
+typedef struct {
+    GstClockTime *in_time; // by frame number, 0 is not pending.
+    guint frames;
+    gint fps;
+    guint64 latency_sum;
+    guint64 latency_max;
+    guint outputs;
+} ProbeTiming;
+
+typedef struct {
+    gboolean ok;
+    gdouble fps;
+    gdouble latency_ms;
+} EncoderScore;
+
+// codec -> best encoder factory of this run, "" if the probe found none.
+static GHashTable *probed_encoders = NULL;
+
+static gboolean factory_exists(const gchar *name) {
+    GstElementFactory *factory = gst_element_factory_find(name);
+    if (factory == NULL)
+        return FALSE;
+    gst_object_unref(factory);
+    return TRUE;
+}
+
+static GPtrArray *get_encoder_candidates(const gchar *codec) {
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *all = g_ptr_array_new_with_free_func(g_free);
+
+    if (g_str_has_prefix(codec, "h264")) {
+        for (int i = 0; i < G_N_ELEMENTS(h264_enc); i++)
+            g_ptr_array_add(all, g_strdup(h264_enc[i]));
+    } else {
+        for (int i = 0; i < G_N_ELEMENTS(hw_enc); i++)
+            g_ptr_array_add(all, g_strdup_printf(hw_enc[i], codec));
+        if (g_str_has_prefix(codec, "h26")) {
+            gchar *tmp = g_strdup_printf("%senc", codec);
+            tmp[0] = 'x';
+            g_ptr_array_add(all, tmp);
+        }
+        if (!g_strcmp0(codec, "av1")) {
+            for (int i = 0; i < G_N_ELEMENTS(av1_sf_enc); i++)
+                g_ptr_array_add(all, g_strdup(av1_sf_enc[i]));
+        } else {
+            for (int i = 0; i < G_N_ELEMENTS(sf_enc); i++)
+                g_ptr_array_add(all, g_strdup_printf(sf_enc[i], codec));
+        }
+    }
+    for (guint i = 0; i < all->len; i++) {
+        const gchar *name = g_ptr_array_index(all, i);
+        if (factory_exists(name))
+            g_ptr_array_add(names, g_strdup(name));
+    }
+    g_ptr_array_unref(all);
+    return names;
+}
+
+/** @brief "1.22.0;x264enc:1.22.0;...", a plugin update invalidates the cached probe. */
+static gchar *get_encoder_signature(GPtrArray *candidates) {
+    GString *sig = g_string_new(NULL);
+    gchar *version = gst_version_string();
+    g_string_append(sig, version);
+    g_free(version);
+    for (guint i = 0; i < candidates->len; i++) {
+        const gchar *name = g_ptr_array_index(candidates, i);
+        GstElementFactory *factory = gst_element_factory_find(name);
+        GstPlugin *plugin = gst_plugin_feature_get_plugin(GST_PLUGIN_FEATURE(factory));
+        g_string_append_printf(sig, ";%s:%s", name, plugin ? gst_plugin_get_version(plugin) : "");
+        if (plugin)
+            gst_object_unref(plugin);
+        gst_object_unref(factory);
+    }
+    return g_string_free(sig, FALSE);
+}
+
+static GstPadProbeReturn probe_encoder_in(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    ProbeTiming *timing = (ProbeTiming *)user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    guint64 index;
+    if (!GST_BUFFER_PTS_IS_VALID(buffer))
+        return GST_PAD_PROBE_OK;
+    index = gst_util_uint64_scale_round(GST_BUFFER_PTS(buffer), timing->fps, GST_SECOND);
+    if (index < timing->frames)
+        timing->in_time[index] = gst_util_get_timestamp();
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn probe_encoder_out(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    ProbeTiming *timing = (ProbeTiming *)user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    guint64 index;
+    if (!GST_BUFFER_PTS_IS_VALID(buffer))
+        return GST_PAD_PROBE_OK;
+    index = gst_util_uint64_scale_round(GST_BUFFER_PTS(buffer), timing->fps, GST_SECOND);
+    if (index < timing->frames && timing->in_time[index] != 0) {
+        GstClockTime latency = gst_util_get_timestamp() - timing->in_time[index];
+        timing->latency_sum += latency;
+        timing->latency_max = MAX(timing->latency_max, latency);
+        timing->in_time[index] = 0;
+        timing->outputs++;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/**
+ * @brief Encode two seconds of videotestsrc as fast as possible, an encoder that fails,
+ * times out or loses more than half of the frames is not ok.
+ */
+static EncoderScore probe_encoder(const gchar *name, gint width, gint height, gint fps) {
+    EncoderScore score = {FALSE, 0, 0};
+    ProbeTiming timing = {0};
+    GError *error = NULL;
+    GstElement *pipe, *encoder;
+    GstPad *pad;
+    GstBus *bus;
+    GstMessage *msg;
+    GstClockTime start;
+    gchar *desc;
+
+    timing.fps = fps;
+    timing.frames = MAX(fps * 2, 30);
+    desc = g_strdup_printf("videotestsrc num-buffers=%u pattern=ball ! video/x-raw,width=%d,height=%d,framerate=%d/1 ! "
+                           "%s ! %s name=enc ! fakesink sync=false",
+                           timing.frames, width, height, fps,
+                           g_str_has_prefix(name, "nvv4l2") ? "nvvidconv ! video/x-raw(memory:NVMM)" : "videoconvert", name);
+    pipe = gst_parse_launch(desc, &error);
+    g_free(desc);
+    if (error != NULL) {
+        g_print("probe %s: %s\n", name, error->message);
+        g_error_free(error);
+        if (pipe)
+            gst_object_unref(pipe);
+        return score;
+    }
+    timing.in_time = g_new0(GstClockTime, timing.frames);
+    encoder = gst_bin_get_by_name(GST_BIN(pipe), "enc");
+    pad = gst_element_get_static_pad(encoder, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, probe_encoder_in, &timing, NULL);
+    gst_object_unref(pad);
+    pad = gst_element_get_static_pad(encoder, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, probe_encoder_out, &timing, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(encoder);
+
+    bus = gst_element_get_bus(pipe);
+    start = gst_util_get_timestamp();
+    gst_element_set_state(pipe, GST_STATE_PLAYING);
+    msg = gst_bus_timed_pop_filtered(bus, ENCODER_PROBE_TIMEOUT, GST_MESSAGE_ERROR | GST_MESSAGE_EOS);
+    if (msg != NULL && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS && timing.outputs >= timing.frames / 2) {
+        score.ok = TRUE;
+        score.fps = timing.outputs * (gdouble)GST_SECOND / (gst_util_get_timestamp() - start);
+        score.latency_ms = (gdouble)timing.latency_sum / timing.outputs / GST_MSECOND;
+    }
+    if (msg != NULL)
+        gst_message_unref(msg);
+    gst_element_set_state(pipe, GST_STATE_NULL);
+    gst_object_unref(bus);
+    gst_object_unref(pipe);
+    g_free(timing.in_time);
+    return score;
+}
+
+/**
+ * @brief The fastest working encoder of codec at the capture size, probed once and cached in
+ * ~/.config/gwc/encoders.ini until the gstreamer or an encoder plugin version changes.
+ * NULL if the probe is off or no candidate works, the callers fall back to their fixed order.
+ */
+static const gchar *get_probed_encoder_name(const gchar *codec) {
+    GKeyFile *cache;
+    GPtrArray *candidates;
+    gchar *path, *group, *signature, *cached_sig, *best = NULL;
+    gint width = config_data.v4l2src_data.width > 0 ? config_data.v4l2src_data.width : 1280;
+    gint height = config_data.v4l2src_data.height > 0 ? config_data.v4l2src_data.height : 720;
+    gint fps = config_data.v4l2src_data.framerate > 0 ? config_data.v4l2src_data.framerate : 30;
+    gdouble best_fps = 0;
+    const gchar *ret;
+
+    if (!config_data.encoder_probe)
+        return NULL;
+    if (probed_encoders == NULL)
+        probed_encoders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    ret = g_hash_table_lookup(probed_encoders, codec);
+    if (ret != NULL)
+        return ret[0] ? ret : NULL;
+
+    candidates = get_encoder_candidates(codec);
+    signature = get_encoder_signature(candidates);
+    group = g_strdup_printf("%s %dx%d@%d", codec, width, height, fps);
+    path = g_build_filename(g_get_user_config_dir(), "gwc", "encoders.ini", NULL);
+    cache = g_key_file_new();
+    g_key_file_load_from_file(cache, path, G_KEY_FILE_KEEP_COMMENTS, NULL);
+
+    cached_sig = g_key_file_get_string(cache, group, "signature", NULL);
+    if (!g_strcmp0(cached_sig, signature)) {
+        best = g_key_file_get_string(cache, group, "best", NULL);
+        g_print("video encoder from %s: %s\n", path, best && best[0] ? best : "none");
+    } else {
+        g_print("probing %u %s encoders at %dx%d@%d\n", candidates->len, codec, width, height, fps);
+        g_key_file_remove_group(cache, group, NULL);
+        g_key_file_set_string(cache, group, "signature", signature);
+        for (guint i = 0; i < candidates->len; i++) {
+            const gchar *name = g_ptr_array_index(candidates, i);
+            EncoderScore score = probe_encoder(name, width, height, fps);
+            gchar *value = g_strdup_printf("%s;%.1f;%.2f", score.ok ? "ok" : "failed", score.fps, score.latency_ms);
+            g_print("  %-16s %-6s %7.1f fps %7.2f ms\n", name, score.ok ? "ok" : "failed", score.fps, score.latency_ms);
+            g_key_file_set_string(cache, group, name, value);
+            g_free(value);
+            if (score.ok && score.fps > best_fps) {
+                best_fps = score.fps;
+                g_free(best);
+                best = g_strdup(name);
+            }
+        }
+        g_key_file_set_comment(cache, group, NULL, " encoder=ok|failed;fps;latency ms", NULL);
+        g_key_file_set_string(cache, group, "best", best ? best : "");
+        gchar *dir = g_path_get_dirname(path);
+        g_mkdir_with_parents(dir, 0755);
+        g_free(dir);
+        if (!g_key_file_save_to_file(cache, path, NULL))
+            g_print("failed to save the encoder probe to %s\n", path);
+    }
+    // a cached encoder may be gone since.
+    if (best != NULL && best[0] && !factory_exists(best)) {
+        g_free(best);
+        best = NULL;
+    }
+    g_hash_table_insert(probed_encoders, g_strdup(codec), best ? best : g_strdup(""));
+
+    g_free(cached_sig);
+    g_free(signature);
+    g_free(group);
+    g_free(path);
+    g_key_file_free(cache);
+    g_ptr_array_unref(candidates);
+    ret = g_hash_table_lookup(probed_encoders, codec);
+    return ret[0] ? ret : NULL;
+}
+
 static gchar *get_best_code_name(const gchar *name) {
     gchar *tmp = NULL;
-    // "msdk%senc", may occur follow errror.
-    // msdkenc gstmsdkenc.c:673:gst_msdkenc_init_encoder:<msdkvp9enc0> Video Encode Query failed (undeveloped feature)
-    static gchar *hw_enc[] = {
-        "va%slpenc", // VA-API H.265 Low Power Encoder in Intel(R) Gen Graphics
-        "va%senc",
-        "vaapi%senc",
-        "qsv%senc",
-        "nvv4l2%senc",
-        "v4l2%enc",
-        "omx%senc"};
-
-    static gchar *sf_enc[] = {
-        "%senc",
-        "avenc_%s_omx",
-        "open%senc"};
+    const gchar *probed = get_probed_encoder_name(name);
+    if (probed != NULL)
+        return g_strdup(probed);
 
     for (int i = 0; i < sizeof(hw_enc) / sizeof(gchar *); i++) {
         tmp = g_strdup_printf(hw_enc[i], name);
@@ -295,6 +976,14 @@ static gchar *get_best_code_name(const gchar *name) {
         }
     }
 
+    if (!g_strcmp0(name, "av1")) {
+        for (int i = 0; i < G_N_ELEMENTS(av1_sf_enc); i++) {
+            if (factory_exists(av1_sf_enc[i]))
+                return g_strdup(av1_sf_enc[i]);
+        }
+        return NULL;
+    }
+
     for (int i = 0; i < sizeof(sf_enc) / sizeof(gchar *); i++) {
         tmp = g_strdup_printf(sf_enc[i], name);
         if (gst_element_factory_find(tmp)) {
@@ -370,20 +1059,355 @@ static GstElement *get_nvbin() {
 }
 #endif
 
+// bits per pixel of h264 at 720p30, check it against your scenes with bitrate-bench.sh.
+#define BITRATE_BPP 0.045
+#define BITRATE_MIN 100000
+
+typedef struct {
+    const gchar *codec;
+    gdouble efficiency; // bitrate relative to h264 at the same quality.
+} CodecEfficiency;
+
+static const CodecEfficiency codec_efficiency[] = {
+    {"h264", 1.0},
+    {"h265", 0.65},
+    {"vp8", 1.1},
+    {"vp9", 0.7},
+    {"av1", 0.55}};
+
+/**
+ * @brief The bitrate of codec at any size and rate. Bigger frames need fewer bits per pixel
+ * and the bits per second grow slower than the frame rate, because the frames are more alike.
+ */
+static guint get_model_bitrate(const gchar *codec, gint width, gint height, gint fps) {
+    gdouble pixels = (gdouble)MAX(width, 16) * MAX(height, 16);
+    gdouble efficiency = 1.0;
+    gdouble bps;
+
+    fps = fps > 0 ? fps : 30;
+    for (int i = 0; i < G_N_ELEMENTS(codec_efficiency); i++) {
+        if (g_str_has_prefix(codec, codec_efficiency[i].codec)) {
+            efficiency = codec_efficiency[i].efficiency;
+            break;
+        }
+    }
+    bps = BITRATE_BPP * pixels * pow(pixels / (1280 * 720), -0.15) * 30 * pow(fps / 30.0, 0.75) * efficiency;
+    return MAX((guint)bps, BITRATE_MIN);
+}
+
+/** the configured bitrate, otherwise the model for the capture size of the configured codec. */
 static guint get_exact_bitrate() {
-    guint bitrate = 8000;
-    if (config_data.v4l2src_data.height == 1080) {
-        if (config_data.v4l2src_data.framerate >= 60)
-            bitrate = 4000000;
-        else
-            bitrate = 3000000;
-    } else if (config_data.v4l2src_data.height == 720) {
-        if (config_data.v4l2src_data.framerate >= 60)
-            bitrate = 1380000;
-        else
-            bitrate = 1000000;
+    if (config_data.bitrate > 0)
+        return config_data.bitrate;
+    return get_model_bitrate(config_data.videnc, config_data.v4l2src_data.width,
+                             config_data.v4l2src_data.height, config_data.v4l2src_data.framerate);
+}
+
+/**
+ * @brief Constant quality instead of a bitrate, quality is the CRF of x264enc and svtav1enc,
+ * the cq-level of vpxenc and the QP of the others. FALSE if the encoder has no such mode, it keeps the bitrate.
+ */
+static gboolean set_encoder_quality(GstElement *encoder, gint quality) {
+    const gchar *name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(gst_element_get_factory(encoder)));
+
+    if (!g_strcmp0(name, "x264enc")) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "pass", "qual");
+        g_object_set(encoder, "quantizer", quality, NULL);
+    } else if (!g_strcmp0(name, "x265enc")) {
+        g_object_set(encoder, "qp", quality, NULL);
+    } else if (!g_strcmp0(name, "vp8enc") || !g_strcmp0(name, "vp9enc")) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "end-usage", "cq");
+        g_object_set(encoder, "cq-level", quality, NULL);
+    } else if (g_str_has_prefix(name, "vaapi")) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "rate-control", "cqp");
+        g_object_set(encoder, "init-qp", quality, NULL);
+    } else if (g_str_has_prefix(name, "va")) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "rate-control", "cqp");
+        g_object_set(encoder, "qpi", quality, "qpp", quality, "qpb", quality, NULL);
+    } else if (g_str_has_prefix(name, "qsv")) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "rate-control", "cqp");
+        g_object_set(encoder, "qp-i", quality, "qp-p", quality, "qp-b", quality, NULL);
+    } else if (!g_strcmp0(name, "nvh264enc") || !g_strcmp0(name, "nvh265enc")) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "rc-mode", "constqp");
+        g_object_set(encoder, "qp-const", quality, NULL);
+    } else if (!g_strcmp0(name, "svtav1enc")) {
+        g_object_set(encoder, "crf", quality, NULL);
+    } else if (!g_strcmp0(name, "rav1enc")) {
+        g_object_set(encoder, "quantizer", quality, NULL);
+    } else {
+        g_print("%s has no constant quality mode, keep %u bps\n", name, get_exact_bitrate());
+        return FALSE;
+    }
+    // the congestion control leaves the bitrate of this encoder alone.
+    g_object_set_data(G_OBJECT(encoder), "quality", GINT_TO_POINTER(quality));
+    g_print("%s constant quality %d\n", name, quality);
+    return TRUE;
+}
+
+static void set_encoder_bitrate(GstElement *encoder, guint bps);
+
+#define LOWLATENCY_MAX_THREADS 8
+#define LOWLATENCY_CHECK_SECONDS 2
+
+/**
+ * @brief The low latency profile of the software encoders: no b-frames and no lookahead,
+ * the threads work on slices of one frame instead of on several frames, a keyframe every
+ * two seconds and a rate control buffer of a few frames.
+ */
+static void set_software_lowlatency(GstElement *encoder, gint fps) {
+    const gchar *name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(gst_element_get_factory(encoder)));
+    guint threads = CLAMP(g_get_num_processors(), 1, LOWLATENCY_MAX_THREADS);
+    guint gop;
+    gchar *options;
+
+    fps = fps > 0 ? fps : 30;
+    gop = fps * 2;
+    if (!g_strcmp0(name, "x264enc")) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "speed-preset", "faster");
+        gst_util_set_object_arg(G_OBJECT(encoder), "tune", "zerolatency");
+        g_object_set(encoder, "threads", threads, "sliced-threads", TRUE, "key-int-max", gop,
+                     "bframes", 0, "rc-lookahead", 0, "vbv-buf-capacity", 3 * 1000 / fps, NULL);
+    } else if (!g_strcmp0(name, "vp8enc") || !g_strcmp0(name, "vp9enc")) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "end-usage", "cbr");
+        g_object_set(encoder, "deadline", (gint64)1, "lag-in-frames", 0, "threads", threads,
+                     "keyframe-max-dist", gop, "buffer-size", 3 * 1000 / fps,
+                     "buffer-initial-size", 2 * 1000 / fps, "buffer-optimal-size", 2 * 1000 / fps, NULL);
+        if (!g_strcmp0(name, "vp9enc")) {
+            // a tile column is at least 256 pixels wide.
+            g_object_set(encoder, "cpu-used", 7, "row-mt", TRUE,
+                         "tile-columns", MIN(g_bit_storage(threads) - 1, 2), NULL);
+        } else {
+            g_object_set(encoder, "cpu-used", 8, "token-partitions", MIN(g_bit_storage(threads) - 1, 3), NULL);
+        }
+    } else if (!g_strcmp0(name, "x265enc")) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "speed-preset", "superfast");
+        gst_util_set_object_arg(G_OBJECT(encoder), "tune", "zerolatency");
+        // set_encoder_bitrate adds the vbv of the bitrate.
+        options = g_strdup_printf("bframes=0:rc-lookahead=0:frame-threads=1:pools=%u:slices=%u", threads, threads);
+        g_object_set(encoder, "key-int-max", gop, "option-string", options, NULL);
+        g_free(options);
+    } else if (!g_strcmp0(name, "svtav1enc")) {
+        // preset 10 and up are the real-time presets, pred-struct 1 is low delay without b-frames.
+        g_object_set(encoder, "preset", 10, "intra-period-length", gop - 1, "logical-processors", threads,
+                     "parameters-string", "pred-struct=1", NULL);
+    } else if (!g_strcmp0(name, "rav1enc")) {
+        g_object_set(encoder, "speed-preset", 10, "low-latency", TRUE, "max-key-frame-interval", (guint64)gop,
+                     "threads", threads, "tiles", threads, NULL);
+    } else if (!g_strcmp0(name, "av1enc")) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "usage-profile", "realtime");
+        gst_util_set_object_arg(G_OBJECT(encoder), "end-usage", "cbr");
+        g_object_set(encoder, "cpu-used", 8, "lag-in-frames", 0, "threads", threads, "row-mt", TRUE,
+                     "tile-columns", MIN(g_bit_storage(threads) - 1, 2), "keyframe-max-dist", gop,
+                     "buf-sz", 3 * 1000 / fps, "buf-initial-sz", 2 * 1000 / fps, "buf-optimal-sz", 2 * 1000 / fps, NULL);
+    } else {
+        return;
+    }
+    g_print("%s low latency profile, %u threads, keyframe every %u frames\n", name, threads, gop);
+}
+
+/**
+ * @brief Glass to glass latency of the low latency profile of name, a live videotestsrc goes
+ * through the encoder and a decoder, avg and max are the ms from the source to the sink.
+ */
+static gboolean measure_lowlatency(const gchar *name, gint width, gint height, gint fps, gdouble *avg, gdouble *max) {
+    ProbeTiming timing = {0};
+    GError *error = NULL;
+    GstElement *pipe, *element;
+    GstPad *pad;
+    GstBus *bus;
+    GstMessage *msg;
+    guint frames = fps * LOWLATENCY_CHECK_SECONDS;
+    gboolean ok = FALSE;
+    gchar *desc;
+
+    desc = g_strdup_printf("videotestsrc name=src is-live=true num-buffers=%u pattern=ball ! "
+                           "video/x-raw,width=%d,height=%d,framerate=%d/1 ! videoconvert ! %s name=enc ! "
+                           "decodebin ! fakesink name=sink sync=false",
+                           frames, width, height, fps, name);
+    pipe = gst_parse_launch(desc, &error);
+    g_free(desc);
+    if (error != NULL) {
+        g_print("latency check of %s: %s\n", name, error->message);
+        g_error_free(error);
+        if (pipe)
+            gst_object_unref(pipe);
+        return FALSE;
+    }
+    element = gst_bin_get_by_name(GST_BIN(pipe), "enc");
+    set_software_lowlatency(element, fps);
+    set_encoder_bitrate(element, get_exact_bitrate());
+    gst_object_unref(element);
+
+    // live pts start at the running time of the first frame, leave room for it.
+    timing.fps = fps;
+    timing.frames = frames * 2;
+    timing.in_time = g_new0(GstClockTime, timing.frames);
+    element = gst_bin_get_by_name(GST_BIN(pipe), "src");
+    pad = gst_element_get_static_pad(element, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, probe_encoder_in, &timing, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(element);
+    element = gst_bin_get_by_name(GST_BIN(pipe), "sink");
+    pad = gst_element_get_static_pad(element, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, probe_encoder_out, &timing, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(element);
+
+    bus = gst_element_get_bus(pipe);
+    gst_element_set_state(pipe, GST_STATE_PLAYING);
+    msg = gst_bus_timed_pop_filtered(bus, LOWLATENCY_CHECK_SECONDS * GST_SECOND + ENCODER_PROBE_TIMEOUT,
+                                     GST_MESSAGE_ERROR | GST_MESSAGE_EOS);
+    if (msg != NULL && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS && timing.outputs > 0) {
+        *avg = (gdouble)timing.latency_sum / timing.outputs / GST_MSECOND;
+        *max = (gdouble)timing.latency_max / GST_MSECOND;
+        ok = TRUE;
     }
-    return bitrate;
+    if (msg != NULL)
+        gst_message_unref(msg);
+    gst_element_set_state(pipe, GST_STATE_NULL);
+    gst_object_unref(bus);
+    gst_object_unref(pipe);
+    g_free(timing.in_time);
+    return ok;
+}
+
+/**
+ * @brief The latency of the low latency profile of name at the capture size against the frame
+ * interval. Measured once with encoder_probe on and cached next to the encoder probe in
+ * ~/.config/gwc/encoders.ini until the gstreamer or the encoder plugin version changes.
+ */
+static void check_lowlatency(const gchar *name) {
+    static GHashTable *checked = NULL;
+    gint width = config_data.v4l2src_data.width > 0 ? config_data.v4l2src_data.width : 1280;
+    gint height = config_data.v4l2src_data.height > 0 ? config_data.v4l2src_data.height : 720;
+    gint fps = config_data.v4l2src_data.framerate > 0 ? config_data.v4l2src_data.framerate : 30;
+    GPtrArray *candidates;
+    GKeyFile *cache;
+    gchar *path, *group, *signature, *cached_sig, *result = NULL;
+    gdouble avg = 0, max = 0;
+
+    if (!config_data.encoder_probe)
+        return;
+    if (checked == NULL)
+        checked = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    if (!g_hash_table_add(checked, g_strdup(name)))
+        return;
+
+    candidates = g_ptr_array_new();
+    g_ptr_array_add(candidates, (gpointer)name);
+    signature = get_encoder_signature(candidates);
+    g_ptr_array_unref(candidates);
+    group = g_strdup_printf("lowlatency %s %dx%d@%d", name, width, height, fps);
+    path = g_build_filename(g_get_user_config_dir(), "gwc", "encoders.ini", NULL);
+    cache = g_key_file_new();
+    g_key_file_load_from_file(cache, path, G_KEY_FILE_KEEP_COMMENTS, NULL);
+
+    cached_sig = g_key_file_get_string(cache, group, "signature", NULL);
+    if (!g_strcmp0(cached_sig, signature))
+        result = g_key_file_get_string(cache, group, "latency", NULL);
+    if (result == NULL) {
+        result = measure_lowlatency(name, width, height, fps, &avg, &max) ? g_strdup_printf("%.1f;%.1f", avg, max)
+                                                                           : g_strdup("failed");
+        g_key_file_set_string(cache, group, "signature", signature);
+        g_key_file_set_string(cache, group, "latency", result);
+        g_key_file_set_comment(cache, group, NULL, " latency=avg ms;max ms|failed", NULL);
+        gchar *dir = g_path_get_dirname(path);
+        g_mkdir_with_parents(dir, 0755);
+        g_free(dir);
+        if (!g_key_file_save_to_file(cache, path, NULL))
+            g_print("failed to save the latency check to %s\n", path);
+    } else if (g_strcmp0(result, "failed")) {
+        sscanf(result, "%lf;%lf", &avg, &max);
+    }
+
+    if (!g_strcmp0(result, "failed"))
+        g_print("latency check of %s failed\n", name);
+    else
+        g_print("%s glass to glass %.1f ms avg, %.1f ms max, frame interval %.1f ms%s\n", name, avg, max,
+                1000.0 / fps, avg > 1000.0 / fps ? ", the encoder can not keep up" : "");
+
+    g_free(result);
+    g_free(cached_sig);
+    g_free(signature);
+    g_free(group);
+    g_free(path);
+    g_key_file_free(cache);
+}
+
+/** the low latency profile of the software encoders, checked against the frame interval. */
+static void set_lowlatency_profile(GstElement *encoder) {
+    const gchar *name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(gst_element_get_factory(encoder)));
+    if (g_strcmp0(name, "x264enc") && g_strcmp0(name, "x265enc") && g_strcmp0(name, "vp8enc") &&
+        g_strcmp0(name, "vp9enc") && g_strcmp0(name, "svtav1enc") && g_strcmp0(name, "rav1enc") &&
+        g_strcmp0(name, "av1enc"))
+        return;
+    check_lowlatency(name);
+    set_software_lowlatency(encoder, config_data.v4l2src_data.framerate);
+}
+
+/**
+ * @brief Refresh a column of intra blocks in every frame instead of sending periodic keyframes,
+ * so there are no keyframe bursts. A forced key unit then only starts a new refresh cycle
+ * on x264enc instead of an IDR, see check_intra_refresh.
+ */
+static gboolean set_intra_refresh(GstElement *encoder) {
+    GObjectClass *klass = G_OBJECT_GET_CLASS(encoder);
+    const gchar *name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(gst_element_get_factory(encoder)));
+    gint fps = config_data.v4l2src_data.framerate > 0 ? config_data.v4l2src_data.framerate : 30;
+    // one refresh cycle takes the keyframe interval of the low latency profile.
+    guint period = fps * 2;
+
+    if (!g_strcmp0(name, "x264enc")) {
+        g_object_set(encoder, "intra-refresh", TRUE, "key-int-max", period, NULL);
+    } else if (!g_strcmp0(name, "x265enc")) {
+        gchar *options = NULL, *tmp;
+        g_object_get(encoder, "option-string", &options, NULL);
+        tmp = g_strdup_printf("%s%sintra-refresh=1", options ? options : "", options && options[0] ? ":" : "");
+        g_object_set(encoder, "option-string", tmp, "key-int-max", period, NULL);
+        g_free(tmp);
+        g_free(options);
+    } else if (g_object_class_find_property(klass, "SliceIntraRefreshInterval")) {
+        // nvv4l2 encoders of jetson.
+        g_object_set(encoder, "SliceIntraRefreshInterval", period, NULL);
+    } else {
+        g_print("%s has no intra refresh, keep periodic keyframes\n", name);
+        return FALSE;
+    }
+    g_print("%s intra refresh every %u frames\n", name, period);
+    return TRUE;
+}
+
+/**
+ * @brief Keep periodic keyframes for the consumers which must start on an IDR: the gop cache and
+ * keyframe drops of the appsrc hubs, and the recordings on the shared encoder.
+ */
+static void check_intra_refresh() {
+    const gchar *reason = NULL;
+    gboolean shared = g_str_has_prefix(config_data.videnc, "h264") || g_str_has_prefix(config_data.videnc, "h265");
+
+    if (!config_data.intra_refresh)
+        return;
+    if (config_data.app_sink && config_data.webrtc.keyframe_drop)
+        reason = "the keyframe drop_policy";
+    else if (shared && config_data.splitfile_sink.enable)
+        reason = "splitfile_sink on the shared encoder";
+    else if (shared && config_data.hls_onoff.av_hlssink)
+        reason = "av_hlssink on the shared encoder";
+    if (reason == NULL)
+        return;
+    g_print("intra refresh is off, %s needs keyframes on request%s\n", reason,
+            config_data.app_sink && config_data.webrtc.keyframe_drop ? ", set drop_policy to \"oldest\" for it" : "");
+    config_data.intra_refresh = FALSE;
+}
+
+/** the quality target when configured, else the bitrate for the encoders which got none yet. */
+static void set_encoder_rate(GstElement *encoder, guint bitrate, gboolean has_bitrate) {
+    if (config_data.intra_refresh)
+        set_intra_refresh(encoder);
+    if (config_data.quality > 0 && set_encoder_quality(encoder, config_data.quality))
+        return;
+    if (!has_bitrate)
+        set_encoder_bitrate(encoder, bitrate);
 }
 
 static GstElement *get_hardware_vp89_encoder(const gchar *name) {
@@ -402,12 +1426,36 @@ static GstElement *get_hardware_vp89_encoder(const gchar *name) {
 
     g_print("video encoder: %s\n", encname);
     encoder = gst_element_factory_make(encname, NULL);
+    set_lowlatency_profile(encoder);
     if (g_str_has_prefix(encname, "qsv")) {
         g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000, "low-latency", TRUE, NULL);
     } else if (g_str_has_prefix(encname, "vaapi")) {
         g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000, "rate-control", 4,
                      "quality-level", 1, "trellis", TRUE, "tune", 3, NULL);
     }
+    set_encoder_rate(encoder, bitrate, g_str_has_prefix(encname, "qsv") || g_str_has_prefix(encname, "vaapi"));
+    g_free(encname);
+    gst_bin_add(GST_BIN(pipeline), encoder);
+    return encoder;
+}
+
+/**
+ * @brief va, qsv and nvenc av1 encoders first, then svtav1enc, rav1enc and av1enc (libaom)
+ * with their real-time presets.
+ */
+static GstElement *get_hardware_av1_encoder() {
+    GstElement *encoder;
+    guint bitrate = get_exact_bitrate();
+    gchar *encname = get_best_code_name("av1");
+
+    if (encname == NULL) {
+        g_printerr("Failed to create av1 encoder\n");
+        return NULL;
+    }
+    g_print("video encoder: %s\n", encname);
+    encoder = gst_element_factory_make(encname, NULL);
+    set_lowlatency_profile(encoder);
+    set_encoder_rate(encoder, bitrate, FALSE);
     g_free(encname);
     gst_bin_add(GST_BIN(pipeline), encoder);
     return encoder;
@@ -425,11 +1473,11 @@ static GstElement *get_hardware_h265_encoder() {
         return NULL;
     encoder = gst_element_factory_make(encname, NULL);
     g_print("video encoder: %s\n", encname);
-    if (g_str_has_prefix(encname, "nvv4l2")) {
-        g_object_set(G_OBJECT(encoder), "control-rate", 1, "maxperf-enable", TRUE, "bitrate", bitrate, NULL);
-    } else {
-        g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000, NULL);
-    }
+    set_lowlatency_profile(encoder);
+    if (g_str_has_prefix(encname, "nvv4l2"))
+        g_object_set(G_OBJECT(encoder), "control-rate", 1, "maxperf-enable", TRUE, NULL);
+    // x265enc also takes the vbv of the bitrate.
+    set_encoder_rate(encoder, bitrate, FALSE);
     g_free(encname);
 
     gst_bin_add(GST_BIN(pipeline), encoder);
@@ -454,27 +1502,33 @@ static int child_proc(void) {
 }
 #endif
 
+/** the probed encoder if there is one, otherwise the first available of the fixed order. */
+static gboolean use_encoder(const gchar *probed, const gchar *name) {
+    return probed != NULL ? !g_strcmp0(probed, name) : factory_exists(name);
+}
+
 static GstElement *get_hardware_h264_encoder() {
     GstElement *encoder;
     // child_proc();
     guint bitrate = get_exact_bitrate();
+    const gchar *probed = get_probed_encoder_name("h264");
     // https://www.intel.com/content/www/us/en/developer/articles/technical/gstreamer-vaapi-media-sdk-command-line-examples.html
-    if (gst_element_factory_find("vah264lpenc")) {
+    if (use_encoder(probed, "vah264lpenc")) {
         // VA-API H.264 Low Power Encoder in Intel(R) Gen Graphics
         encoder = gst_element_factory_make("vah264lpenc", NULL);
         g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000,
                      "rate-control", 16, "qpb", 14, "key-int-max", 30, "ref-frames", 1, "b-frames", 2, NULL);
-    } else if (gst_element_factory_find("vaapih264enc")) {
+    } else if (use_encoder(probed, "vaapih264enc")) {
         // VA-API H264 encoder
         encoder = gst_element_factory_make("vaapih264enc", NULL);
         g_object_set(G_OBJECT(encoder), "bitrate", bitrate / 1000, NULL);
-    } else if (gst_element_factory_find("nvh264enc")) {
+    } else if (use_encoder(probed, "nvh264enc")) {
         // NVENC H.264 Video Encoder
         encoder = gst_element_factory_make("nvh264enc", NULL);
-    } else if (gst_element_factory_find("nvcudah264enc")) {
+    } else if (use_encoder(probed, "nvcudah264enc")) {
         // NVENC H.264 Video Encoder CUDA Mode
         encoder = gst_element_factory_make("nvcudah264enc", NULL);
-    } else if (gst_element_factory_find("nvv4l2h264enc")) {
+    } else if (use_encoder(probed, "nvv4l2h264enc")) {
         // https://docs.nvidia.com/jetson/archives/r34.1/DeveloperGuide/text/SD/Multimedia/AcceleratedGstreamer.html#supported-h-264-h-265-vp9-av1-encoder-features-with-gstreamer-1-0
         gchar *drvname = get_video_driver_name(config_data.v4l2src_data.device);
         guint64 nvbitrate = g_strcmp0(drvname, "uvcvideo") ? 12000000 : 800000;
@@ -487,16 +1541,18 @@ static GstElement *get_hardware_h264_encoder() {
                      "vbv-size", 100,
                      "qp-range", "1,51:1,51:1,51",
                      "bitrate", nvbitrate, NULL);
-    } else if (gst_element_factory_find("v4l2h264enc")) {
+    } else if (use_encoder(probed, "v4l2h264enc")) {
         encoder = gst_element_factory_make("v4l2h264enc", NULL);
-    } else if (gst_element_factory_find("x264enc")) {
+    } else if (use_encoder(probed, "x264enc")) {
         encoder = gst_element_factory_make("x264enc", NULL);
-        // g_object_set(G_OBJECT(encoder), "key-int-max", 2, NULL);
-        g_object_set(G_OBJECT(encoder), "speed-preset", 4, "tune", 2, NULL);
+        set_lowlatency_profile(encoder);
     } else {
         g_printerr("Failed to create h264 encoder\n");
         return NULL;
     }
+    // nvv4l2h264enc keeps the bitrate of its driver.
+    set_encoder_rate(encoder, bitrate, g_str_has_prefix(GST_OBJECT_NAME(gst_element_get_factory(encoder)), "va") ||
+                                           g_str_has_prefix(GST_OBJECT_NAME(gst_element_get_factory(encoder)), "nvv4l2"));
 
     gst_bin_add(GST_BIN(pipeline), encoder);
     return encoder;
@@ -509,11 +1565,276 @@ static GstElement *get_video_encoder_by_name(gchar *name) {
         return get_hardware_h265_encoder();
     } else if (g_str_has_prefix(name, "vp")) {
         return get_hardware_vp89_encoder(name);
+    } else if (g_str_has_prefix(name, "av1")) {
+        return get_hardware_av1_encoder();
     } else {
         return get_hardware_h264_encoder();
     }
 }
 
+// "branch: factory" of every video encoder in the pipeline, for the startup report.
+static GPtrArray *encoder_report = NULL;
+static guint shared_branches = 0;
+
+#define CPU_REPORT_DELAY 10
+
+static void count_encoder(const gchar *branch, const gchar *factory) {
+    if (encoder_report == NULL)
+        encoder_report = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(encoder_report, g_strdup_printf("%s: %s", branch, factory));
+}
+
+static void count_encoder_element(const gchar *branch, GstElement *encoder) {
+    if (encoder != NULL)
+        count_encoder(branch, GST_OBJECT_NAME(gst_element_get_factory(encoder)));
+}
+
+/**
+ * @brief The branches without burned-in analytics take the stream of the video_encoder tee
+ * instead of encoding again, the mpegts and mp4 muxers only take h264 and h265 of it.
+ * They record what the viewers get, the bitrate of the congestion control included.
+ */
+static gboolean can_share_encoder() {
+    return video_encoder != NULL &&
+           (g_str_has_prefix(config_data.videnc, "h264") || g_str_has_prefix(config_data.videnc, "h265"));
+}
+
+// busy time of every videoconvert, the conversion cost of each branch with shared_convert on and off.
+typedef struct {
+    gchar *label;
+    gint64 in_time;
+    guint64 frames;
+    gint64 busy;
+} ConvertCost;
+
+static GPtrArray *convert_costs = NULL;
+
+static GstPadProbeReturn convert_in_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    ((ConvertCost *)user_data)->in_time = g_get_monotonic_time();
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn convert_out_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    ConvertCost *cost = user_data;
+    // videoconvert pushes from the streaming thread of its sink pad, in_time is the same frame.
+    if (cost->in_time != 0) {
+        cost->busy += g_get_monotonic_time() - cost->in_time;
+        cost->frames++;
+        cost->in_time = 0;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void free_convert_cost(gpointer data) {
+    ConvertCost *cost = data;
+    g_free(cost->label);
+    g_free(cost);
+}
+
+static void watch_convert_cost(GstElement *convert, const gchar *label) {
+    GstPad *pad;
+    ConvertCost *cost = g_new0(ConvertCost, 1);
+    cost->label = g_strdup(label);
+    if (convert_costs == NULL)
+        convert_costs = g_ptr_array_new_with_free_func(free_convert_cost);
+    g_ptr_array_add(convert_costs, cost);
+
+    pad = gst_element_get_static_pad(convert, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, convert_in_probe, cost, NULL);
+    gst_object_unref(pad);
+    pad = gst_element_get_static_pad(convert, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, convert_out_probe, cost, NULL);
+    gst_object_unref(pad);
+}
+
+/** converts on all cores, for the conversions of the shared video. */
+static void set_convert_threads(GstElement *convert) {
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(convert), "n-threads"))
+        g_object_set(convert, "n-threads", 0, NULL);
+}
+
+// the frames before the baseline of report_cpu_usage are not counted.
+static void reset_convert_costs() {
+    for (guint i = 0; convert_costs && i < convert_costs->len; i++) {
+        ConvertCost *cost = g_ptr_array_index(convert_costs, i);
+        cost->frames = 0;
+        cost->busy = 0;
+    }
+}
+
+static void report_convert_costs(gint64 elapsed) {
+    guint count = convert_costs ? convert_costs->len : 0;
+    g_print("conversions: %u, shared_convert: %s\n", count, config_data.shared_convert ? "on" : "off");
+    for (guint i = 0; i < count; i++) {
+        ConvertCost *cost = g_ptr_array_index(convert_costs, i);
+        g_print("  %s: %" G_GUINT64_FORMAT " frames, %.2f ms/frame, %.1f%% of one core\n",
+                cost->label, cost->frames,
+                cost->frames ? cost->busy / 1000.0 / cost->frames : 0.0,
+                cost->busy * 100.0 / elapsed);
+    }
+}
+
+static gboolean report_cpu_usage(gpointer user_data) {
+    static gint64 start = 0;
+    static gdouble start_cpu = 0;
+    gint64 now = g_get_monotonic_time();
+    gdouble cpu = get_process_cpu_seconds();
+
+    if (start == 0) {
+        start = now;
+        start_cpu = cpu;
+        reset_convert_costs();
+        return G_SOURCE_CONTINUE;
+    }
+    g_print("cpu: %.1f%% of one core over %d s with %u video encoders\n",
+            (cpu - start_cpu) * 1e8 / (now - start), CPU_REPORT_DELAY,
+            encoder_report ? encoder_report->len : 0);
+    report_convert_costs(now - start);
+    return G_SOURCE_REMOVE;
+}
+
+static void report_encoders() {
+    guint count = encoder_report ? encoder_report->len : 0;
+    g_print("video encoders: %u, branches on the shared encoder: %u\n", count, shared_branches);
+    for (guint i = 0; i < count; i++)
+        g_print("  %s\n", (gchar *)g_ptr_array_index(encoder_report, i));
+    // the first call takes the baseline once the pipeline runs.
+    report_cpu_usage(NULL);
+    g_timeout_add_seconds(CPU_REPORT_DELAY, report_cpu_usage, NULL);
+}
+
+gboolean is_synthetic_capture() {
+    return !g_strcmp0(config_data.v4l2src_data.devtype, "test") || !g_strcmp0(config_data.v4l2src_data.devtype, "file");
+}
+
+typedef struct {
+    GstSegment segment;
+    GstClockTime end; // running time of the end of the last frame.
+    gboolean looping;
+} FileLoop;
+
+static gboolean seek_file_start(gpointer user_data) {
+    GstPad *pad = (GstPad *)user_data;
+    gst_pad_push_event(pad, gst_event_new_seek(1.0, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT,
+                                               GST_SEEK_TYPE_SET, 0, GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE));
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Loops the file on its decoded side: eos seeks back to the start, the flush of the seek
+ * stays here and the pad offset moves the new segment behind the last frame of the previous round.
+ */
+static GstPadProbeReturn file_loop_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    FileLoop *loop = (FileLoop *)user_data;
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        GstClockTime end = gst_segment_to_running_time(&loop->segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buffer));
+        if (GST_CLOCK_TIME_IS_VALID(end))
+            loop->end = end + (GST_BUFFER_DURATION_IS_VALID(buffer) ? GST_BUFFER_DURATION(buffer) : 0);
+        return GST_PAD_PROBE_OK;
+    }
+    switch (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info))) {
+    case GST_EVENT_SEGMENT:
+        gst_event_copy_segment(GST_PAD_PROBE_INFO_EVENT(info), &loop->segment);
+        loop->looping = FALSE;
+        return GST_PAD_PROBE_OK;
+    case GST_EVENT_EOS:
+        if (loop->looping)
+            return GST_PAD_PROBE_DROP;
+        loop->looping = TRUE;
+        gst_pad_set_offset(pad, gst_pad_get_offset(pad) + loop->end);
+        // a flushing seek can not be sent from the streaming thread.
+        g_idle_add_full(G_PRIORITY_DEFAULT, seek_file_start, gst_object_ref(pad), gst_object_unref);
+        return GST_PAD_PROBE_DROP;
+    case GST_EVENT_FLUSH_START:
+    case GST_EVENT_FLUSH_STOP:
+        return GST_PAD_PROBE_DROP;
+    default:
+        return GST_PAD_PROBE_OK;
+    }
+}
+
+/**
+ * @brief The source of devtype test or file in place of the camera, at the configured size,
+ * framerate and type, so the capsfilter, the mjpeg decoder and all after them are the production path.
+ * test is a moving videotestsrc, file the endless loop of the video file at device.
+ */
+static GstElement *get_synthetic_video_src() {
+    _v4l2src_data *data = &config_data.v4l2src_data;
+    gboolean jpeg = g_str_has_prefix(data->type, "image/jpeg");
+    GError *error = NULL;
+    GstElement *bin;
+    gchar *caps, *desc;
+
+    if (jpeg)
+        caps = g_strdup_printf("video/x-raw,width=%d,height=%d,framerate=(fraction)%d/1 ! jpegenc",
+                               data->width, data->height, data->framerate);
+    else
+        caps = g_strdup_printf("%s,format=%s,width=%d,height=%d,framerate=(fraction)%d/1",
+                               data->type, data->format, data->width, data->height, data->framerate);
+    if (!g_strcmp0(data->devtype, "file"))
+        desc = g_strdup_printf("filesrc location=\"%s\" ! decodebin ! videoconvert name=fileconv ! videoscale ! "
+                               "videorate ! %s ! identity sync=true",
+                               data->device, caps);
+    else
+        desc = g_strdup_printf("videotestsrc is-live=true pattern=smpte horizontal-speed=2 ! %s", caps);
+    g_free(caps);
+    g_print("synthetic capture: %s\n", desc);
+    bin = gst_parse_bin_from_description(desc, TRUE, &error);
+    g_free(desc);
+    if (error) {
+        g_printerr("Unable to create synthetic capture: %s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    if (!g_strcmp0(data->devtype, "file")) {
+        GstElement *conv = gst_bin_get_by_name(GST_BIN(bin), "fileconv");
+        GstPad *pad = gst_element_get_static_pad(conv, "sink");
+        FileLoop *loop = g_new0(FileLoop, 1);
+        gst_segment_init(&loop->segment, GST_FORMAT_TIME);
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM | GST_PAD_PROBE_TYPE_EVENT_FLUSH,
+                          file_loop_probe, loop, g_free);
+        gst_object_unref(pad);
+        gst_object_unref(conv);
+    }
+    return bin;
+}
+
+/** jpegdec, or the frame-parallel decoder of mjpegdec.c when mjpeg_workers asks for more than one. */
+static GstElement *get_jpeg_decoder() {
+    if (config_data.mjpeg_workers > 1) {
+        g_print("mjpeg decode on %d workers\n", config_data.mjpeg_workers);
+        return mjpeg_decoder_new(config_data.mjpeg_workers);
+    }
+    return gst_element_factory_make("jpegdec", NULL);
+}
+
+#if !defined(HAS_JETSON_NANO)
+/**
+ * @brief videoconvert ! video/x-raw,format={NV12,I420} in front of the capture tee, a format every
+ * encoder takes, so that the branches pass it through instead of converting it each. Returns the videoconvert.
+ */
+static GstElement *add_capture_convert(GstElement *tee) {
+    GstElement *convert, *capsfilter;
+    GstCaps *caps;
+    convert = gst_element_factory_make("videoconvert", NULL);
+    capsfilter = gst_element_factory_make("capsfilter", NULL);
+    caps = gst_caps_from_string("video/x-raw,format={NV12,I420}");
+    g_object_set(capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    set_convert_threads(convert);
+    gst_bin_add_many(GST_BIN(pipeline), convert, capsfilter, NULL);
+    if (!gst_element_link_many(convert, capsfilter, tee, NULL)) {
+        g_printerr("Failed to link capture convert\n");
+        return NULL;
+    }
+    watch_convert_cost(convert, "capture");
+    return convert;
+}
+#endif
+
 static GstElement *get_video_src() {
     GstCaps *srcCaps;
     GstElement *teesrc, *capsfilter;
@@ -527,7 +1848,7 @@ static GstElement *get_video_src() {
             config_data.v4l2src_data.format);
 
 #if defined(HAS_JETSON_NANO)
-    GstElement *nvbin = get_nvbin();
+    GstElement *nvbin = is_synthetic_capture() ? get_synthetic_video_src() : get_nvbin();
     teesrc = gst_element_factory_make("tee", NULL);
     srcCaps = gst_caps_from_string("video/x-raw");
     g_object_set(G_OBJECT(capsfilter), "caps", srcCaps, NULL);
@@ -552,11 +1873,15 @@ static GstElement *get_video_src() {
     g_object_set(G_OBJECT(capsfilter), "caps", srcCaps, NULL);
     gst_caps_unref(srcCaps);
     teesrc = gst_element_factory_make("tee", NULL);
-    source = gst_element_factory_make("v4l2src", NULL);
-    g_object_set(G_OBJECT(source),
-                 "device", config_data.v4l2src_data.device,
-                 "io-mode", config_data.v4l2src_data.io_mode,
-                 NULL);
+    if (is_synthetic_capture()) {
+        source = get_synthetic_video_src();
+    } else {
+        source = gst_element_factory_make("v4l2src", NULL);
+        g_object_set(G_OBJECT(source),
+                     "device", config_data.v4l2src_data.device,
+                     "io-mode", config_data.v4l2src_data.io_mode,
+                     NULL);
+    }
 
     queue = gst_element_factory_make("queue", NULL);
     g_object_set(G_OBJECT(queue), "leaky", 1, NULL);
@@ -567,6 +1892,10 @@ static GstElement *get_video_src() {
     // srcCaps = _getVideoCaps("image/jpeg", "NV12", 30, 1280, 720);
 
     gst_bin_add_many(GST_BIN(pipeline), source, capsfilter, teesrc, queue, NULL);
+    // the element the capture chain ends in, the tee itself without shared_convert.
+    GstElement *head = config_data.shared_convert ? add_capture_convert(teesrc) : teesrc;
+    if (head == NULL)
+        return NULL;
 
     if (g_str_has_prefix(config_data.v4l2src_data.type, "image")) {
         GstElement *jpegparse = NULL, *jpegdec = NULL;
@@ -580,7 +1909,7 @@ static GstElement *get_video_src() {
             jpegdec = gst_element_factory_make("v4l2jpegdec", NULL);
 #endif
         else {
-            jpegdec = gst_element_factory_make("jpegdec", NULL);
+            jpegdec = get_jpeg_decoder();
             jpegparse = gst_element_factory_make("jpegparse", NULL);
         }
 
@@ -594,12 +1923,12 @@ static GstElement *get_video_src() {
             if (gst_element_factory_find("vaapipostproc")) {
                 GstElement *vapp = gst_element_factory_make("vaapipostproc", NULL);
                 gst_bin_add(GST_BIN(pipeline), vapp);
-                if (!gst_element_link_many(source, capsfilter, jpegparse, jpegdec, vapp, queue, teesrc, NULL)) {
+                if (!gst_element_link_many(source, capsfilter, jpegparse, jpegdec, vapp, queue, head, NULL)) {
                     g_error("Failed to link elements video mjpg src\n");
                     return NULL;
                 }
             } else {
-                if (!gst_element_link_many(source, capsfilter, jpegparse, jpegdec, queue, teesrc, NULL)) {
+                if (!gst_element_link_many(source, capsfilter, jpegparse, jpegdec, queue, head, NULL)) {
                     g_error("Failed to link elements video mjpg src\n");
                     return NULL;
                 }
@@ -608,12 +1937,12 @@ static GstElement *get_video_src() {
             if (gst_element_factory_find("vaapipostproc")) {
                 GstElement *vapp = gst_element_factory_make("vaapipostproc", NULL);
                 gst_bin_add(GST_BIN(pipeline), vapp);
-                if (!gst_element_link_many(source, capsfilter, jpegdec, vapp, queue, teesrc, NULL)) {
+                if (!gst_element_link_many(source, capsfilter, jpegdec, vapp, queue, head, NULL)) {
                     g_error("Failed to link elements video mjpg src\n");
                     return NULL;
                 }
             } else {
-                if (!gst_element_link_many(source, capsfilter, jpegdec, queue, teesrc, NULL)) {
+                if (!gst_element_link_many(source, capsfilter, jpegdec, queue, head, NULL)) {
                     g_error("Failed to link elements video mjpg src\n");
                     return NULL;
                 }
@@ -623,12 +1952,12 @@ static GstElement *get_video_src() {
         if (gst_element_factory_find("vaapipostproc")) {
             GstElement *vapp = gst_element_factory_make("vaapipostproc", NULL);
             gst_bin_add(GST_BIN(pipeline), vapp);
-            if (!gst_element_link_many(source, capsfilter, vapp, queue, teesrc, NULL)) {
+            if (!gst_element_link_many(source, capsfilter, vapp, queue, head, NULL)) {
                 g_error("Failed to link elements video src\n");
                 return NULL;
             }
         } else {
-            if (!gst_element_link_many(source, capsfilter, queue, teesrc, NULL)) {
+            if (!gst_element_link_many(source, capsfilter, queue, head, NULL)) {
                 g_error("Failed to link elements video src\n");
                 return NULL;
             }
@@ -640,6 +1969,11 @@ static GstElement *get_video_src() {
 
 static GstElement *get_audio_device() {
     GstElement *source;
+    if (is_synthetic_capture()) {
+        source = gst_element_factory_make("audiotestsrc", NULL);
+        g_object_set(G_OBJECT(source), "is-live", TRUE, "wave", 8, NULL); // ticks
+        return source;
+    }
     if (gst_element_factory_find("pipewiresrc")) {
         source = gst_element_factory_make("pipewiresrc", NULL);
         if (config_data.audio.path != 0) {
@@ -862,6 +2196,193 @@ static GstElement *get_h264_caps() {
 }
 #endif
 
+/**
+ * @brief Live size and rate of the shared encoder, videorate ! videoscale ! capsfilter in front
+ * of it. A new mode renegotiates the caps in the running pipeline, the sessions stay connected
+ * and get a keyframe of the new mode. The capture itself keeps the mode of config.json.
+ */
+static GstElement *video_mode_filter = NULL;
+static gint video_mode_fps = 0;
+
+// splitfile_sink takes the stream of the shared encoder into mp4 files.
+static gboolean shared_mp4_record = FALSE;
+
+/** links videorate ! videoscale ! capsfilter to sink, head is videorate. */
+static int add_video_mode_filter(GstElement *sink, GstElement **head) {
+    GstElement *rate, *scale;
+    MAKE_ELEMENT_AND_ADD(rate, "videorate");
+    MAKE_ELEMENT_AND_ADD(scale, "videoscale");
+    MAKE_ELEMENT_AND_ADD(video_mode_filter, "capsfilter");
+    // never duplicate frames, a lower rate only drops them.
+    g_object_set(rate, "drop-only", TRUE, NULL);
+    if (!gst_element_link_many(rate, scale, video_mode_filter, sink, NULL)) {
+        g_printerr("Failed to link video mode filter\n");
+        return -1;
+    }
+    video_mode_fps = config_data.v4l2src_data.framerate;
+    *head = rate;
+    return 0;
+}
+
+/**
+ * @brief From the data channel and the http thread. The mp4 muxer of a split-file recording on
+ * the shared encoder refuses new caps in a file, its mode can not change while it records.
+ */
+gboolean set_video_mode(gint width, gint height, gint framerate) {
+    _v4l2src_data *data = &config_data.v4l2src_data;
+    Rendition *rendition = &renditions[0];
+    GstCaps *caps;
+    guint bitrate;
+
+    if (video_mode_filter == NULL || rendition->encoder == NULL) {
+        g_printerr("video mode can not be changed by this pipeline\n");
+        return FALSE;
+    }
+    if (shared_mp4_record) {
+        g_printerr("video mode can not be changed while splitfile_sink records the shared encoder\n");
+        return FALSE;
+    }
+    width = width > 0 ? width : data->width;
+    height = height > 0 ? height : data->height;
+    framerate = framerate > 0 ? framerate : data->framerate;
+    // only down from the capture mode, even sizes for the chroma of 4:2:0.
+    if (width > data->width || height > data->height || framerate > data->framerate) {
+        g_printerr("video mode %dx%d@%d is above the capture mode\n", width, height, framerate);
+        return FALSE;
+    }
+    width &= ~1;
+    height &= ~1;
+
+    if (config_data.bitrate > 0)
+        bitrate = MAX((guint)((guint64)config_data.bitrate * width * height * framerate /
+                              ((guint64)data->width * data->height * data->framerate)),
+                      BITRATE_MIN);
+    else
+        bitrate = get_model_bitrate(config_data.videnc, width, height, framerate);
+
+    // one caller at a time, and the congestion controller, the rendition choice and the roi see both.
+    g_mutex_lock(&rendition_lock);
+    caps = gst_caps_new_simple("video/x-raw", "width", G_TYPE_INT, width, "height", G_TYPE_INT, height,
+                               "framerate", GST_TYPE_FRACTION, framerate, 1, NULL);
+    g_object_set(video_mode_filter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    rendition->width = width;
+    rendition->height = height;
+    rendition->bitrate = bitrate;
+    video_mode_fps = framerate;
+    if (g_object_get_data(G_OBJECT(rendition->encoder), "quality") == NULL) {
+        // the congestion controller only lowers it from here.
+        rendition->current_bitrate = rendition->current_bitrate ? MIN(rendition->current_bitrate, bitrate)
+                                                                : bitrate;
+        set_encoder_bitrate(rendition->encoder, rendition->current_bitrate);
+    }
+    g_mutex_unlock(&rendition_lock);
+    request_keyframe(rendition, KEYFRAME_MODE);
+    g_print("video mode %dx%d@%d at %u bps\n", width, height, framerate, bitrate);
+    return TRUE;
+}
+
+void get_video_mode(gint *width, gint *height, gint *framerate) {
+    g_mutex_lock(&rendition_lock);
+    *width = n_renditions > 0 ? renditions[0].width : config_data.v4l2src_data.width;
+    *height = n_renditions > 0 ? renditions[0].height : config_data.v4l2src_data.height;
+    *framerate = video_mode_fps ? video_mode_fps : config_data.v4l2src_data.framerate;
+    g_mutex_unlock(&rendition_lock);
+}
+
+#if !defined(HAS_JETSON_NANO)
+// format -> tee of the analysis stream in it, shared by the analytics branches.
+static GHashTable *analysis_sources = NULL;
+
+/** the first raw format of the sink template of filter, RGB for the opencv elements. */
+static gchar *get_sink_format(GstElement *filter) {
+    GstPadTemplate *templ;
+    GstCaps *caps;
+    const GValue *value = NULL;
+    gchar *format = NULL;
+
+    templ = gst_element_class_get_pad_template(GST_ELEMENT_GET_CLASS(filter), "sink");
+    if (templ == NULL)
+        return g_strdup("RGB");
+    caps = gst_pad_template_get_caps(templ);
+    if (!gst_caps_is_empty(caps) && !gst_caps_is_any(caps))
+        value = gst_structure_get_value(gst_caps_get_structure(caps, 0), "format");
+    if (value != NULL && G_VALUE_HOLDS_STRING(value))
+        format = g_value_dup_string(value);
+    else if (value != NULL && GST_VALUE_HOLDS_LIST(value) && gst_value_list_get_size(value) > 0)
+        format = g_value_dup_string(gst_value_list_get_value(value, 0));
+    gst_caps_unref(caps);
+    return format ? format : g_strdup("RGB");
+}
+
+/**
+ * @brief The analysis stream in the sink format of filter: video_source dropped to the analysis
+ * rate, scaled to the analysis size and converted by a videoconvert on all cores. Each format is
+ * made once and its tee is shared by every branch that takes it, the videoconvert of the branch
+ * then passes it through. video_source itself without shared_convert.
+ */
+static GstElement *get_analysis_source(GstElement *filter) {
+    GstElement *queue, *rate, *scale, *convert, *capsfilter, *tee;
+    GstCaps *caps;
+    gchar *format, *label;
+    gint width, height, framerate;
+
+    if (!config_data.shared_convert)
+        return video_source;
+    if (analysis_sources == NULL)
+        analysis_sources = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    format = get_sink_format(filter);
+    tee = g_hash_table_lookup(analysis_sources, format);
+    if (tee != NULL) {
+        g_free(format);
+        return tee;
+    }
+
+    get_analysis_size(&width, &height, &framerate);
+    queue = gst_element_factory_make("queue", NULL);
+    rate = gst_element_factory_make("videorate", NULL);
+    scale = gst_element_factory_make("videoscale", NULL);
+    convert = gst_element_factory_make("videoconvert", NULL);
+    capsfilter = gst_element_factory_make("capsfilter", NULL);
+    tee = gst_element_factory_make("tee", NULL);
+    // the analytics drop frames instead of holding back the capture.
+    g_object_set(queue, "leaky", 2, "max-size-buffers", 2, "max-size-bytes", 0, "max-size-time", (guint64)0, NULL);
+    g_object_set(rate, "drop-only", TRUE, NULL);
+    set_convert_threads(convert);
+    // scaled before the conversion, the conversion only sees the small frames.
+    caps = gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, format,
+                               "width", G_TYPE_INT, width, "height", G_TYPE_INT, height,
+                               "framerate", GST_TYPE_FRACTION, framerate, 1, NULL);
+    g_object_set(capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    gst_bin_add_many(GST_BIN(pipeline), queue, rate, scale, convert, capsfilter, tee, NULL);
+    if (!gst_element_link_many(queue, rate, scale, convert, capsfilter, tee, NULL)) {
+        g_printerr("Failed to link the %s analysis stream\n", format);
+        g_free(format);
+        return video_source;
+    }
+    link_request_src_pad(video_source, queue);
+    g_print("analysis stream %s %dx%d at %d fps\n", format, width, height, framerate);
+    label = g_strdup_printf("analysis %s", format);
+    watch_convert_cost(convert, label);
+    g_free(label);
+    g_hash_table_insert(analysis_sources, format, tee);
+    return tee;
+}
+#endif
+
+/** links src to sink through a new encoder gate, or directly without the valve element. */
+static void link_through_encoder_gate(GstElement *src, GstElement *sink) {
+    GstElement *gate = add_encoder_gate();
+    if (gate == NULL) {
+        link_request_src_pad(src, sink);
+        return;
+    }
+    if (!gst_element_link(gate, sink))
+        g_printerr("Failed to link encoder gate\n");
+    link_request_src_pad(src, gate);
+}
+
 static GstElement *get_encoder_src() {
     GstElement *encoder, *teesrc;
     encoder = get_video_encoder_by_name(config_data.videnc);
@@ -870,6 +2391,9 @@ static GstElement *get_encoder_src() {
         // g_printerr("encoder %x ; clock %x.\n", encoder, clock);
         return NULL;
     }
+    video_encoder_element = encoder;
+    count_encoder_element("live", encoder);
+    watch_encoder_roi(encoder, &renditions[0]);
     teesrc = gst_element_factory_make("tee", vid_encoder_tee);
 
 #if defined(HAS_JETSON_NANO)
@@ -889,7 +2413,7 @@ static GstElement *get_encoder_src() {
         g_print("Failed to link  elements encoder source \n");
         return NULL;
     }
-    link_request_src_pad(video_source, clockbin);
+    link_through_encoder_gate(video_source, clockbin);
 #else
     GstElement *clock, *videoconvert;
 
@@ -930,7 +2454,11 @@ static GstElement *get_encoder_src() {
             }
         }
     }
-    link_request_src_pad(video_source, videoconvert);
+    watch_convert_cost(videoconvert, "live encoder");
+    GstElement *head = videoconvert;
+    if (add_video_mode_filter(videoconvert, &head))
+        return NULL;
+    link_through_encoder_gate(video_source, head);
 #endif
     return teesrc;
 }
@@ -985,6 +2513,8 @@ static void *_inotify_thread(void *filename) {
                     if (ret) {
                         g_error("Failed to lock on mutex.\n");
                     }
+                    // released by stop_appsrc_rec or stop_udpsrc_rec.
+                    encoder_consumer_acquire();
                     if (config_data.app_sink) {
                         g_thread_new("start_record_mkv", (GThreadFunc)start_appsrc_record, NULL);
                     } else {
@@ -1039,6 +2569,7 @@ void udpsrc_cmd_rec_stop(gpointer user_data) {
     gst_element_set_state(GST_ELEMENT(item->pipeline),
                           GST_STATE_NULL);
     g_print("stop udpsrc record.\n");
+    encoder_consumer_release();
 
     gst_object_unref(GST_OBJECT(item->pipeline));
     if (pthread_mutex_lock(&cmd_mtx)) {
@@ -1053,6 +2584,43 @@ void udpsrc_cmd_rec_stop(gpointer user_data) {
 
 int get_record_state() { return cmd_recording ? 1 : 0; }
 
+/**
+ * @brief Set the caps of the shared rtp stream on a forward mode source, the payloader caps carry
+ * profile-level-id and sprop-parameter-sets for the SDP. With ssrc the source gets a new random ssrc,
+ * the fanout rewrites the packets to it, otherwise the ssrc of the payloader is kept.
+ */
+static void set_forward_caps(GstElement *src, GstElement *rtp_sink, guint32 *ssrc) {
+    GstCaps *caps = NULL;
+    GstStructure *structure;
+    if (src == NULL)
+        return;
+    if (rtp_sink != NULL) {
+        GstPad *pad = gst_element_get_static_pad(rtp_sink, "sink");
+        caps = gst_pad_get_current_caps(pad);
+        gst_object_unref(pad);
+    }
+    if (caps == NULL) {
+        gchar *name = gst_element_get_name(src);
+        gchar *upenc = g_ascii_strup(config_data.videnc, strlen(config_data.videnc));
+        gchar *str = g_str_has_prefix(name, "audio")
+                         ? g_strdup("application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS,payload=(int)97")
+                         : g_strdup_printf("application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96", upenc);
+        caps = gst_caps_from_string(str);
+        g_free(str);
+        g_free(upenc);
+        g_free(name);
+    }
+    caps = gst_caps_make_writable(caps);
+    structure = gst_caps_get_structure(caps, 0);
+    if (ssrc != NULL) {
+        *ssrc = g_random_int_range(1, G_MAXINT32);
+        gst_structure_remove_fields(structure, "ssrc", "timestamp-offset", "seqnum-offset", NULL);
+        gst_structure_set(structure, "ssrc", G_TYPE_UINT, *ssrc, NULL);
+    }
+    g_object_set(src, "caps", caps, NULL);
+    gst_caps_unref(caps);
+}
+
 static gchar *udpsrc_audio_cmdline(const gchar *sink) {
     gchar *opus;
     if (g_str_has_prefix(sink, "mux")) {
@@ -1074,9 +2642,232 @@ static gchar *get_rtp_args() {
     if (g_strcmp0(config_data.videnc, "vp8")) {
         rtp = g_strdup_printf("rtp%sdepay ! %sparse", config_data.videnc, config_data.videnc);
     } else {
-        rtp = g_strdup_printf("rtp%sdepay ", config_data.videnc);
+        rtp = g_strdup_printf("rtp%sdepay ", config_data.videnc);
+    }
+    return rtp;
+}
+
+/* rtp sequence gaps seen by every udpsrc consumer of the loopback multicast. */
+typedef struct {
+    gboolean started;
+    guint16 last_seq;
+    guint64 received;
+    guint64 lost;
+} UdpLossStats;
+
+static GMutex udp_loss_lock;
+static GPtrArray *udp_loss_list = NULL;
+static guint64 udp_closed_received = 0;
+static guint64 udp_closed_lost = 0;
+
+static GstPadProbeReturn
+udpsrc_loss_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    UdpLossStats *stats = (UdpLossStats *)user_data;
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+
+    if (!gst_rtp_buffer_map(GST_PAD_PROBE_INFO_BUFFER(info), GST_MAP_READ, &rtp))
+        return GST_PAD_PROBE_OK;
+    guint16 seq = gst_rtp_buffer_get_seq(&rtp);
+    gst_rtp_buffer_unmap(&rtp);
+
+    if (stats->started) {
+        gint16 gap = (gint16)(guint16)(seq - stats->last_seq);
+        // reordered or duplicated packets are not counted as lost.
+        if (gap > 1)
+            stats->lost += gap - 1;
+        if (gap > 0)
+            stats->last_seq = seq;
+    } else {
+        stats->last_seq = seq;
+        stats->started = TRUE;
+    }
+    stats->received++;
+    return GST_PAD_PROBE_OK;
+}
+
+static void udpsrc_loss_free(gpointer data) {
+    UdpLossStats *stats = (UdpLossStats *)data;
+    g_mutex_lock(&udp_loss_lock);
+    udp_closed_received += stats->received;
+    udp_closed_lost += stats->lost;
+    g_ptr_array_remove_fast(udp_loss_list, stats);
+    g_mutex_unlock(&udp_loss_lock);
+    g_free(stats);
+}
+
+static void watch_udpsrc_loss(GstElement *bin) {
+    GValue item = G_VALUE_INIT;
+    GstIterator *it;
+    if (bin == NULL)
+        return;
+    it = gst_bin_iterate_all_by_element_factory_name(GST_BIN(bin), "udpsrc");
+    while (gst_iterator_next(it, &item) == GST_ITERATOR_OK) {
+        GstElement *udpsrc = GST_ELEMENT(g_value_get_object(&item));
+        GstPad *pad = gst_element_get_static_pad(udpsrc, "src");
+        UdpLossStats *stats = g_new0(UdpLossStats, 1);
+
+        g_mutex_lock(&udp_loss_lock);
+        if (udp_loss_list == NULL)
+            udp_loss_list = g_ptr_array_new();
+        g_ptr_array_add(udp_loss_list, stats);
+        g_mutex_unlock(&udp_loss_lock);
+
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, udpsrc_loss_probe, stats, udpsrc_loss_free);
+        gst_object_unref(pad);
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+    gst_iterator_free(it);
+}
+
+#define FRAME_SIZE_WINDOW 1024
+
+/**
+ * @brief Sizes of the rtp access units of the live video in the current report interval,
+ * p99 and max against the mean show the keyframe bursts every viewer gets at once.
+ */
+typedef struct {
+    GMutex lock;
+    guint sizes[FRAME_SIZE_WINDOW];
+    guint frames;
+    guint64 bytes;
+    guint max;
+    guint au_bytes; // the access unit in progress, publisher thread only.
+} FrameSizeStats;
+
+static FrameSizeStats video_frame_sizes;
+
+static void count_rtp_packet(GstBuffer *buffer, FrameSizeStats *stats) {
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    gboolean marker;
+
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+        return;
+    marker = gst_rtp_buffer_get_marker(&rtp);
+    stats->au_bytes += gst_rtp_buffer_get_payload_len(&rtp);
+    gst_rtp_buffer_unmap(&rtp);
+    if (!marker)
+        return;
+
+    g_mutex_lock(&stats->lock);
+    // reservoir sample of the interval when it has more frames than the window.
+    if (stats->frames < FRAME_SIZE_WINDOW) {
+        stats->sizes[stats->frames] = stats->au_bytes;
+    } else {
+        guint slot = g_random_int_range(0, stats->frames + 1);
+        if (slot < FRAME_SIZE_WINDOW)
+            stats->sizes[slot] = stats->au_bytes;
+    }
+    stats->frames++;
+    stats->bytes += stats->au_bytes;
+    stats->max = MAX(stats->max, stats->au_bytes);
+    g_mutex_unlock(&stats->lock);
+    stats->au_bytes = 0;
+}
+
+static gboolean count_rtp_list_packet(GstBuffer **buffer, guint idx, gpointer user_data) {
+    count_rtp_packet(*buffer, (FrameSizeStats *)user_data);
+    return TRUE;
+}
+
+static GstPadProbeReturn frame_size_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+        gst_buffer_list_foreach(GST_PAD_PROBE_INFO_BUFFER_LIST(info), count_rtp_list_packet, user_data);
+    else
+        count_rtp_packet(GST_PAD_PROBE_INFO_BUFFER(info), (FrameSizeStats *)user_data);
+    return GST_PAD_PROBE_OK;
+}
+
+/** watch the rtp egress of the live video at the payloader. */
+static void watch_frame_sizes(GstElement *video_pay) {
+    GstPad *pad = gst_element_get_static_pad(video_pay, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+                      frame_size_probe, &video_frame_sizes, NULL);
+    gst_object_unref(pad);
+}
+
+static gint compare_uint(gconstpointer a, gconstpointer b) {
+    guint x = *(const guint *)a, y = *(const guint *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report_frame_sizes(FrameSizeStats *stats) {
+    guint sizes[FRAME_SIZE_WINDOW];
+    guint n, frames, max;
+    guint64 bytes;
+    gdouble mean;
+
+    g_mutex_lock(&stats->lock);
+    frames = stats->frames;
+    bytes = stats->bytes;
+    max = stats->max;
+    n = MIN(frames, FRAME_SIZE_WINDOW);
+    memcpy(sizes, stats->sizes, n * sizeof(guint));
+    stats->frames = 0;
+    stats->bytes = 0;
+    stats->max = 0;
+    g_mutex_unlock(&stats->lock);
+    if (frames == 0)
+        return;
+
+    qsort(sizes, n, sizeof(guint), compare_uint);
+    mean = (gdouble)bytes / frames;
+    gst_print("video frames%s: %u, mean: %.0f B, p50: %u B, p99: %u B, max: %u B, p99/mean: %.2f, max/mean: %.2f\n",
+              config_data.intra_refresh ? " (intra refresh)" : "", frames, mean, sizes[n / 2],
+              sizes[MIN(n - 1, n * 99 / 100)], max, sizes[MIN(n - 1, n * 99 / 100)] / mean, max / mean);
+}
+
+// the previous sample of a transport, the cpu of the report is the delta to it.
+typedef struct {
+    gboolean app_sink;
+    gint64 last_wall;
+    gdouble last_cpu;
+} TransportStats;
+
+static TransportStats transport_stats[2] = {{FALSE}, {TRUE}};
+
+/**
+ * @brief Print loss and process cpu of the transport between the encoder and the sessions,
+ * run with "transport": "udp" and "appsrc" on the same stream to compare them.
+ */
+static gboolean report_transport_stats(gpointer user_data) {
+    TransportStats *transport = (TransportStats *)user_data;
+    gint64 wall = g_get_monotonic_time();
+    gdouble cpu = get_process_cpu_seconds();
+    gdouble cpu_pct = transport->last_wall ? (cpu - transport->last_cpu) * 1e8 / (wall - transport->last_wall) : 0;
+    guint64 received, lost;
+    guint consumers;
+
+    transport->last_wall = wall;
+    transport->last_cpu = cpu;
+    if (transport->app_sink) {
+        FanoutSubStats video, audio;
+        consumers = fanout_hub_get_totals(video_hub, &video);
+        fanout_hub_get_totals(audio_hub, &audio);
+        received = video.pushed + audio.pushed;
+        lost = video.dropped + audio.dropped;
+    } else {
+        g_mutex_lock(&udp_loss_lock);
+        received = udp_closed_received;
+        lost = udp_closed_lost;
+        consumers = udp_loss_list ? udp_loss_list->len : 0;
+        for (guint i = 0; i < consumers; i++) {
+            UdpLossStats *stats = g_ptr_array_index(udp_loss_list, i);
+            received += stats->received;
+            lost += stats->lost;
+        }
+        g_mutex_unlock(&udp_loss_lock);
     }
-    return rtp;
+    if (consumers == 0 && received == 0)
+        return G_SOURCE_CONTINUE;
+    gst_print("transport %s: consumers: %u, packets: %" G_GUINT64_FORMAT ", lost: %" G_GUINT64_FORMAT
+              " (%.3f%%), cpu: %.1f%%\n",
+              transport->app_sink ? "appsrc" : "udp", consumers, received, lost,
+              received + lost ? lost * 100.0 / (received + lost) : 0, cpu_pct);
+    report_frame_sizes(&video_frame_sizes);
+    report_keyframe_requests();
+    report_roi();
+    return G_SOURCE_CONTINUE;
 }
 
 void udpsrc_cmd_rec_start(gpointer user_data) {
@@ -1093,6 +2884,7 @@ void udpsrc_cmd_rec_start(gpointer user_data) {
     if (pthread_mutex_unlock(&cmd_mtx)) {
         g_error("Failed to lock on mutex.\n");
     }
+    encoder_consumer_acquire();
 
     RecordItem *item = (RecordItem *)user_data;
     gchar *timestr = NULL;
@@ -1143,9 +2935,12 @@ void udpsrc_cmd_rec_start(gpointer user_data) {
     }
 
     g_free(cmdline);
+    watch_udpsrc_loss(item->pipeline);
     gst_element_set_state(item->pipeline, GST_STATE_READY);
 
     gst_element_set_state(item->pipeline, GST_STATE_PLAYING);
+    // the recording starts at a keyframe instead of the next periodic one.
+    request_keyframe(&renditions[0], KEYFRAME_RECORD);
 }
 
 #if !defined(GLIB_AVAILABLE_IN_2_74)
@@ -1175,6 +2970,7 @@ static gboolean stop_udpsrc_rec(gpointer user_data) {
     gst_element_set_state(GST_ELEMENT(rec_pipeline),
                           GST_STATE_NULL);
     g_print("stop udpsrc record.\n");
+    encoder_consumer_release();
 
     gst_object_unref(GST_OBJECT(rec_pipeline));
     if (pthread_mutex_lock(&mtx)) {
@@ -1238,7 +3034,10 @@ static int start_udpsrc_rec(gpointer user_data) {
     rec_pipeline = gst_parse_launch(cmdline, NULL);
 
     g_free(cmdline);
+    watch_udpsrc_loss(rec_pipeline);
     gst_element_set_state(rec_pipeline, GST_STATE_PLAYING);
+    // the recording starts at a keyframe instead of the next periodic one.
+    request_keyframe(&renditions[0], KEYFRAME_RECORD);
 #if defined(GLIB_AVAILABLE_IN_2_74)
     g_timeout_add_once(record_time * 1000, (GSourceOnceFunc)stop_udpsrc_rec, rec_pipeline);
 #else
@@ -1315,6 +3114,9 @@ on_ice_gathering_state_notify(GstElement *webrtcbin, GParamSpec *pspec,
         break;
     case GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE:
         new_state = g_strdup("complete");
+        // user_data is the WebrtcItem of the send sessions.
+        if (user_data != NULL)
+            session_timeline_mark((WebrtcItem *)user_data, SESSION_ICE_COMPLETE);
         break;
     }
     gst_print("%s ICE gathering state changed to %s\n", biname, new_state);
@@ -1355,11 +3157,328 @@ on_peer_connection_state_notify(GstElement *webrtcbin, GParamSpec *pspec,
     g_free(new_state);
 }
 
+static gboolean encoder_has_bitrate(GstElement *encoder) {
+    GObjectClass *klass = G_OBJECT_GET_CLASS(encoder);
+    return g_object_class_find_property(klass, "target-bitrate") || g_object_class_find_property(klass, "bitrate");
+}
+
+/**
+ * @brief x265 ignores vbv-bufsize without vbv-maxrate, both go in the option-string at the build
+ * bitrate, a rate control buffer of three frames as in the low latency profile.
+ */
+static void set_x265_vbv(GstElement *encoder, guint bps) {
+    gint fps = config_data.v4l2src_data.framerate > 0 ? config_data.v4l2src_data.framerate : 30;
+    gchar *options = NULL, **items;
+    GString *str = g_string_new(NULL);
+
+    g_object_get(encoder, "option-string", &options, NULL);
+    items = g_strsplit(options ? options : "", ":", -1);
+    for (gchar **item = items; *item != NULL; item++) {
+        if (!(*item)[0] || g_str_has_prefix(*item, "vbv-maxrate=") || g_str_has_prefix(*item, "vbv-bufsize="))
+            continue;
+        g_string_append_printf(str, "%s%s", str->len ? ":" : "", *item);
+    }
+    g_string_append_printf(str, "%svbv-maxrate=%u:vbv-bufsize=%u", str->len ? ":" : "", bps / 1000,
+                           MAX(bps / 1000 * 3 / fps, 1));
+    g_object_set(encoder, "option-string", str->str, NULL);
+    g_string_free(str, TRUE);
+    g_strfreev(items);
+    g_free(options);
+}
+
+/**
+ * @brief Encoders take the bitrate in kbps, except nvv4l2 and rav1enc (bps) and vpxenc
+ * target-bitrate (bps). All of them accept the bitrate in PLAYING state, the option-string
+ * of x265enc only before, so its vbv keeps the bitrate the encoder was built with.
+ */
+static void set_encoder_bitrate(GstElement *encoder, guint bps) {
+    GObjectClass *klass = G_OBJECT_GET_CLASS(encoder);
+    const gchar *name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(gst_element_get_factory(encoder)));
+
+    if (!g_strcmp0(name, "x265enc") && GST_STATE(encoder) <= GST_STATE_READY)
+        set_x265_vbv(encoder, bps);
+
+    if (g_object_class_find_property(klass, "target-bitrate"))
+        // svtav1enc and av1enc (libaom) take kbps.
+        g_object_set(encoder, "target-bitrate", g_str_has_prefix(name, "vp") ? bps : bps / 1000, NULL);
+    else if (!g_object_class_find_property(klass, "bitrate"))
+        g_print("%s has no bitrate property, keep its default\n", name);
+    else if (g_str_has_prefix(name, "nvv4l2") || !g_strcmp0(name, "rav1enc"))
+        g_object_set(encoder, "bitrate", bps, NULL);
+    else
+        g_object_set(encoder, "bitrate", bps / 1000, NULL);
+}
+
+/** @brief FanoutKeyframeFunc of the hub of the Rendition in user_data. */
+static void request_fanout_keyframe(gpointer user_data) {
+    request_keyframe((Rendition *)user_data, KEYFRAME_LAGGING);
+}
+
+/** the force-key-unit events rtpsession sends upstream for the PLI and FIR of a viewer. */
+static GstPadProbeReturn on_session_keyframe_request(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcItem *item = (WebrtcItem *)user_data;
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+
+    if (GST_EVENT_TYPE(event) != GST_EVENT_CUSTOM_UPSTREAM || !gst_event_has_name(event, "GstForceKeyUnit"))
+        return GST_PAD_PROBE_OK;
+    request_keyframe(&renditions[CLAMP(item->send_avpair.rendition, 0, MAX(n_renditions - 1, 0))], KEYFRAME_PLI);
+    return GST_PAD_PROBE_DROP;
+}
+
+static void watch_keyframe_requests(GstElement *video_src, WebrtcItem *item) {
+    GstPad *pad = gst_element_get_static_pad(video_src, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, on_session_keyframe_request, item, NULL);
+    gst_object_unref(pad);
+}
+
+static FanoutHub *rendition_hub(gint index) {
+    return renditions[index].hub != NULL ? renditions[index].hub : video_hub;
+}
+
+static void fanout_subscribe_avpair(struct _AppsrcAvPair *pair);
+static gboolean poll_session_stats(gpointer user_data);
+
+/** the first rtp packet of any sink pad of webrtcbin, the first one sent after connected. */
+static GstPadProbeReturn
+first_rtp_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    session_timeline_mark((WebrtcItem *)user_data, SESSION_FIRST_RTP);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+static gboolean
+watch_first_rtp(GstElement *webrtcbin, GstPad *pad, gpointer user_data) {
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+                      first_rtp_probe, user_data, NULL);
+    return TRUE;
+}
+
+/**
+ * @brief Start feeding a viewer once its DTLS is up, anything sent before is dropped by webrtcbin,
+ * the appsrc session starts with the cached gop, the udpsrc session asks for a keyframe.
+ */
+static void
+on_send_connection_state_notify(GstElement *webrtcbin, GParamSpec *pspec,
+                                gpointer user_data) {
+    WebrtcItem *item = (WebrtcItem *)user_data;
+    GstWebRTCPeerConnectionState state;
+
+    g_object_get(webrtcbin, "connection-state", &state, NULL);
+    if (state != GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED)
+        return;
+    session_timeline_mark(item, SESSION_CONNECTED);
+    // webrtcbin drops the packets before connected, so the first one after is the first sent.
+    gst_element_foreach_sink_pad(webrtcbin, watch_first_rtp, item);
+    g_mutex_lock(&bwe_lock);
+    if (item->bwe.stats_timer == 0) {
+        item->bwe.stats_timer = g_timeout_add_seconds(BWE_INTERVAL, poll_session_stats, item);
+        bwe_sessions = g_list_prepend(bwe_sessions, item);
+    }
+    g_mutex_unlock(&bwe_lock);
+    if (item->send_avpair.video_src != NULL) {
+        // a late notify must not subscribe a session that stop_appsrc_webrtc tears down.
+        g_mutex_lock(&item->lock);
+        if (!item->stopping && item->send_avpair.video_sub == NULL)
+            fanout_subscribe_avpair(&item->send_avpair);
+        g_mutex_unlock(&item->lock);
+    } else {
+        request_keyframe(&renditions[0], KEYFRAME_JOIN);
+    }
+}
+
+static void fanout_subscribe_avpair(struct _AppsrcAvPair *pair) {
+    FanoutHub *hub = rendition_hub(pair->rendition);
+    if (pair->video_ssrc) {
+        pair->video_sub = fanout_hub_subscribe_rtp(hub, pair->video_src, FANOUT_VIDEO_RING_SIZE, 90000, pair->video_ssrc);
+        pair->audio_sub = fanout_hub_subscribe_rtp(audio_hub, pair->audio_src, FANOUT_AUDIO_RING_SIZE, 48000, pair->audio_ssrc);
+        return;
+    }
+    pair->video_sub = fanout_hub_subscribe(hub, pair->video_src, FANOUT_VIDEO_RING_SIZE);
+    pair->audio_sub = fanout_hub_subscribe(audio_hub, pair->audio_src, FANOUT_AUDIO_RING_SIZE);
+}
+
+typedef struct {
+    guint64 bytes_sent; // the largest outbound-rtp, the video.
+    gdouble loss;       // the worst remote-inbound-rtp fraction lost.
+} SendStats;
+
+static gboolean collect_send_stats(GQuark field_id, const GValue *value, gpointer user_data) {
+    SendStats *stats = (SendStats *)user_data;
+    const GstStructure *s;
+    GstWebRTCStatsType type;
+    guint64 bytes;
+    gdouble loss;
+
+    if (!GST_VALUE_HOLDS_STRUCTURE(value))
+        return TRUE;
+    s = gst_value_get_structure(value);
+    if (!gst_structure_get(s, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL))
+        return TRUE;
+    if (type == GST_WEBRTC_STATS_OUTBOUND_RTP && gst_structure_get_uint64(s, "bytes-sent", &bytes))
+        stats->bytes_sent = MAX(stats->bytes_sent, bytes);
+    else if (type == GST_WEBRTC_STATS_REMOTE_INBOUND_RTP && gst_structure_get_double(s, "fraction-lost", &loss))
+        stats->loss = MAX(stats->loss, loss);
+    return TRUE;
+}
+
+/**
+ * @brief Loss based bandwidth estimate, the loss controller of Google congestion control:
+ * back off by half the loss above 10%, grow 8% per poll below 2%, hold in between.
+ */
+static void update_bandwidth_estimate(WebrtcItem *item, const SendStats *stats) {
+    struct _SessionBwe *bwe = &item->bwe;
+    guint top;
+
+    g_mutex_lock(&rendition_lock);
+    top = n_renditions > 0 ? renditions[0].bitrate : get_exact_bitrate();
+    g_mutex_unlock(&rendition_lock);
+
+    if (bwe->bytes_sent != 0 && stats->bytes_sent >= bwe->bytes_sent)
+        bwe->send_bps = (stats->bytes_sent - bwe->bytes_sent) * 8 / BWE_INTERVAL;
+    bwe->bytes_sent = stats->bytes_sent;
+    bwe->loss = stats->loss;
+    if (bwe->estimate == 0)
+        bwe->estimate = top;
+
+    if (stats->loss > 0.1)
+        bwe->estimate = bwe->estimate * (1.0 - 0.5 * stats->loss);
+    else if (stats->loss < 0.02)
+        bwe->estimate = MIN(bwe->estimate * 1.08, top * 1.5);
+    bwe->estimate = MAX(bwe->estimate, BWE_MIN_BITRATE);
+}
+
+/**
+ * @brief Attach the session to the highest rung under its estimate, down at once,
+ * up one rung after BWE_UP_POLLS polls in a row. The switch itself waits for a keyframe.
+ */
+static void choose_rendition(WebrtcItem *item) {
+    struct _AppsrcAvPair *pair = &item->send_avpair;
+    gint target = n_renditions - 1;
+
+    if (n_renditions < 2 || pair->video_sub == NULL)
+        return;
+    g_mutex_lock(&rendition_lock);
+    for (gint i = 0; i < n_renditions; i++) {
+        if (renditions[i].bitrate <= item->bwe.estimate) {
+            target = i;
+            break;
+        }
+    }
+    g_mutex_unlock(&rendition_lock);
+    if (target < pair->rendition) {
+        if (++item->bwe.up_votes < BWE_UP_POLLS)
+            return;
+        target = pair->rendition - 1;
+    } else if (target == pair->rendition) {
+        item->bwe.up_votes = 0;
+        return;
+    }
+    item->bwe.up_votes = 0;
+    gst_print("client: %" G_GUINT64_FORMAT " estimate %u bps, loss %.2f, switch to %dp\n",
+              item->hash_id, item->bwe.estimate, item->bwe.loss, renditions[target].height);
+    pair->rendition = target;
+    fanout_sub_switch(pair->video_sub, renditions[target].hub);
+}
+
+/**
+ * @brief Congestion control of the shared encoders, every rung runs at the lowest estimate of
+ * the viewers attached to it, between BWE_MIN_BITRATE and its nominal bitrate. The bitrate goes
+ * down at once by more than 10%, and up by more than 10% after BWE_RAISE_POLLS polls in a row.
+ */
+static gboolean control_encoder_bitrate(gpointer user_data) {
+    guint lowest[MAX_RENDITIONS];
+
+    for (gint i = 0; i < MAX_RENDITIONS; i++)
+        lowest[i] = G_MAXUINT;
+    g_mutex_lock(&bwe_lock);
+    for (GList *l = bwe_sessions; l != NULL; l = l->next) {
+        WebrtcItem *item = (WebrtcItem *)l->data;
+        gint index = CLAMP(item->send_avpair.rendition, 0, MAX_RENDITIONS - 1);
+        if (item->bwe.estimate != 0)
+            lowest[index] = MIN(lowest[index], item->bwe.estimate);
+    }
+    g_mutex_unlock(&bwe_lock);
+
+    g_mutex_lock(&rendition_lock);
+    for (gint i = 0; i < n_renditions; i++) {
+        Rendition *rendition = &renditions[i];
+        guint target = MIN(MAX(lowest[i], BWE_MIN_BITRATE), rendition->bitrate);
+
+        if (rendition->encoder == NULL || !encoder_has_bitrate(rendition->encoder) ||
+            g_object_get_data(G_OBJECT(rendition->encoder), "quality") != NULL)
+            continue;
+        if (rendition->current_bitrate == 0)
+            rendition->current_bitrate = rendition->bitrate;
+        if (target > rendition->current_bitrate * 1.1) {
+            if (++rendition->raise_votes < BWE_RAISE_POLLS)
+                continue;
+        } else if (target >= rendition->current_bitrate * 0.9) {
+            rendition->raise_votes = 0;
+            continue;
+        }
+        rendition->raise_votes = 0;
+        gst_print("encoder %dp bitrate %u -> %u bps\n", rendition->height, rendition->current_bitrate, target);
+        rendition->current_bitrate = target;
+        set_encoder_bitrate(rendition->encoder, target);
+    }
+    g_mutex_unlock(&rendition_lock);
+    return G_SOURCE_CONTINUE;
+}
+
+/** the reply of get-stats on the thread of webrtcbin, which stops before the item is freed. */
+static void on_session_stats(GstPromise *promise, gpointer user_data) {
+    WebrtcItem *item = (WebrtcItem *)user_data;
+    SendStats stats = {0, 0.0};
+
+    if (gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED) {
+        const GstStructure *reply = gst_promise_get_reply(promise);
+        if (reply != NULL)
+            gst_structure_foreach(reply, collect_send_stats, &stats);
+    }
+    gst_promise_unref(promise);
+
+    g_mutex_lock(&bwe_lock);
+    item->bwe.pending = FALSE;
+    update_bandwidth_estimate(item, &stats);
+    g_mutex_unlock(&bwe_lock);
+    choose_rendition(item);
+}
+
+static gboolean poll_session_stats(gpointer user_data) {
+    WebrtcItem *item = (WebrtcItem *)user_data;
+    GstPromise *promise;
+
+    // a slow webrtcbin skips polls instead of piling up promises.
+    g_mutex_lock(&bwe_lock);
+    if (item->bwe.pending) {
+        g_mutex_unlock(&bwe_lock);
+        return G_SOURCE_CONTINUE;
+    }
+    item->bwe.pending = TRUE;
+    g_mutex_unlock(&bwe_lock);
+    promise = gst_promise_new_with_change_func(on_session_stats, item, NULL);
+    g_signal_emit_by_name(item->sendbin, "get-stats", NULL, promise);
+    return G_SOURCE_CONTINUE;
+}
+
+/** the pipeline of pair must be in NULL state before unsubscribe. */
+static void fanout_unsubscribe_avpair(struct _AppsrcAvPair *pair) {
+    fanout_hub_unsubscribe(rendition_hub(pair->rendition), pair->video_sub);
+    fanout_hub_unsubscribe(audio_hub, pair->audio_sub);
+    pair->video_sub = NULL;
+    pair->audio_sub = NULL;
+    if (pair->audio_src)
+        gst_object_unref(pair->audio_src);
+    gst_object_unref(pair->video_src);
+    pair->audio_src = NULL;
+    pair->video_src = NULL;
+}
+
 void appsrc_cmd_rec_stop(gpointer user_data) {
     RecordItem *item = (RecordItem *)user_data;
     gst_element_set_state(GST_ELEMENT(item->pipeline),
                           GST_STATE_NULL);
     g_print("stop appsrc record.\n");
+    encoder_consumer_release();
 
     gst_object_unref(GST_OBJECT(item->pipeline));
     if (pthread_mutex_lock(&cmd_mtx)) {
@@ -1369,12 +3488,7 @@ void appsrc_cmd_rec_stop(gpointer user_data) {
     if (pthread_mutex_unlock(&cmd_mtx)) {
         g_error("Failed to lock on mutex.\n");
     }
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_remove(G_AppsrcList, &item->rec_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
-    if (item->rec_avpair.audio_src)
-        gst_object_unref(item->rec_avpair.audio_src);
-    gst_object_unref(item->rec_avpair.video_src);
+    fanout_unsubscribe_avpair(&item->rec_avpair);
     item->pipeline = NULL;
 }
 
@@ -1411,6 +3525,7 @@ static void appsrc_cmd_rec_start(gpointer user_data) {
     if (pthread_mutex_unlock(&cmd_mtx)) {
         g_error("Failed to lock on mutex.\n");
     }
+    encoder_consumer_acquire();
 
     today = get_today_str();
     const gchar *vid_str = "video_appsrc_cmd_rec";
@@ -1466,9 +3581,7 @@ static void appsrc_cmd_rec_start(gpointer user_data) {
     item->rec_avpair.audio_src = config_data.audio.enable ? gst_bin_get_by_name(GST_BIN(item->pipeline), aid_str) : NULL;
 
     // g_signal_connect(appsrc_aid, "need-data", (GCallback)need_data, audio_sink);
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_append(G_AppsrcList, &item->rec_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
+    fanout_subscribe_avpair(&item->rec_avpair);
 }
 
 static gboolean stop_appsrc_rec(gpointer user_data) {
@@ -1489,6 +3602,7 @@ static gboolean stop_appsrc_rec(gpointer user_data) {
     timestr = get_format_current_time();
     gst_println("stop appsrc record at: %s .\n", timestr);
     g_free(timestr);
+    encoder_consumer_release();
 
     // gst_println("after stop record pipeline state: %s !!!!\n", gst_element_state_get_name(state));
     if (pthread_mutex_lock(&mtx)) {
@@ -1499,12 +3613,7 @@ static gboolean stop_appsrc_rec(gpointer user_data) {
         g_error("Failed to lock on mutex.\n");
     }
 
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_remove(G_AppsrcList, &item->rec_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
-    if (item->rec_avpair.audio_src)
-        gst_object_unref(item->rec_avpair.audio_src);
-    gst_object_unref(item->rec_avpair.video_src);
+    fanout_unsubscribe_avpair(&item->rec_avpair);
 
     gst_object_unref(item->pipeline);
     g_free(item);
@@ -1586,9 +3695,7 @@ start_appsrc_record() {
                                            tdata,
                                            (GDestroyNotify)destroy_timeout);
 #endif
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_append(G_AppsrcList, &item->rec_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
+    fanout_subscribe_avpair(&item->rec_avpair);
 }
 
 static gboolean
@@ -1633,6 +3740,7 @@ static GstElement *get_playbin(const gchar *encode_name) {
     GstElement *playbin;
     gchar *desc;
     gchar *lowname = g_ascii_strdown(encode_name, -1);
+    // older browsers name av1 AV1X.
     if (g_strcmp0(encode_name, "AV1X") == 0) {
         g_free(lowname);
         lowname = g_strdup("av1");
@@ -1641,6 +3749,7 @@ static GstElement *get_playbin(const gchar *encode_name) {
     if (g_strcmp0(encode_name, "VP9") == 0 ||
         g_strcmp0(encode_name, "VP8") == 0 ||
         g_strcmp0(encode_name, "AV1X") == 0 ||
+        g_strcmp0(encode_name, "AV1") == 0 ||
         g_strcmp0(encode_name, "H264") == 0) {
         gchar *decname = get_best_decode_name(lowname);
         desc = g_strdup_printf("%s ! %s ! queue leaky=1 ! videoconvert ! autovideosink", rtp, decname);
@@ -1740,7 +3849,8 @@ data_channel_on_open(GObject *dc, gpointer user_data) {
 #endif
     gst_print("data channel opened\n");
     gchar *videoCtrls = get_device_json(config_data.v4l2src_data.device);
-    g_signal_emit_by_name(dc, "send-string", videoCtrls);
+    if (videoCtrls != NULL)
+        g_signal_emit_by_name(dc, "send-string", videoCtrls);
     g_free(videoCtrls);
 }
 
@@ -1938,6 +4048,11 @@ data_channel_on_message_string(GObject *dc, gchar *str, gpointer user_data) {
             gint64 value = json_object_get_int_member(ctrl_object, "value");
             set_ctrl_value(config_data.v4l2src_data.device, id, value);
         }
+    } else if (!g_strcmp0(type_string, "video_mode")) {
+        // {"type":"video_mode","width":640,"height":360,"framerate":15}, a missing field keeps the capture value.
+        set_video_mode(json_object_get_int_member_with_default(root_json_object, "width", 0),
+                       json_object_get_int_member_with_default(root_json_object, "height", 0),
+                       json_object_get_int_member_with_default(root_json_object, "framerate", 0));
     }
 cleanup:
     g_free(tmp_str);
@@ -2070,11 +4185,26 @@ static void start_recv_webrtcbin(gpointer user_data) {
 #endif
 }
 
+static void stop_session_stats(WebrtcItem *item) {
+    g_mutex_lock(&bwe_lock);
+    if (item->bwe.stats_timer) {
+        g_source_remove(item->bwe.stats_timer);
+        item->bwe.stats_timer = 0;
+        bwe_sessions = g_list_remove(bwe_sessions, item);
+    }
+    g_mutex_unlock(&bwe_lock);
+}
+
 static void stop_appsrc_webrtc(gpointer user_data) {
     WebrtcItem *webrtc_entry = (WebrtcItem *)user_data;
 
+    g_mutex_lock(&webrtc_entry->lock);
+    webrtc_entry->stopping = TRUE;
+    g_mutex_unlock(&webrtc_entry->lock);
+    // webrtcbin notifies and answers get-stats on its threads until it is in NULL state.
     gst_element_set_state(GST_ELEMENT(webrtc_entry->sendpipe),
                           GST_STATE_NULL);
+    stop_session_stats(webrtc_entry);
 
     gst_object_unref(GST_OBJECT(webrtc_entry->sendbin));
     gst_object_unref(GST_OBJECT(webrtc_entry->sendpipe));
@@ -2082,36 +4212,95 @@ static void stop_appsrc_webrtc(gpointer user_data) {
     if (webrtc_entry->send_channel)
         g_object_unref(webrtc_entry->send_channel);
 
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_remove(G_AppsrcList, &webrtc_entry->send_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
-    gst_object_unref(webrtc_entry->send_avpair.video_src);
-    gst_object_unref(webrtc_entry->send_avpair.audio_src);
+    fanout_unsubscribe_avpair(&webrtc_entry->send_avpair);
+    encoder_consumer_release();
 }
 
 static void stop_udpsrc_webrtc(gpointer user_data) {
     WebrtcItem *webrtc_entry = (WebrtcItem *)user_data;
 
+    // webrtcbin notifies and answers get-stats on its threads until it is in NULL state.
     gst_element_set_state(GST_ELEMENT(webrtc_entry->sendpipe),
                           GST_STATE_NULL);
+    stop_session_stats(webrtc_entry);
 
     gst_object_unref(GST_OBJECT(webrtc_entry->sendbin));
     gst_object_unref(GST_OBJECT(webrtc_entry->sendpipe));
 
     if (webrtc_entry->send_channel != NULL)
         g_object_unref(webrtc_entry->send_channel);
+    encoder_consumer_release();
 }
 
-void start_udpsrc_webrtcbin(WebrtcItem *item) {
+/**
+ * @brief Pool of appsrc session pipelines which are parsed and in READY state before the viewer
+ * connects, a session is checked out on connect and the pool is refilled by a background thread.
+ */
+typedef struct {
+    GstElement *sendpipe;
+    GstElement *sendbin;
+    GstElement *video_src; // appsrc or udpsrc of forward mode, or NULL.
+    GstElement *audio_src;
+} SessionPipe;
+
+typedef SessionPipe *(*session_builder)(void);
+
+static GAsyncQueue *session_pool = NULL;
+static GThreadPool *session_refill = NULL;
+static session_builder pool_builder = NULL;
+static gint session_serial = 0;
+
+static void refill_session_pool(gpointer data, gpointer user_data) {
+    while (g_async_queue_length(session_pool) < config_data.webrtc.pool_size) {
+        g_async_queue_push(session_pool, pool_builder());
+    }
+}
+
+static void start_session_pool(session_builder builder) {
+    pool_builder = builder;
+    session_pool = g_async_queue_new();
+    // one thread, the sessions are built one after another.
+    session_refill = g_thread_pool_new(refill_session_pool, NULL, 1, FALSE, NULL);
+    g_thread_pool_push(session_refill, session_pool, NULL);
+}
+
+/**
+ * @brief Takes a pre-built session from the pool and refills it in the background,
+ * builds one in place when the pool is off or drained.
+ */
+static SessionPipe *checkout_session(session_builder builder, gboolean *pooled) {
+    SessionPipe *session = NULL;
+    if (session_pool != NULL) {
+        session = g_async_queue_try_pop(session_pool);
+        g_thread_pool_push(session_refill, session_pool, NULL);
+    }
+    *pooled = session != NULL;
+    return session != NULL ? session : builder();
+}
+
+// the pipeline label of the metrics.
+static void name_session_pipeline(GstElement *sendpipe, gint id) {
+    gchar *name = g_strdup_printf("session_%d", id);
+    gst_object_set_name(GST_OBJECT(sendpipe), name);
+    g_free(name);
+}
+
+static SessionPipe *build_udpsrc_session(void) {
+    SessionPipe *session = g_new0(SessionPipe, 1);
     gchar *cmdline = NULL;
     gchar *video_src = NULL;
     // gchar *turn_srv = NULL;
-    gchar *webrtc_name = g_strdup_printf("send_%" G_GUINT64_FORMAT, item->hash_id);
+    gint id = g_atomic_int_add(&session_serial, 1);
+    gchar *webrtc_name = g_strdup_printf("send_%d", id);
 
     gchar *upenc = g_ascii_strup(config_data.videnc, strlen(config_data.videnc));
     // here must have rtph264depay and rtph264pay to be compatible with  mobile browser.
 
-    if (g_str_has_prefix(config_data.videnc, "h26")) {
+    if (config_data.webrtc.forward) {
+        // the caps with sprop-parameter-sets of the udpsink are set at checkout.
+        video_src = g_strdup_printf("udpsrc name=video_%d port=%d multicast-group=%s multicast-iface=lo ! %s. ",
+                                    id, config_data.webrtc.udpsink.port, config_data.webrtc.udpsink.addr, webrtc_name);
+    } else if (g_str_has_prefix(config_data.videnc, "h26")) {
         gchar *rtp = get_rtp_args();
         video_src = g_strdup_printf("udpsrc port=%d multicast-group=%s multicast-iface=lo  socket-timestamp=1  ! "
                                     " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
@@ -2127,7 +4316,11 @@ void start_udpsrc_webrtcbin(WebrtcItem *item) {
 
     g_free(upenc);
     if (audio_source != NULL) {
-        gchar *audio_src = udpsrc_audio_cmdline(webrtc_name);
+        gchar *audio_src = config_data.webrtc.forward
+                               ? g_strdup_printf("udpsrc name=audio_%d port=%d multicast-group=%s multicast-iface=lo ! %s.",
+                                                 id, config_data.webrtc.udpsink.port + 1,
+                                                 config_data.webrtc.udpsink.addr, webrtc_name)
+                               : udpsrc_audio_cmdline(webrtc_name);
         cmdline = g_strdup_printf("webrtcbin name=%s stun-server=stun://%s %s %s ", webrtc_name, config_data.webrtc.stun, audio_src, video_src);
         // g_print("webrtc cmdline: %s \n", cmdline);
         g_free(audio_src);
@@ -2140,21 +4333,54 @@ void start_udpsrc_webrtcbin(WebrtcItem *item) {
         // g_free(turn_srv);
     }
     // g_print("webrtc cmdline: %s \n", cmdline);
-    item->sendpipe = gst_parse_launch(cmdline, NULL);
-    gst_element_set_state(item->sendpipe, GST_STATE_READY);
-
+    session->sendpipe = gst_parse_launch(cmdline, NULL);
     g_free(cmdline);
+    name_session_pipeline(session->sendpipe, id);
+    if (config_data.webrtc.forward) {
+        gchar *name = g_strdup_printf("video_%d", id);
+        session->video_src = gst_bin_get_by_name(GST_BIN(session->sendpipe), name);
+        g_free(name);
+        name = g_strdup_printf("audio_%d", id);
+        session->audio_src = gst_bin_get_by_name(GST_BIN(session->sendpipe), name);
+        g_free(name);
+    }
+    watch_udpsrc_loss(session->sendpipe);
 
-    item->sendbin = gst_bin_get_by_name(GST_BIN(item->sendpipe), webrtc_name);
+    session->sendbin = gst_bin_get_by_name(GST_BIN(session->sendpipe), webrtc_name);
     if (config_data.webrtc.turn.enable) {
-        webrtcbin_add_turn(item->sendbin);
+        webrtcbin_add_turn(session->sendbin);
     }
     g_free(webrtc_name);
+    gst_element_set_state(session->sendpipe, GST_STATE_READY);
+    return session;
+}
+
+void start_udpsrc_webrtcbin(WebrtcItem *item) {
+    SessionPipe *session = checkout_session(build_udpsrc_session, &item->pooled);
+    encoder_consumer_acquire();
+    item->sendpipe = session->sendpipe;
+    item->sendbin = session->sendbin;
+    if (session->video_src != NULL) {
+        // the udpsink caps are only known once the encoder runs, so they are set here, not at build.
+        set_forward_caps(session->video_src, video_rtp_sink, NULL);
+        watch_keyframe_requests(session->video_src, item);
+        gst_object_unref(session->video_src);
+    }
+    if (session->audio_src != NULL) {
+        set_forward_caps(session->audio_src, audio_rtp_sink, NULL);
+        gst_object_unref(session->audio_src);
+    }
+    g_free(session);
+
     item->record.get_rec_state = &get_record_state;
     item->record.start = &udpsrc_cmd_rec_start;
     item->record.stop = &udpsrc_cmd_rec_stop;
     item->recv.addremote = &start_recv_webrtcbin;
     item->stop_webrtc = &stop_udpsrc_webrtc;
+    g_signal_connect(item->sendbin, "notify::ice-gathering-state",
+                     G_CALLBACK(on_ice_gathering_state_notify), item);
+    g_signal_connect(item->sendbin, "notify::connection-state",
+                     G_CALLBACK(on_send_connection_state_notify), item);
 
     create_data_channel((gpointer)item);
 #if 0
@@ -2203,6 +4429,7 @@ int start_av_udpsink() {
         }
     }
 
+    watch_frame_sizes(video_pay);
     link_request_src_pad(video_encoder, vqueue);
 
     if (audio_source != NULL) {
@@ -2221,7 +4448,9 @@ int start_av_udpsink() {
             return -1;
         }
         link_request_src_pad(audio_source, aqueue);
+        audio_rtp_sink = audio_sink;
     }
+    video_rtp_sink = video_sink;
 #if 1
     gst_debug_bin_to_dot_file_with_ts(GST_BIN(pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "udpsink_webrtc");
 #endif
@@ -2346,30 +4575,47 @@ check_webrtcbin_state_by_timer(GstElement *webrtcbin) {
     g_signal_emit_by_name(G_OBJECT(webrtcbin), "notify::ice-connection-state", NULL, NULL);
 }
 
-void start_appsrc_webrtcbin(WebrtcItem *item) {
+static SessionPipe *build_appsrc_session(void) {
+    SessionPipe *session = g_new0(SessionPipe, 1);
     gchar *cmdline = NULL;
     // gchar *turn_srv = NULL;
+    gint id = g_atomic_int_add(&session_serial, 1);
 
-    gchar *webrtc_name = g_strdup_printf("webrtc_appsrc_%" G_GUINT64_FORMAT, item->hash_id);
+    gchar *webrtc_name = g_strdup_printf("webrtc_appsrc_%d", id);
     // vcaps = gst_caps_from_string("video/x-h264,stream-format=(string)avc,alignment=(string)au,width=(int)1280,height=(int)720,framerate=(fraction)30/1,profile=(string)main");
     // acaps = gst_caps_from_string("audio/x-opus, channels=(int)1,channel-mapping-family=(int)1");
     gchar *upenc = g_ascii_strup(config_data.videnc, strlen(config_data.videnc));
-    gchar *rtp = get_rtp_args();
-    gchar *video_src = g_strdup_printf("appsrc  name=video_%" G_GUINT64_FORMAT " format=3 leaky-type=2 ! "
-                                       " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
-                                       " %s ! rtp%spay  ! queue leaky=2 !"
-                                       " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
-                                       " queue leaky=2 ! %s. ",
-                                       item->hash_id, upenc, rtp, config_data.videnc, upenc, webrtc_name);
+    gchar *video_src, *audio_src = NULL;
+    if (config_data.webrtc.forward) {
+        // the shared rtp packets go to webrtcbin as is, the caps are set at checkout.
+        video_src = g_strdup_printf("appsrc  name=video_%d format=3 block=true ! %s. ",
+                                    id, webrtc_name);
+        if (audio_source != NULL)
+            audio_src = g_strdup_printf("appsrc name=audio_%d  format=3 block=true ! %s.",
+                                        id, webrtc_name);
+    } else {
+        gchar *rtp = get_rtp_args();
+        /**
+         * @note The appsrc blocks instead of leaking, so a slow viewer backs up into its fanout ring,
+         * which drops whole access units up to the next keyframe.
+         */
+        video_src = g_strdup_printf("appsrc  name=video_%d format=3 block=true ! "
+                                    " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
+                                    " %s ! rtp%spay  ! queue !"
+                                    " application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)%s,payload=(int)96 ! "
+                                    " queue ! %s. ",
+                                    id, upenc, rtp, config_data.videnc, upenc, webrtc_name);
+        g_free(rtp);
+        if (audio_source != NULL)
+            audio_src = g_strdup_printf("appsrc name=audio_%d  format=3 block=true ! "
+                                        " application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS,payload=(int)97 ! "
+                                        " rtpopusdepay ! rtpopuspay ! queue ! "
+                                        " application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS,payload=(int)97 ! "
+                                        " queue ! %s.",
+                                        id, webrtc_name);
+    }
     g_free(upenc);
-    g_free(rtp);
-    if (audio_source != NULL) {
-        gchar *audio_src = g_strdup_printf("appsrc name=audio_%" G_GUINT64_FORMAT "  format=3 leaky-type=2 ! "
-                                           " application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS,payload=(int)97 ! "
-                                           " rtpopusdepay ! rtpopuspay ! queue leaky=2 ! "
-                                           " application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS,payload=(int)97 ! "
-                                           " queue leaky=2 ! %s.",
-                                           item->hash_id, webrtc_name);
+    if (audio_src != NULL) {
         cmdline = g_strdup_printf("webrtcbin name=%s stun-server=stun://%s %s %s ", webrtc_name, config_data.webrtc.stun, audio_src, video_src);
         g_free(audio_src);
     } else {
@@ -2382,48 +4628,65 @@ void start_appsrc_webrtcbin(WebrtcItem *item) {
     // g_print("webrtc cmdline: %s \n", cmdline);
     g_free(video_src);
 
-    item->sendpipe = gst_parse_launch(cmdline, NULL);
+    session->sendpipe = gst_parse_launch(cmdline, NULL);
     g_free(cmdline);
+    name_session_pipeline(session->sendpipe, id);
 
-    item->sendbin = gst_bin_get_by_name(GST_BIN(item->sendpipe), webrtc_name);
+    session->sendbin = gst_bin_get_by_name(GST_BIN(session->sendpipe), webrtc_name);
     if (config_data.webrtc.turn.enable) {
-        webrtcbin_add_turn(item->sendbin);
+        webrtcbin_add_turn(session->sendbin);
     }
     g_free(webrtc_name);
 
-    webrtc_name = g_strdup_printf("video_%" G_GUINT64_FORMAT, item->hash_id);
-    item->send_avpair.video_src = gst_bin_get_by_name(GST_BIN(item->sendpipe), webrtc_name);
+    webrtc_name = g_strdup_printf("video_%d", id);
+    session->video_src = gst_bin_get_by_name(GST_BIN(session->sendpipe), webrtc_name);
+    g_free(webrtc_name);
+
+    webrtc_name = g_strdup_printf("audio_%d", id);
+    session->audio_src = gst_bin_get_by_name(GST_BIN(session->sendpipe), webrtc_name);
     g_free(webrtc_name);
+
+    gst_element_set_state(session->sendpipe, GST_STATE_READY);
+    return session;
+}
+
+void start_appsrc_webrtcbin(WebrtcItem *item) {
+    SessionPipe *session = checkout_session(build_appsrc_session, &item->pooled);
+    encoder_consumer_acquire();
+    item->sendpipe = session->sendpipe;
+    item->sendbin = session->sendbin;
+    item->send_avpair.video_src = session->video_src;
+    item->send_avpair.audio_src = session->audio_src;
+    g_free(session);
+    watch_keyframe_requests(item->send_avpair.video_src, item);
 #if 0
     g_signal_connect(item->send_avpair.video_src, "enough-data", (GCallback)on_enough_data, NULL);
     g_signal_connect(item->send_avpair.video_src, "need-data", (GCallback)need_data, NULL);
 #endif
 
-    webrtc_name = g_strdup_printf("audio_%" G_GUINT64_FORMAT, item->hash_id);
-    item->send_avpair.audio_src = gst_bin_get_by_name(GST_BIN(item->sendpipe), webrtc_name);
-    g_free(webrtc_name);
+    if (config_data.webrtc.forward) {
+        set_forward_caps(item->send_avpair.video_src, video_rtp_sink, &item->send_avpair.video_ssrc);
+        set_forward_caps(item->send_avpair.audio_src, audio_rtp_sink, &item->send_avpair.audio_ssrc);
+    }
 #if 0
     g_signal_connect(item->send_avpair.audio_src, "enough-data", (GCallback)on_enough_data, NULL);
     g_signal_connect(item->send_avpair.audio_src, "need-data", (GCallback)need_data, NULL);
 #endif
-    g_mutex_lock(&G_appsrc_lock);
-    G_AppsrcList = g_list_append(G_AppsrcList, &item->send_avpair);
-    g_mutex_unlock(&G_appsrc_lock);
-
-    gst_element_set_state(item->sendpipe, GST_STATE_READY);
     create_data_channel((gpointer)item);
-
     item->record.get_rec_state = &get_record_state;
     item->record.start = &appsrc_cmd_rec_start;
     item->record.stop = &appsrc_cmd_rec_stop;
     item->recv.addremote = &start_recv_webrtcbin;
     item->stop_webrtc = &stop_appsrc_webrtc;
     g_signal_connect(item->sendbin, "notify::ice-gathering-state",
-                     G_CALLBACK(on_ice_gathering_state_notify), NULL);
+                     G_CALLBACK(on_ice_gathering_state_notify), item);
 
     g_signal_connect(item->sendbin, "notify::ice-connection-state",
                      G_CALLBACK(on_peer_connection_state_notify), NULL);
 
+    g_signal_connect(item->sendbin, "notify::connection-state",
+                     G_CALLBACK(on_send_connection_state_notify), item);
+
     g_signal_connect(item->sendbin, "on-new-transceiver",
                      G_CALLBACK(_on_new_transceiver), item->sendbin);
     g_timeout_add(3 * 1000, (GSourceFunc)check_webrtcbin_state_by_timer, item->sendbin);
@@ -2433,10 +4696,7 @@ static GstFlowReturn
 on_new_sample_from_sink(GstElement *elt, gpointer user_data) {
     GstSample *sample;
     GstFlowReturn ret;
-    gchar *sink_name = gst_element_get_name(elt);
-    // g_print("new sample from :%s\n", sink_name);
-    gboolean isVideo = g_str_has_prefix(sink_name, "video");
-    g_free(sink_name);
+    FanoutHub *hub = (FanoutHub *)user_data;
 
     sample = gst_app_sink_pull_sample(GST_APP_SINK(elt));
     ret = GST_FLOW_ERROR;
@@ -2456,27 +4716,156 @@ on_new_sample_from_sink(GstElement *elt, gpointer user_data) {
             dts = gst_segment_to_running_time(seg, GST_FORMAT_TIME, dts);
 
         if (buffer) {
-            /* Make writable so we can adjust the timestamps */
-            buffer = gst_buffer_copy(buffer);
+            /**
+             * @note Take the buffer out of the sample, once the sample is gone we are the
+             * only owner (enable-last-sample is off), so make_writable does not copy the payload.
+             */
+            buffer = gst_buffer_ref(buffer);
+            gst_sample_unref(sample);
+            buffer = gst_buffer_make_writable(buffer);
             GST_BUFFER_PTS(buffer) = pts;
             GST_BUFFER_DTS(buffer) = dts;
-            GList *item;
-            g_mutex_lock(&G_appsrc_lock);
-            for (item = G_AppsrcList; item; item = item->next) {
-                AppSrcAVPair *pair = item->data;
-                g_signal_emit_by_name(isVideo ? pair->video_src : pair->audio_src, "push-buffer", buffer, &ret);
-            }
-            g_mutex_unlock(&G_appsrc_lock);
-
-            gst_buffer_unref(buffer);
+            fanout_hub_push(hub, buffer);
+        } else {
+            gst_sample_unref(sample);
         }
-
-        /* we don't need the appsink sample anymore */
-        gst_sample_unref(sample);
     }
     return ret;
 }
 
+
+/**
+ * @brief Encode a smaller rung of the ladder off the raw video_source tee into its own hub.
+ */
+static int start_rendition(Rendition *rendition) {
+    GstElement *queue, *convert, *capsfilter, *encoder, *last, *video_pay, *video_sink;
+    GstCaps *caps;
+    gchar *tmpname;
+
+    MAKE_ELEMENT_AND_ADD(queue, "queue");
+    MAKE_ELEMENT_AND_ADD(capsfilter, "capsfilter");
+    // a busy encoder drops raw frames of its own rung instead of stalling the capture tee.
+    g_object_set(queue, "leaky", 2, "max-size-buffers", 2, "max-size-bytes", 0, "max-size-time", (guint64)0, NULL);
+#if defined(HAS_JETSON_NANO)
+    // nvvidconv converts and scales in NVMM memory for the nvv4l2 encoders.
+    MAKE_ELEMENT_AND_ADD(convert, "nvvidconv");
+    tmpname = g_strdup_printf("video/x-raw(memory:NVMM),width=%d,height=%d", rendition->width, rendition->height);
+    caps = gst_caps_from_string(tmpname);
+    g_free(tmpname);
+    g_object_set(capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    if (!gst_element_link_many(queue, convert, capsfilter, NULL)) {
+        g_printerr("Failed to link elements of %dp rendition\n", rendition->height);
+        return -1;
+    }
+#else
+    GstElement *scale;
+    MAKE_ELEMENT_AND_ADD(convert, "videoconvert");
+    MAKE_ELEMENT_AND_ADD(scale, "videoscale");
+    caps = gst_caps_new_simple("video/x-raw", "width", G_TYPE_INT, rendition->width,
+                               "height", G_TYPE_INT, rendition->height, NULL);
+    g_object_set(capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    if (!gst_element_link_many(queue, convert, scale, capsfilter, NULL)) {
+        g_printerr("Failed to link elements of %dp rendition\n", rendition->height);
+        return -1;
+    }
+    tmpname = g_strdup_printf("%dp rendition", rendition->height);
+    watch_convert_cost(convert, tmpname);
+    g_free(tmpname);
+#endif
+
+    encoder = get_video_encoder_by_name(config_data.videnc);
+    if (encoder == NULL)
+        return -1;
+    if (g_object_get_data(G_OBJECT(encoder), "quality") == NULL)
+        set_encoder_bitrate(encoder, rendition->bitrate);
+    tmpname = g_strdup_printf("%dp rendition", rendition->height);
+    count_encoder_element(tmpname, encoder);
+    g_free(tmpname);
+    watch_encoder_roi(encoder, rendition);
+    last = encoder;
+#if !defined(HAS_JETSON_NANO)
+    if (g_str_has_prefix(config_data.videnc, "h264"))
+        last = get_h264_caps();
+#endif
+    if (!gst_element_link_many(capsfilter, encoder, NULL) ||
+        (last != encoder && !gst_element_link(encoder, last))) {
+        g_printerr("Failed to link encoder of %dp rendition\n", rendition->height);
+        return -1;
+    }
+
+    if (g_strcmp0(config_data.videnc, "vp8")) {
+        GstElement *videoparse;
+        tmpname = g_strdup_printf("%sparse", config_data.videnc);
+        MAKE_ELEMENT_AND_ADD(videoparse, tmpname);
+        g_free(tmpname);
+        if (!gst_element_link(last, videoparse))
+            return -1;
+        last = videoparse;
+    }
+
+    tmpname = g_strdup_printf("rtp%spay", config_data.videnc);
+    MAKE_ELEMENT_AND_ADD(video_pay, tmpname);
+    g_free(tmpname);
+    if (g_str_has_prefix(config_data.videnc, "h26")) {
+        g_object_set(video_pay, "config-interval", -1, "aggregate-mode", 1, NULL);
+    }
+    video_sink = gst_element_factory_make("appsink", NULL);
+    g_object_set(video_sink, "sync", FALSE, "async", FALSE, "enable-last-sample", FALSE,
+                 "emit-signals", TRUE, "drop", TRUE, "max-buffers", 100, NULL);
+    gst_bin_add(GST_BIN(pipeline), video_sink);
+    if (!gst_element_link_many(last, video_pay, video_sink, NULL)) {
+        g_printerr("Failed to link payloader of %dp rendition\n", rendition->height);
+        return -1;
+    }
+    link_through_encoder_gate(video_source, queue);
+
+    tmpname = g_strdup_printf("video_%dp", rendition->height);
+    rendition->encoder = encoder;
+    rendition->rtp_sink = video_sink;
+    rendition->hub = fanout_hub_new(tmpname);
+    g_free(tmpname);
+    if (config_data.webrtc.keyframe_drop)
+        fanout_hub_set_keyframe_policy(rendition->hub, config_data.videnc,
+                                       config_data.webrtc.request_keyframe ? request_fanout_keyframe : NULL,
+                                       rendition);
+    g_signal_connect(video_sink, "new-sample",
+                     (GCallback)on_new_sample_from_sink, rendition->hub);
+    g_print("rendition %dx%d at %u bps\n", rendition->width, rendition->height, rendition->bitrate);
+    return 0;
+}
+
+/**
+ * @brief Rung 0 is the shared encoder at the capture size, the configured ladder heights
+ * get the bitrate model of their size, or a configured bitrate scaled by their share of pixels.
+ */
+static void start_renditions(GstElement *video_sink) {
+    gint width = renditions[0].width;
+    gint height = renditions[0].height;
+
+    renditions[0].rtp_sink = video_sink;
+    renditions[0].hub = video_hub;
+    for (gint i = 0; i < config_data.webrtc.ladder.count && n_renditions < MAX_RENDITIONS; i++) {
+        Rendition *rendition = &renditions[n_renditions];
+        gint h = config_data.webrtc.ladder.height[i];
+        if (h <= 0 || h >= renditions[n_renditions - 1].height) {
+            g_print("skip ladder height %d, the heights must go down from %d\n", h, height);
+            continue;
+        }
+        rendition->height = h;
+        rendition->width = (gint)((gint64)width * h / height) & ~1;
+        if (config_data.bitrate > 0)
+            rendition->bitrate = MAX((guint)((guint64)renditions[0].bitrate * rendition->width * h / ((guint64)width * height)),
+                                     BWE_MIN_BITRATE);
+        else
+            rendition->bitrate = get_model_bitrate(config_data.videnc, rendition->width, h,
+                                                   config_data.v4l2src_data.framerate);
+        if (start_rendition(rendition) == 0)
+            n_renditions++;
+    }
+}
+
 int start_av_appsink() {
     if (!_check_initial_status())
         return -1;
@@ -2488,7 +4877,7 @@ int start_av_appsink() {
 
     video_sink = gst_element_factory_make("appsink", "video_sink");
     /* Configure udpsink */
-    g_object_set(video_sink, "sync", FALSE, "async", FALSE,
+    g_object_set(video_sink, "sync", FALSE, "async", FALSE, "enable-last-sample", FALSE,
                  "emit-signals", TRUE, "drop", TRUE, "max-buffers", 100, NULL);
     if (g_str_has_prefix(config_data.videnc, "h26")) {
         g_object_set(video_pay, "config-interval", -1, "aggregate-mode", 1, NULL);
@@ -2515,10 +4904,18 @@ int start_av_appsink() {
         }
     }
 
+    watch_frame_sizes(video_pay);
     link_request_src_pad(video_encoder, vqueue);
 
+    video_rtp_sink = video_sink;
+    video_hub = fanout_hub_new("video");
+    if (config_data.webrtc.keyframe_drop)
+        fanout_hub_set_keyframe_policy(video_hub, config_data.videnc,
+                                       config_data.webrtc.request_keyframe ? request_fanout_keyframe : NULL,
+                                       &renditions[0]);
     g_signal_connect(video_sink, "new-sample",
-                     (GCallback)on_new_sample_from_sink, NULL);
+                     (GCallback)on_new_sample_from_sink, video_hub);
+    start_renditions(video_sink);
 
     if (audio_source != NULL) {
         audio_sink = gst_element_factory_make("appsink", "audio_sink");
@@ -2526,7 +4923,7 @@ int start_av_appsink() {
         MAKE_ELEMENT_AND_ADD(audio_pay, "rtpopuspay");
         MAKE_ELEMENT_AND_ADD(aqueue, "queue");
         g_object_set(aqueue, "leaky", 1, NULL);
-        g_object_set(audio_sink, "sync", FALSE, "async", FALSE,
+        g_object_set(audio_sink, "sync", FALSE, "async", FALSE, "enable-last-sample", FALSE,
                      "emit-signals", TRUE, "drop", TRUE,
                      "max-buffers", 200, NULL);
         g_object_set(audio_pay, "pt", 97, NULL);
@@ -2537,38 +4934,105 @@ int start_av_appsink() {
         }
 
         link_request_src_pad(audio_source, aqueue);
+        audio_rtp_sink = audio_sink;
+        audio_hub = fanout_hub_new("audio");
         g_signal_connect(audio_sink, "new-sample",
-                         (GCallback)on_new_sample_from_sink, NULL);
+                         (GCallback)on_new_sample_from_sink, audio_hub);
     }
 
-    g_mutex_init(&G_appsrc_lock);
-
     return 0;
 }
 
+// a recording on the shared encoder this far behind drops the rest of the gop.
+#define RECORD_QUEUE_TIME (4 * GST_SECOND)
+
+typedef struct {
+    GstElement *queue;
+    gboolean dropping;
+    guint64 dropped;
+} RecordGate;
+
+/**
+ * @brief Drops whole access units from where the queue of a shared recording fills up to the
+ * next keyframe, the file keeps every gop it has from its start and never a frame without its
+ * references. The queue is not leaky, its limit is headroom above RECORD_QUEUE_TIME.
+ */
+static GstPadProbeReturn record_gate_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    RecordGate *gate = (RecordGate *)user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    guint64 level = 0;
+
+    if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) && gate->dropping) {
+        gate->dropped++;
+        return GST_PAD_PROBE_DROP;
+    }
+    g_object_get(gate->queue, "current-level-time", &level, NULL);
+    if (level < RECORD_QUEUE_TIME) {
+        if (gate->dropping && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+            gst_print("%s resumes at a keyframe after %" G_GUINT64_FORMAT " dropped frames\n",
+                      GST_OBJECT_NAME(gate->queue), gate->dropped);
+            gate->dropping = FALSE;
+        }
+        return GST_PAD_PROBE_OK;
+    }
+    if (!gate->dropping)
+        gst_print("%s is %.1f s behind, dropping to the next keyframe\n",
+                  GST_OBJECT_NAME(gate->queue), level / (gdouble)GST_SECOND);
+    gate->dropping = TRUE;
+    gate->dropped++;
+    return GST_PAD_PROBE_DROP;
+}
+
+/** the queue in front of a recording that takes the encoded video of the shared encoder. */
+static void set_record_queue(GstElement *queue) {
+    RecordGate *gate = g_new0(RecordGate, 1);
+    GstPad *pad = gst_element_get_static_pad(queue, "sink");
+    gate->queue = queue;
+    g_object_set(queue, "leaky", 0, "max-size-buffers", 0, "max-size-bytes", 0,
+                 "max-size-time", (guint64)(RECORD_QUEUE_TIME + 2 * GST_SECOND), NULL);
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, record_gate_probe, gate, g_free);
+    gst_object_unref(pad);
+}
+
 int splitfile_sink() {
     if (!_check_initial_status())
         return -1;
     GstElement *splitmuxsink, *videoparse, *vqueue, *clock, *encoder, *textoverlay;
 
     gchar *tmpfile;
-    encoder = get_hardware_h264_encoder();
     gchar *outdir = g_strconcat(config_data.root_dir, "/daily_record", NULL);
     MAKE_ELEMENT_AND_ADD(splitmuxsink, "splitmuxsink");
-    MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
     MAKE_ELEMENT_AND_ADD(vqueue, "queue");
-    MAKE_ELEMENT_AND_ADD(clock, "clockoverlay");
-    g_object_set(clock, "time-format", "%D %H:%M:%S", NULL);
-    MAKE_ELEMENT_AND_ADD(textoverlay, "textoverlay");
-    g_object_set(textoverlay, "text", g_getenv("LANG"),
-                 "valignment", 1, // bottom
-                 "halignment", 0, // left
-                 NULL);
-
     g_object_set(vqueue, "leaky", 1, NULL);
-    if (!gst_element_link_many(vqueue, clock, textoverlay, encoder, videoparse, splitmuxsink, NULL)) {
-        g_error("Failed to link elements splitmuxsink.\n");
-        return -1;
+    if (can_share_encoder()) {
+        // the live stream already carries the clock overlay.
+        tmpfile = g_strdup_printf("%sparse", config_data.videnc);
+        MAKE_ELEMENT_AND_ADD(videoparse, tmpfile);
+        g_free(tmpfile);
+        if (!gst_element_link_many(vqueue, videoparse, splitmuxsink, NULL)) {
+            g_error("Failed to link elements splitmuxsink.\n");
+            return -1;
+        }
+        set_record_queue(vqueue);
+        shared_mp4_record = TRUE;
+        shared_branches++;
+        // a permanent consumer, the shared encoder never idles.
+        encoder_consumer_acquire();
+    } else {
+        encoder = get_hardware_h264_encoder();
+        count_encoder_element("splitfile", encoder);
+        MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
+        MAKE_ELEMENT_AND_ADD(clock, "clockoverlay");
+        g_object_set(clock, "time-format", "%D %H:%M:%S", NULL);
+        MAKE_ELEMENT_AND_ADD(textoverlay, "textoverlay");
+        g_object_set(textoverlay, "text", g_getenv("LANG"),
+                     "valignment", 1, // bottom
+                     "halignment", 0, // left
+                     NULL);
+        if (!gst_element_link_many(vqueue, clock, textoverlay, encoder, videoparse, splitmuxsink, NULL)) {
+            g_error("Failed to link elements splitmuxsink.\n");
+            return -1;
+        }
     }
     tmpfile = g_strconcat(outdir, "/segment-%05d.mp4", NULL);
     g_object_set(splitmuxsink,
@@ -2580,7 +5044,7 @@ int splitfile_sink() {
     _mkdir(outdir, 0755);
     g_free(outdir);
 
-    link_request_src_pad(video_source, vqueue);
+    link_request_src_pad(can_share_encoder() ? video_encoder : video_source, vqueue);
 
 #if 0
     // add audio to muxer.
@@ -2636,24 +5100,42 @@ int av_hlssink() {
     GstElement *hlssink, *videoparse, *mpegtsmux, *vqueue, *encoder;
     if (!_check_initial_status())
         return -1;
-    encoder = get_hardware_h264_encoder();
     gchar *outdir = g_strconcat(config_data.root_dir, "/hls", NULL);
     MAKE_ELEMENT_AND_ADD(hlssink, "hlssink");
-    MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
     MAKE_ELEMENT_AND_ADD(vqueue, "queue");
     MAKE_ELEMENT_AND_ADD(mpegtsmux, "mpegtsmux");
     g_object_set(vqueue, "leaky", 1, NULL);
-    if (!gst_element_link_many(vqueue, videoparse, mpegtsmux, hlssink, NULL)) {
-        g_error("Failed to link elements av hlssink\n");
-        return -1;
+    if (can_share_encoder()) {
+        gchar *tmpname = g_strdup_printf("%sparse", config_data.videnc);
+        MAKE_ELEMENT_AND_ADD(videoparse, tmpname);
+        g_free(tmpname);
+        if (!gst_element_link_many(vqueue, videoparse, mpegtsmux, hlssink, NULL)) {
+            g_error("Failed to link elements av hlssink\n");
+            return -1;
+        }
+        set_record_queue(vqueue);
+        shared_branches++;
+        // a permanent consumer, the shared encoder never idles.
+        encoder_consumer_acquire();
+        link_request_src_pad(video_encoder, vqueue);
+    } else {
+        // mpegtsmux does not take vp8 and vp9, encode h264 of the raw video.
+        GstElement *convert;
+        encoder = get_hardware_h264_encoder();
+        count_encoder_element("av hls", encoder);
+        MAKE_ELEMENT_AND_ADD(convert, "videoconvert");
+        MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
+        if (!gst_element_link_many(vqueue, convert, encoder, videoparse, mpegtsmux, hlssink, NULL)) {
+            g_error("Failed to link elements av hlssink\n");
+            return -1;
+        }
+        watch_convert_cost(convert, "av hls");
+        link_request_src_pad(video_source, vqueue);
     }
-    g_object_set(vqueue, "leaky", 1, NULL);
     set_hlssink_object(hlssink, outdir, "/segment%05d.ts");
 
     _mkdir(outdir, 0755);
     g_free(outdir);
-
-    link_request_src_pad(encoder, vqueue);
     // add audio to muxer.
     if (audio_source != NULL) {
         GstElement *aqueue, *opusparse;
@@ -2723,6 +5205,7 @@ int udp_multicastsink() {
     }
 
     link_request_src_pad_with_dst_name(video_encoder, bin, "video_sink");
+    encoder_consumer_acquire();
 
     return 0;
 }
@@ -2761,7 +5244,9 @@ int motion_hlssink() {
     _mkdir(outdir, 0755);
     gchar *hlssinkstr = get_hlssink_string(outdir, "/motion-%05d.ts");
     gchar *tmp2 = g_strconcat(outdir, "/motioncells", NULL);
-    gchar *tmp = g_strdup_printf("motioncells datafile=%s ", tmp2);
+    // every frame with motion posts its cells for the regions of interest.
+    gchar *tmp = g_strdup_printf("motioncells datafile=%s postallmotion=%s ", tmp2,
+                                 config_data.roi_delta_qp ? "true" : "false");
     gchar *hlsbin = get_hlssink_bin(tmp);
     gchar *binstr = g_strdup_printf(" %s ! %s ",
                                     hlsbin, hlssinkstr);
@@ -2779,6 +5264,7 @@ int motion_hlssink() {
     g_free(binstr);
     g_free(tmp2);
     g_free(outdir);
+    count_encoder("motion hls", "nvv4l2h264enc");
     gst_element_sync_state_with_parent(motionbin);
     gst_bin_add(GST_BIN(pipeline), motionbin);
     return link_request_src_pad(video_source, motionbin);
@@ -2793,6 +5279,7 @@ int motion_hlssink() {
 
     gchar *outdir = g_strconcat(config_data.root_dir, "/hls/motion", NULL);
     encoder = get_hardware_h264_encoder();
+    count_encoder_element("motion hls", encoder);
 
     MAKE_ELEMENT_AND_ADD(hlssink, "hlssink");
     MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
@@ -2829,13 +5316,16 @@ int motion_hlssink() {
     gchar *tmp2;
     tmp2 = g_strconcat(outdir, "/motioncells", NULL);
     g_object_set(motioncells,
-                 // "postallmotion", TRUE,
+                 // every frame with motion posts its cells for the regions of interest.
+                 "postallmotion", config_data.roi_delta_qp != 0,
                  "datafile", tmp2,
                  NULL);
     g_free(tmp2);
     _mkdir(outdir, 0755);
     g_free(outdir);
-    return link_request_src_pad(video_source, pre_convert);
+    watch_convert_cost(pre_convert, "motion pre");
+    watch_convert_cost(post_convert, "motion post");
+    return link_request_src_pad(get_analysis_source(motioncells), pre_convert);
 }
 #endif
 
@@ -2863,6 +5353,7 @@ int cvtracker_hlssink() {
     }
     g_free(binstr);
     g_free(outdir);
+    count_encoder("cvtracker hls", "nvv4l2h264enc");
     gst_element_sync_state_with_parent(trackerbin);
     gst_bin_add(GST_BIN(pipeline), trackerbin);
     return link_request_src_pad(video_source, trackerbin);
@@ -2878,6 +5369,7 @@ int cvtracker_hlssink() {
 
     gchar *outdir = g_strconcat(config_data.root_dir, "/hls/cvtracker", NULL);
     encoder = get_hardware_h264_encoder();
+    count_encoder_element("cvtracker hls", encoder);
 
     MAKE_ELEMENT_AND_ADD(hlssink, "hlssink");
     MAKE_ELEMENT_AND_ADD(videoparse, "h264parse");
@@ -2888,7 +5380,17 @@ int cvtracker_hlssink() {
     MAKE_ELEMENT_AND_ADD(mpegtsmux, "mpegtsmux");
     MAKE_ELEMENT_AND_ADD(clock, "clockoverlay");
     g_object_set(clock, "time-format", "%D %H:%M:%S", NULL);
-    g_object_set(cvtracker, "object-initial-x", 600, "object-initial-y", 300, "object-initial-height", 100, "object-initial-width", 100, NULL);
+    {
+        // the box is in capture pixels, cvtracker runs on the analysis stream.
+        gint width, height, framerate;
+        gdouble sx, sy;
+
+        get_analysis_size(&width, &height, &framerate);
+        sx = (gdouble)width / config_data.v4l2src_data.width;
+        sy = (gdouble)height / config_data.v4l2src_data.height;
+        g_object_set(cvtracker, "object-initial-x", (guint)(600 * sx), "object-initial-y", (guint)(300 * sy),
+                     "object-initial-height", MAX((guint)(100 * sy), 1), "object-initial-width", MAX((guint)(100 * sx), 1), NULL);
+    }
     if (config_data.hls.showtext) {
         GstElement *textoverlay;
         MAKE_ELEMENT_AND_ADD(textoverlay, "textoverlay");
@@ -2914,7 +5416,9 @@ int cvtracker_hlssink() {
     _mkdir(outdir, 0755);
     g_free(outdir);
 
-    return link_request_src_pad(video_source, pre_convert);
+    watch_convert_cost(pre_convert, "cvtracker pre");
+    watch_convert_cost(post_convert, "cvtracker post");
+    return link_request_src_pad(get_analysis_source(cvtracker), pre_convert);
 }
 #endif
 
@@ -2947,6 +5451,7 @@ int facedetect_hlssink() {
     }
     g_free(binstr);
     g_free(outdir);
+    count_encoder("facedetect hls", "nvv4l2h264enc");
     gst_element_sync_state_with_parent(facebin);
     gst_bin_add(GST_BIN(pipeline), facebin);
     return link_request_src_pad(video_source, facebin);
@@ -2970,6 +5475,7 @@ int facedetect_hlssink() {
     MAKE_ELEMENT_AND_ADD(mpegtsmux, "mpegtsmux");
     g_object_set(queue, "leaky", 1, NULL);
     encoder = get_hardware_h264_encoder();
+    count_encoder_element("facedetect hls", encoder);
 
     if (config_data.hls.showtext) {
         GstElement *textoverlay;
@@ -2999,7 +5505,9 @@ int facedetect_hlssink() {
 
     _mkdir(outdir, 0755);
     g_free(outdir);
-    return link_request_src_pad(video_source, queue);
+    watch_convert_cost(pre_convert, "facedetect pre");
+    watch_convert_cost(post_convert, "facedetect post");
+    return link_request_src_pad(get_analysis_source(facedetect), queue);
 }
 #endif
 
@@ -3025,6 +5533,7 @@ int edgedect_hlssink() {
     }
     g_free(binstr);
     g_free(outdir);
+    count_encoder("edgedetect hls", "nvv4l2h264enc");
     gst_element_sync_state_with_parent(edgebin);
     gst_bin_add(GST_BIN(pipeline), edgebin);
     return link_request_src_pad(video_source, edgebin);
@@ -3049,6 +5558,7 @@ int edgedect_hlssink() {
     g_object_set(clock, "time-format", "%D %H:%M:%S", NULL);
     g_object_set(post_queue, "leaky", 1, NULL);
     encoder = get_hardware_h264_encoder();
+    count_encoder_element("edgedetect hls", encoder);
 
     if (config_data.hls.showtext) {
         GstElement *textoverlay;
@@ -3077,7 +5587,9 @@ int edgedect_hlssink() {
 
     _mkdir(outdir, 0755);
     g_free(outdir);
-    return link_request_src_pad(video_source, pre_convert);
+    watch_convert_cost(pre_convert, "edgedetect pre");
+    watch_convert_cost(post_convert, "edgedetect post");
+    return link_request_src_pad(get_analysis_source(edgedetect), pre_convert);
 }
 #endif
 
@@ -3102,11 +5614,16 @@ static void _initial_device() {
         return;
     }
 
+    check_intra_refresh();
     video_encoder = get_encoder_src();
     if (video_encoder == NULL) {
         g_printerr("unable to open h264 encoder.\n");
         return;
     }
+    // rung 0 of the ladder, the appsrc transport adds its sink, its hub and the smaller rungs.
+    renditions[0] = (Rendition){config_data.v4l2src_data.width, config_data.v4l2src_data.height,
+                                get_exact_bitrate(), video_encoder_element};
+    n_renditions = 1;
 
     if (config_data.audio.enable) {
         audio_source = get_audio_src();
@@ -3136,6 +5653,8 @@ GThread *start_inotify_thread(void) {
 }
 
 GstElement *create_instance() {
+    if (config_data.metrics)
+        metrics_tracer_start();
     pipeline = gst_pipeline_new("pipeline");
 
     if (!capture_htable)
@@ -3189,10 +5708,37 @@ GstElement *create_instance() {
     }
     if (config_data.app_sink) {
         start_av_appsink();
+    } else if (config_data.webrtc.ladder.count > 0) {
+        g_print("the rendition ladder needs the appsrc transport, only the capture size is encoded\n");
     }
 
-    if (config_data.webrtc.enable)
+    // the appsrc transport feeds the sessions in process, no loopback multicast needed.
+    if (config_data.webrtc.enable && !config_data.app_sink)
         start_av_udpsink();
 
+    if (config_data.webrtc.enable) {
+        TransportStats *transport = &transport_stats[config_data.app_sink ? 1 : 0];
+        // a restarted pipeline starts a new sample.
+        transport->last_wall = 0;
+        g_timeout_add_seconds(TRANSPORT_STATS_INTERVAL, report_transport_stats, transport);
+        g_timeout_add_seconds(BWE_INTERVAL, control_encoder_bitrate, NULL);
+    }
+
+    /**
+     * @note Only appsrc sessions are pooled. A pooled udpsrc binds and joins the multicast group
+     * in READY, it copies every packet with no viewer and bursts the stale ones on checkout.
+     */
+    if (config_data.webrtc.enable && config_data.webrtc.pool_size > 0 && config_data.app_sink)
+        start_session_pool(build_appsrc_session);
+
+    if (config_data.roi_delta_qp && (config_data.hls_onoff.motion_hlssink || config_data.hls_onoff.facedetect_hlssink))
+        watch_analytics_regions();
+
+    report_encoders();
+    // the first session or recording opens the gate again.
+    g_mutex_lock(&gate_lock);
+    if (gate_consumers == 0)
+        set_encoder_gate(FALSE);
+    g_mutex_unlock(&gate_lock);
     return pipeline;
 }
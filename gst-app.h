@@ -45,6 +45,12 @@ void start_webrtcbin(WebrtcItem *item);
 void udpsrc_cmd_rec_start(gpointer user_data);
 void udpsrc_cmd_rec_stop(gpointer user_data);
 int get_record_state(void);
+void keyframe_stats_to_prometheus(GString *out);
+/** size and rate of the shared encoder, 0 keeps the value of the capture. */
+gboolean set_video_mode(gint width, gint height, gint framerate);
+void get_video_mode(gint *width, gint *height, gint *framerate);
+/** devtype test or file, videotestsrc or a looping file instead of the camera. */
+gboolean is_synthetic_capture(void);
 
 int splitfile_sink();
 int av_hlssink();
@@ -30,6 +30,8 @@
 #include "sql.h"
 #include "v4l2ctl.h"
 #include "common_priv.h"
+#include "fanout.h"
+#include "mjpegdec.h"
 
 static GMainLoop *loop;
 static GstElement *pipeline;
@@ -39,9 +41,12 @@ static const gchar *video_encodecs[] = {
     "h264",
     "h265",
     "vp9",
-    "vp8"};
+    "vp8",
+    "av1"};
 
 static gchar *config_path;
+static gint bench_fanout = 0;
+static gint bench_mjpeg = 0;
 
 // static GThread *inotify_watch = NULL;
 
@@ -182,7 +187,7 @@ static void read_config_json(gchar *fullpath) {
         config_data.splitfile_sink.max_files = json_object_get_int_member(object, "max_files");
         config_data.splitfile_sink.max_size_time = json_object_get_int_member(object, "max_size_time");
     }
-    config_data.app_sink = json_object_get_boolean_member(root_obj, "app_sink");
+    config_data.app_sink = json_object_get_boolean_member_with_default(root_obj, "app_sink", FALSE);
     object = json_object_get_object_member(root_obj, "hls_onoff");
 
     config_data.hls_onoff.av_hlssink = json_object_get_boolean_member(object, "av_hlssink");
@@ -191,6 +196,16 @@ static void read_config_json(gchar *fullpath) {
     config_data.hls_onoff.facedetect_hlssink = json_object_get_boolean_member(object, "facedetect_hlssink");
     config_data.hls_onoff.cvtracker_hlssink = json_object_get_boolean_member(object, "cvtracker_hlssink");
 
+    config_data.analysis.width = 0;
+    config_data.analysis.height = 0;
+    config_data.analysis.framerate = 0;
+    object = json_object_get_object_member(root_obj, "analysis");
+    if (object) {
+        config_data.analysis.width = json_object_get_int_member_with_default(object, "width", 0);
+        config_data.analysis.height = json_object_get_int_member_with_default(object, "height", 0);
+        config_data.analysis.framerate = json_object_get_int_member_with_default(object, "framerate", 0);
+    }
+
     config_data.videnc = g_strdup(json_object_get_string_member(root_obj, "videnc"));
 
     int len = sizeof(video_encodecs) / sizeof(gchar *);
@@ -205,6 +220,13 @@ static void read_config_json(gchar *fullpath) {
         gst_println("Unsupported video encoding, please use the default h264. ");
         config_data.videnc = "h264";
     }
+    config_data.bitrate = json_object_get_int_member_with_default(root_obj, "bitrate", 0);
+    config_data.quality = json_object_get_int_member_with_default(root_obj, "quality", 0);
+    config_data.intra_refresh = json_object_get_boolean_member_with_default(root_obj, "intra_refresh", FALSE);
+    config_data.encoder_idle = json_object_get_boolean_member_with_default(root_obj, "encoder_idle", TRUE);
+    config_data.roi_delta_qp = json_object_get_int_member_with_default(root_obj, "roi_delta_qp", 0);
+    config_data.mjpeg_workers = json_object_get_int_member_with_default(root_obj, "mjpeg_workers", 0);
+    config_data.shared_convert = json_object_get_boolean_member_with_default(root_obj, "shared_convert", TRUE);
     const gchar *tpath = json_object_get_string_member(root_obj, "rootdir");
     if (tpath[0] == '~') {
         config_data.root_dir = g_strconcat("/home/", g_getenv("USER"), &tpath[1], NULL);
@@ -221,6 +243,8 @@ static void read_config_json(gchar *fullpath) {
 
 
     config_data.showdot = json_object_get_boolean_member(root_obj, "showdot");
+    config_data.metrics = json_object_get_boolean_member_with_default(root_obj, "metrics", FALSE);
+    config_data.encoder_probe = json_object_get_boolean_member_with_default(root_obj, "encoder_probe", TRUE);
     config_data.sysinfo = json_object_get_boolean_member(root_obj, "sysinfo");
 
     config_data.rec_len = json_object_get_int_member(root_obj, "rec_len");
@@ -257,6 +281,21 @@ static void read_config_json(gchar *fullpath) {
         // "stun://stun.l.google.com:19302"
         config_data.webrtc.stun = g_strdup(json_object_get_string_member(object, "stun"));
         config_data.webrtc.enable = json_object_get_boolean_member(object, "enable");
+        config_data.webrtc.keyframe_drop = !g_strcmp0(json_object_get_string_member_with_default(object, "drop_policy", "keyframe"), "keyframe");
+        config_data.webrtc.request_keyframe = json_object_get_boolean_member_with_default(object, "request_keyframe", TRUE);
+        config_data.webrtc.forward = json_object_get_boolean_member_with_default(object, "forward", FALSE);
+        config_data.webrtc.pool_size = json_object_get_int_member_with_default(object, "pool_size", 2);
+        if (json_object_has_member(object, "ladder")) {
+            JsonArray *ladder = json_object_get_array_member(object, "ladder");
+            guint len = MIN(json_array_get_length(ladder), MAX_RENDITIONS - 1);
+            for (guint i = 0; i < len; i++)
+                config_data.webrtc.ladder.height[i] = json_array_get_int_element(ladder, i);
+            config_data.webrtc.ladder.count = len;
+        }
+        // transport between the encoder and the sessions, the old app_sink switch is the default.
+        const gchar *transport = json_object_get_string_member_with_default(object, "transport", NULL);
+        if (transport != NULL)
+            config_data.app_sink = !g_strcmp0(transport, "appsrc");
         JsonObject *turn_obj = json_object_get_object_member(object, "turn");
         config_data.webrtc.turn.url = g_strdup(json_object_get_string_member(turn_obj, "url"));
         config_data.webrtc.turn.user = g_strdup(json_object_get_string_member(turn_obj, "user"));
@@ -359,11 +398,16 @@ load_deepstream_plugin(const gchar *name) {
 static GOptionEntry entries[] = {
     {"config", 'c', 0, G_OPTION_ARG_STRING, &config_path,
      "application config ", "CONFIG"},
+    {"bench-fanout", 0, 0, G_OPTION_ARG_INT, &bench_fanout,
+     "benchmark the rtp fan-out with 1..N subscribers and exit", "N"},
+    {"bench-mjpeg", 0, 0, G_OPTION_ARG_INT, &bench_mjpeg,
+     "benchmark jpegdec against the parallel mjpeg decoder with 2..N workers and exit", "N"},
     {NULL}};
 
 int main(int argc, char *argv[]) {
     GOptionContext *context;
     GError *error = NULL;
+    gint64 startup_time = g_get_monotonic_time();
 
     context = g_option_context_new("- gstreamer webrtc camera");
     g_option_context_add_main_entries(context, entries, NULL);
@@ -377,6 +421,16 @@ int main(int argc, char *argv[]) {
 
     g_option_context_free(context);
 
+    if (bench_fanout > 0) {
+        gst_init(&argc, &argv);
+        return fanout_bench(bench_fanout);
+    }
+
+    if (bench_mjpeg > 0) {
+        gst_init(&argc, &argv);
+        return mjpeg_bench(bench_mjpeg);
+    }
+
     if(config_path == NULL)
     {
         // _get_config_path();
@@ -391,11 +445,16 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    if (!find_video_device_fmt(&config_data.v4l2src_data, TRUE)
+    gint64 probe_start = g_get_monotonic_time();
+    if (!is_synthetic_capture() && !find_video_device_fmt(&config_data.v4l2src_data, TRUE)
         && !get_capture_device(&config_data.v4l2src_data)) {
         g_error("No video capture device found!!!\n");
         exit(1);
     }
+    guint devices_cached, devices_probed;
+    get_device_probe_counts(&devices_cached, &devices_probed);
+    g_print("startup: capture probe %.1f ms, %u devices cached, %u enumerated\n",
+            (g_get_monotonic_time() - probe_start) / 1000.0, devices_cached, devices_probed);
 
     // reset_user_ctrls(config_data.v4l2src_data.device);
 
@@ -473,6 +532,7 @@ int main(int argc, char *argv[]) {
         goto bail;
     }
 
+    g_print("startup: %.1f ms to playing\n", (g_get_monotonic_time() - startup_time) / 1000.0);
     char *version_utf8 = gst_version_string();
     g_print("Starting loop on gstreamer :%s.\n", version_utf8);
     g_free(version_utf8);
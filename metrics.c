@@ -0,0 +1,378 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * metrics.c:  latency histograms and pipeline tracer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "metrics.h"
+
+// inputs of an element waiting for their output, matched by pts.
+#define METRICS_PTS_RING 32
+// queue levels are read every so many buffers, the property read takes the queue lock.
+#define METRICS_QUEUE_SAMPLE 16
+
+static const gdouble bucket_bounds[METRICS_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 60000};
+
+struct _MetricsHistogram {
+    gchar *name;
+    GMutex lock;
+    guint64 buckets[METRICS_BUCKETS];
+    guint64 count;
+    gdouble sum;
+    gdouble max;
+};
+
+MetricsHistogram *metrics_histogram_new(const gchar *name) {
+    MetricsHistogram *hist = g_new0(MetricsHistogram, 1);
+    hist->name = g_strdup(name);
+    g_mutex_init(&hist->lock);
+    return hist;
+}
+
+void metrics_histogram_free(MetricsHistogram *hist) {
+    g_mutex_clear(&hist->lock);
+    g_free(hist->name);
+    g_free(hist);
+}
+
+void metrics_histogram_observe(MetricsHistogram *hist, gdouble ms) {
+    guint i = 0;
+    while (i < METRICS_BUCKETS - 1 && ms > bucket_bounds[i])
+        i++;
+    g_mutex_lock(&hist->lock);
+    hist->buckets[i]++;
+    hist->count++;
+    hist->sum += ms;
+    if (ms > hist->max)
+        hist->max = ms;
+    g_mutex_unlock(&hist->lock);
+}
+
+static gdouble histogram_quantile_locked(MetricsHistogram *hist, gdouble q) {
+    guint64 rank, seen = 0;
+    if (hist->count == 0)
+        return 0;
+    rank = (guint64)(q * hist->count + 0.5);
+    rank = CLAMP(rank, 1, hist->count);
+    for (guint i = 0; i < METRICS_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+            return i < METRICS_BUCKETS - 1 ? MIN(bucket_bounds[i], hist->max) : hist->max;
+    }
+    return hist->max;
+}
+
+gdouble metrics_histogram_quantile(MetricsHistogram *hist, gdouble q) {
+    gdouble ret;
+    g_mutex_lock(&hist->lock);
+    ret = histogram_quantile_locked(hist, q);
+    g_mutex_unlock(&hist->lock);
+    return ret;
+}
+
+guint64 metrics_histogram_count(MetricsHistogram *hist) {
+    guint64 ret;
+    g_mutex_lock(&hist->lock);
+    ret = hist->count;
+    g_mutex_unlock(&hist->lock);
+    return ret;
+}
+
+void metrics_histogram_to_json(MetricsHistogram *hist, JsonBuilder *builder) {
+    g_mutex_lock(&hist->lock);
+    json_builder_set_member_name(builder, hist->name);
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "count");
+    json_builder_add_int_value(builder, hist->count);
+    json_builder_set_member_name(builder, "avg");
+    json_builder_add_double_value(builder, hist->count ? hist->sum / hist->count : 0);
+    json_builder_set_member_name(builder, "max");
+    json_builder_add_double_value(builder, hist->max);
+    json_builder_set_member_name(builder, "p50");
+    json_builder_add_double_value(builder, histogram_quantile_locked(hist, 0.5));
+    json_builder_set_member_name(builder, "p90");
+    json_builder_add_double_value(builder, histogram_quantile_locked(hist, 0.9));
+    json_builder_set_member_name(builder, "p99");
+    json_builder_add_double_value(builder, histogram_quantile_locked(hist, 0.99));
+    json_builder_end_object(builder);
+    g_mutex_unlock(&hist->lock);
+}
+
+void metrics_histogram_to_prometheus(MetricsHistogram *hist, GString *out, const gchar *metric, const gchar *labels) {
+    guint64 cumulative = 0;
+    const gchar *sep = labels != NULL ? "," : "";
+    labels = labels != NULL ? labels : "";
+
+    g_mutex_lock(&hist->lock);
+    for (guint i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += hist->buckets[i];
+        if (i < METRICS_BUCKETS - 1)
+            g_string_append_printf(out, "%s_bucket{%s%sle=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                                   metric, labels, sep, bucket_bounds[i], cumulative);
+        else
+            g_string_append_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+                                   metric, labels, sep, cumulative);
+    }
+    g_string_append_printf(out, "%s_sum{%s} %f\n", metric, labels, hist->sum);
+    g_string_append_printf(out, "%s_count{%s} %" G_GUINT64_FORMAT "\n", metric, labels, hist->count);
+    g_mutex_unlock(&hist->lock);
+}
+
+typedef struct {
+    gchar *labels; // pipeline, element and factory labels.
+    GMutex lock;
+    guint64 buffers;
+    guint64 bytes;
+    GstClockTime in_pts[METRICS_PTS_RING];
+    GstClockTime in_ts[METRICS_PTS_RING];
+    guint in_pos;
+    MetricsHistogram *latency; // created at the first matched output, so only for filters.
+    gboolean is_queue;
+    guint queue_limit;
+    guint queue_level;
+    guint queue_max_level;
+} ElementStats;
+
+typedef struct {
+    GstTracer parent;
+} MetricsTracer;
+
+typedef struct {
+    GstTracerClass parent_class;
+} MetricsTracerClass;
+
+G_DEFINE_TYPE(MetricsTracer, metrics_tracer, GST_TYPE_TRACER);
+
+static GMutex registry_lock;
+static GPtrArray *registry = NULL;
+static GQuark stats_quark;
+static GstTracer *tracer = NULL;
+
+static void element_stats_free(gpointer data) {
+    ElementStats *stats = (ElementStats *)data;
+    // called when the element is finalized, the sessions come and go.
+    g_mutex_lock(&registry_lock);
+    g_ptr_array_remove_fast(registry, stats);
+    g_mutex_unlock(&registry_lock);
+    if (stats->latency != NULL)
+        metrics_histogram_free(stats->latency);
+    g_mutex_clear(&stats->lock);
+    g_free(stats->labels);
+    g_free(stats);
+}
+
+static gchar *top_pipeline_name(GstElement *element) {
+    GstObject *top = gst_object_ref(GST_OBJECT(element));
+    GstObject *parent;
+    gchar *name;
+    while ((parent = gst_object_get_parent(top)) != NULL) {
+        gst_object_unref(top);
+        top = parent;
+    }
+    name = gst_object_get_name(top);
+    gst_object_unref(top);
+    return name;
+}
+
+static ElementStats *element_stats_get(GstElement *element) {
+    ElementStats *stats = g_object_get_qdata(G_OBJECT(element), stats_quark);
+    GstElementFactory *factory;
+    gchar *pipeline, *name;
+
+    if (stats != NULL)
+        return stats;
+
+    g_mutex_lock(&registry_lock);
+    stats = g_object_get_qdata(G_OBJECT(element), stats_quark);
+    if (stats == NULL) {
+        stats = g_new0(ElementStats, 1);
+        g_mutex_init(&stats->lock);
+        factory = gst_element_get_factory(element);
+        pipeline = top_pipeline_name(element);
+        name = gst_element_get_name(element);
+        stats->labels = g_strdup_printf("pipeline=\"%s\",element=\"%s\",factory=\"%s\"", pipeline, name,
+                                        factory ? gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)) : "");
+        g_free(pipeline);
+        g_free(name);
+        if (factory != NULL && !g_strcmp0(gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)), "queue")) {
+            stats->is_queue = TRUE;
+            g_object_get(element, "max-size-buffers", &stats->queue_limit, NULL);
+        }
+        g_ptr_array_add(registry, stats);
+        g_object_set_qdata_full(G_OBJECT(element), stats_quark, stats, element_stats_free);
+    }
+    g_mutex_unlock(&registry_lock);
+    return stats;
+}
+
+/** the element owning pad, NULL for ghost and proxy pads, those are counted at the real pads. */
+static GstElement *pad_element(GstPad *pad) {
+    GstObject *parent = GST_OBJECT_PARENT(pad);
+    if (parent == NULL || !GST_IS_ELEMENT(parent) || GST_IS_BIN(parent))
+        return NULL;
+    return GST_ELEMENT(parent);
+}
+
+static void element_push(GstClockTime ts, GstPad *pad, GstClockTime pts, gsize bytes, guint buffers) {
+    GstElement *element = pad_element(pad);
+    GstPad *peer;
+
+    if (element != NULL) {
+        ElementStats *stats = element_stats_get(element);
+        gdouble latency = -1;
+        gboolean sample;
+        guint level, limit;
+
+        g_mutex_lock(&stats->lock);
+        stats->buffers += buffers;
+        stats->bytes += bytes;
+        if (GST_CLOCK_TIME_IS_VALID(pts)) {
+            for (guint i = 0; i < METRICS_PTS_RING; i++) {
+                if (stats->in_pts[i] == pts && GST_CLOCK_TIME_IS_VALID(stats->in_ts[i])) {
+                    latency = (gdouble)(ts - stats->in_ts[i]) / GST_MSECOND;
+                    stats->in_ts[i] = GST_CLOCK_TIME_NONE;
+                    break;
+                }
+            }
+        }
+        if (latency >= 0 && stats->latency == NULL)
+            stats->latency = metrics_histogram_new(stats->labels);
+        sample = stats->is_queue && stats->buffers % METRICS_QUEUE_SAMPLE < buffers;
+        g_mutex_unlock(&stats->lock);
+        if (latency >= 0)
+            metrics_histogram_observe(stats->latency, latency);
+
+        // the queue src pad pushes from the queue thread, the element is alive here. the limit may change.
+        if (sample) {
+            g_object_get(element, "current-level-buffers", &level, "max-size-buffers", &limit, NULL);
+            g_mutex_lock(&stats->lock);
+            stats->queue_level = level;
+            stats->queue_max_level = MAX(stats->queue_max_level, level);
+            stats->queue_limit = limit;
+            g_mutex_unlock(&stats->lock);
+        }
+    }
+
+    peer = gst_pad_get_peer(pad);
+    if (peer == NULL)
+        return;
+    element = pad_element(peer);
+    if (element != NULL && GST_CLOCK_TIME_IS_VALID(pts)) {
+        ElementStats *stats = element_stats_get(element);
+        g_mutex_lock(&stats->lock);
+        stats->in_pts[stats->in_pos] = pts;
+        stats->in_ts[stats->in_pos] = ts;
+        stats->in_pos = (stats->in_pos + 1) % METRICS_PTS_RING;
+        g_mutex_unlock(&stats->lock);
+    }
+    gst_object_unref(peer);
+}
+
+static void do_push_buffer_pre(GObject *self, GstClockTime ts, GstPad *pad, GstBuffer *buffer) {
+    element_push(ts, pad, GST_BUFFER_PTS(buffer), gst_buffer_get_size(buffer), 1);
+}
+
+static void do_push_list_pre(GObject *self, GstClockTime ts, GstPad *pad, GstBufferList *list) {
+    guint len = gst_buffer_list_length(list);
+    if (len == 0)
+        return;
+    element_push(ts, pad, GST_BUFFER_PTS(gst_buffer_list_get(list, 0)),
+                 gst_buffer_list_calculate_size(list), len);
+}
+
+static void metrics_tracer_class_init(MetricsTracerClass *klass) {
+}
+
+static void metrics_tracer_init(MetricsTracer *self) {
+    gst_tracing_register_hook(GST_TRACER(self), "pad-push-pre", G_CALLBACK(do_push_buffer_pre));
+    gst_tracing_register_hook(GST_TRACER(self), "pad-push-list-pre", G_CALLBACK(do_push_list_pre));
+}
+
+void metrics_tracer_start(void) {
+    if (tracer != NULL)
+        return;
+    registry = g_ptr_array_new();
+    stats_quark = g_quark_from_static_string("gwc-metrics-stats");
+    // the tracer subsystem is initialized by gst_init even without GST_TRACERS.
+    tracer = g_object_new(metrics_tracer_get_type(), NULL);
+}
+
+/** the counters of stats, read under its lock, the streaming threads update them. */
+typedef struct {
+    guint64 buffers;
+    guint64 bytes;
+    guint queue_level;
+    guint queue_max_level;
+    guint queue_limit;
+    MetricsHistogram *latency;
+} StatsSnapshot;
+
+void metrics_tracer_to_prometheus(GString *out) {
+    StatsSnapshot *snap;
+
+    if (registry == NULL)
+        return;
+
+    g_mutex_lock(&registry_lock);
+    snap = g_new(StatsSnapshot, registry->len);
+    for (guint i = 0; i < registry->len; i++) {
+        ElementStats *stats = g_ptr_array_index(registry, i);
+        g_mutex_lock(&stats->lock);
+        snap[i] = (StatsSnapshot){stats->buffers, stats->bytes, stats->queue_level, stats->queue_max_level,
+                                  stats->queue_limit, stats->latency};
+        g_mutex_unlock(&stats->lock);
+    }
+    g_string_append(out, "# TYPE gwc_element_buffers_total counter\n");
+    for (guint i = 0; i < registry->len; i++) {
+        ElementStats *stats = g_ptr_array_index(registry, i);
+        g_string_append_printf(out, "gwc_element_buffers_total{%s} %" G_GUINT64_FORMAT "\n", stats->labels, snap[i].buffers);
+    }
+    g_string_append(out, "# TYPE gwc_element_bytes_total counter\n");
+    for (guint i = 0; i < registry->len; i++) {
+        ElementStats *stats = g_ptr_array_index(registry, i);
+        g_string_append_printf(out, "gwc_element_bytes_total{%s} %" G_GUINT64_FORMAT "\n", stats->labels, snap[i].bytes);
+    }
+    g_string_append(out, "# TYPE gwc_element_latency_ms histogram\n");
+    for (guint i = 0; i < registry->len; i++) {
+        ElementStats *stats = g_ptr_array_index(registry, i);
+        if (snap[i].latency != NULL)
+            metrics_histogram_to_prometheus(snap[i].latency, out, "gwc_element_latency_ms", stats->labels);
+    }
+    g_string_append(out, "# TYPE gwc_queue_level_buffers gauge\n");
+    for (guint i = 0; i < registry->len; i++) {
+        ElementStats *stats = g_ptr_array_index(registry, i);
+        if (stats->is_queue)
+            g_string_append_printf(out, "gwc_queue_level_buffers{%s} %u\n", stats->labels, snap[i].queue_level);
+    }
+    g_string_append(out, "# TYPE gwc_queue_max_level_buffers gauge\n");
+    for (guint i = 0; i < registry->len; i++) {
+        ElementStats *stats = g_ptr_array_index(registry, i);
+        if (stats->is_queue)
+            g_string_append_printf(out, "gwc_queue_max_level_buffers{%s} %u\n", stats->labels, snap[i].queue_max_level);
+    }
+    g_string_append(out, "# TYPE gwc_queue_limit_buffers gauge\n");
+    for (guint i = 0; i < registry->len; i++) {
+        ElementStats *stats = g_ptr_array_index(registry, i);
+        if (stats->is_queue)
+            g_string_append_printf(out, "gwc_queue_limit_buffers{%s} %u\n", stats->labels, snap[i].queue_limit);
+    }
+    g_mutex_unlock(&registry_lock);
+    g_free(snap);
+}
@@ -0,0 +1,55 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * metrics.h:  latency histograms and pipeline tracer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+#include <glib.h>
+#include <gst/gst.h>
+#include <json-glib/json-glib.h>
+
+// upper bounds in ms, the last bucket is +Inf.
+#define METRICS_BUCKETS 16
+
+typedef struct _MetricsHistogram MetricsHistogram;
+
+MetricsHistogram *metrics_histogram_new(const gchar *name);
+void metrics_histogram_free(MetricsHistogram *hist);
+/** thread safe, called from the streaming and the main threads. */
+void metrics_histogram_observe(MetricsHistogram *hist, gdouble ms);
+/** the upper bound of the bucket holding the quantile q (0..1), the max for the +Inf bucket. */
+gdouble metrics_histogram_quantile(MetricsHistogram *hist, gdouble q);
+guint64 metrics_histogram_count(MetricsHistogram *hist);
+/** adds {"count","avg","max","p50","p90","p99"} to builder as a member named by the histogram. */
+void metrics_histogram_to_json(MetricsHistogram *hist, JsonBuilder *builder);
+/** appends the _bucket, _sum and _count lines of a prometheus histogram, labels may be NULL. */
+void metrics_histogram_to_prometheus(MetricsHistogram *hist, GString *out, const gchar *metric, const gchar *labels);
+
+/**
+ * @brief Registers a tracer on the pad push hooks of every pipeline of the process, it counts
+ * the buffers and bytes pushed by every element, the in->out latency of filters by pts,
+ * and samples the level of queues. Call it before the pipelines go to PLAYING.
+ */
+void metrics_tracer_start(void);
+/** appends the tracer metrics in the prometheus text format. */
+void metrics_tracer_to_prometheus(GString *out);
+
+#endif // _METRICS_H
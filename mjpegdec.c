@@ -0,0 +1,409 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * mjpegdec.c:  frame-parallel mjpeg decoder for usb cameras
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "mjpegdec.h"
+#include "common_priv.h"
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+
+// frames of the bench clip and its rate for the paced run.
+#define MJPEG_BENCH_FRAMES 300
+#define MJPEG_BENCH_FPS 30
+
+typedef struct {
+    GstElement *pipeline; // appsrc ! jpegdec ! appsink
+    GstElement *src;
+    GstElement *sink;
+    GstCaps *caps;       // of the last pushed jpeg frame.
+    GMutex lock;
+    GQueue pts;          // of the frames handed to this worker and not put out yet.
+    GstSample *pending;  // decoded, but a frame of another worker comes first.
+} MjpegWorker;
+
+typedef struct {
+    GstElement *bin;  // not a reference, the decoder is data of the bin.
+    GstElement *sink; // jpeg frames into the bin.
+    GstElement *src;  // decoded frames out of the bin.
+    MjpegWorker *workers;
+    guint n_workers;
+    guint64 in;      // frames handed out, the next one goes to in % n_workers.
+    guint64 out;     // turns of the output thread.
+    guint64 skipped; // frames lost by their worker.
+    guint64 dropped; // frames a worker did not take.
+    GThread *thread;
+} MjpegDecoder;
+
+/**
+ * @brief The workers are pipelines of their own, nobody else reads their bus. Errors and warnings
+ * are printed, an error is posted again by the bin, so that the application sees it.
+ */
+static GstBusSyncReply on_worker_message(GstBus *bus, GstMessage *message, gpointer user_data) {
+    MjpegDecoder *dec = (MjpegDecoder *)user_data;
+    GError *error = NULL;
+    gchar *debug = NULL;
+
+    switch (GST_MESSAGE_TYPE(message)) {
+    case GST_MESSAGE_ERROR:
+        gst_message_parse_error(message, &error, &debug);
+        g_printerr("mjpeg worker %s: %s\n", GST_OBJECT_NAME(GST_MESSAGE_SRC(message)), error->message);
+        if (dec->bin != NULL)
+            gst_element_post_message(dec->bin, gst_message_new_error(GST_OBJECT(dec->bin), error, debug));
+        break;
+    case GST_MESSAGE_WARNING:
+        gst_message_parse_warning(message, &error, &debug);
+        g_print("mjpeg worker %s: %s\n", GST_OBJECT_NAME(GST_MESSAGE_SRC(message)), error->message);
+        break;
+    default:
+        break;
+    }
+    if (error != NULL)
+        g_error_free(error);
+    g_free(debug);
+    return GST_BUS_DROP;
+}
+
+static gboolean mjpeg_worker_init(MjpegDecoder *dec, MjpegWorker *worker) {
+    GError *error = NULL;
+    GstBus *bus;
+    // a corrupt jpeg is dropped by its worker instead of stopping it, the output thread skips it.
+    worker->pipeline = gst_parse_launch("appsrc name=src format=time block=true max-bytes=4194304 ! jpegdec max-errors=-1 ! "
+                                        " appsink name=sink sync=false enable-last-sample=false max-buffers=2",
+                                        &error);
+    if (error) {
+        g_printerr("Unable to build mjpeg worker: %s\n", error->message);
+        g_error_free(error);
+        gst_clear_object(&worker->pipeline);
+        return FALSE;
+    }
+    worker->src = gst_bin_get_by_name(GST_BIN(worker->pipeline), "src");
+    worker->sink = gst_bin_get_by_name(GST_BIN(worker->pipeline), "sink");
+    g_mutex_init(&worker->lock);
+    g_queue_init(&worker->pts);
+    bus = gst_element_get_bus(worker->pipeline);
+    gst_bus_set_sync_handler(bus, on_worker_message, dec, NULL);
+    gst_object_unref(bus);
+    gst_element_set_state(worker->pipeline, GST_STATE_PLAYING);
+    return TRUE;
+}
+
+static void mjpeg_decoder_free(MjpegDecoder *dec) {
+    // the bin finalizes, its workers post nothing more on it.
+    dec->bin = NULL;
+    // a stopped worker returns NULL to the output thread, which ends then.
+    for (guint i = 0; i < dec->n_workers; i++) {
+        if (dec->workers[i].pipeline != NULL)
+            gst_element_set_state(dec->workers[i].pipeline, GST_STATE_NULL);
+    }
+    if (dec->thread != NULL)
+        g_thread_join(dec->thread);
+    for (guint i = 0; i < dec->n_workers; i++) {
+        MjpegWorker *worker = &dec->workers[i];
+        if (worker->pipeline == NULL)
+            continue;
+        gst_object_unref(worker->src);
+        gst_object_unref(worker->sink);
+        gst_object_unref(worker->pipeline);
+        gst_caps_replace(&worker->caps, NULL);
+        if (worker->pending != NULL)
+            gst_sample_unref(worker->pending);
+        g_queue_clear_full(&worker->pts, g_free);
+        g_mutex_clear(&worker->lock);
+    }
+    if (dec->skipped || dec->dropped)
+        g_print("mjpeg decoder: %" G_GUINT64_FORMAT " frames lost, %" G_GUINT64_FORMAT " dropped of %" G_GUINT64_FORMAT "\n",
+                dec->skipped, dec->dropped, dec->in);
+    g_clear_object(&dec->sink);
+    g_clear_object(&dec->src);
+    g_free(dec->workers);
+    g_free(dec);
+}
+
+static GstFlowReturn on_jpeg_sample(GstAppSink *appsink, gpointer user_data) {
+    MjpegDecoder *dec = (MjpegDecoder *)user_data;
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+    MjpegWorker *worker;
+    GstBuffer *buffer;
+    GstCaps *caps;
+    GstClockTime *pts;
+    GstFlowReturn ret;
+
+    if (sample == NULL)
+        return GST_FLOW_EOS;
+    worker = &dec->workers[dec->in++ % dec->n_workers];
+    caps = gst_sample_get_caps(sample);
+    if (caps != NULL && (worker->caps == NULL || !gst_caps_is_equal(worker->caps, caps))) {
+        gst_caps_replace(&worker->caps, caps);
+        gst_app_src_set_caps(GST_APP_SRC(worker->src), caps);
+    }
+    buffer = gst_buffer_ref(gst_sample_get_buffer(sample));
+    gst_sample_unref(sample);
+
+    // queued before the push, so the pts is known when the decoded frame arrives.
+    pts = g_new(GstClockTime, 1);
+    *pts = GST_BUFFER_PTS(buffer);
+    g_mutex_lock(&worker->lock);
+    g_queue_push_tail(&worker->pts, pts);
+    g_mutex_unlock(&worker->lock);
+    ret = gst_app_src_push_buffer(GST_APP_SRC(worker->src), buffer);
+    if (ret != GST_FLOW_OK && ret != GST_FLOW_FLUSHING) {
+        // the frame is dropped, a worker error does not stop the capture, its bus tells why.
+        g_mutex_lock(&worker->lock);
+        g_free(g_queue_pop_tail(&worker->pts));
+        g_mutex_unlock(&worker->lock);
+        dec->dropped++;
+    }
+    return ret == GST_FLOW_FLUSHING ? ret : GST_FLOW_OK;
+}
+
+static void on_jpeg_eos(GstAppSink *appsink, gpointer user_data) {
+    MjpegDecoder *dec = (MjpegDecoder *)user_data;
+    for (guint i = 0; i < dec->n_workers; i++)
+        gst_app_src_end_of_stream(GST_APP_SRC(dec->workers[i].src));
+}
+
+/**
+ * @brief Takes the workers in the order of their frames. The pts a worker put out is later than
+ * the one expected when its decoder dropped a frame, then the turn is skipped and the frame
+ * waits for the next turn of its worker.
+ */
+static gpointer mjpeg_output_thread(gpointer user_data) {
+    MjpegDecoder *dec = (MjpegDecoder *)user_data;
+    GstCaps *caps = NULL;
+
+    for (;;) {
+        MjpegWorker *worker = &dec->workers[dec->out++ % dec->n_workers];
+        GstClockTime *expected, pts;
+        GstSample *sample;
+
+        if (worker->pending == NULL)
+            worker->pending = gst_app_sink_pull_sample(GST_APP_SINK(worker->sink));
+        if (worker->pending == NULL)
+            break;
+        g_mutex_lock(&worker->lock);
+        expected = g_queue_pop_head(&worker->pts);
+        g_mutex_unlock(&worker->lock);
+        pts = GST_BUFFER_PTS(gst_sample_get_buffer(worker->pending));
+        if (expected != NULL && GST_CLOCK_TIME_IS_VALID(*expected) && GST_CLOCK_TIME_IS_VALID(pts) && pts > *expected) {
+            g_free(expected);
+            dec->skipped++;
+            continue;
+        }
+        g_free(expected);
+
+        sample = worker->pending;
+        worker->pending = NULL;
+        if (caps == NULL || !gst_caps_is_equal(caps, gst_sample_get_caps(sample))) {
+            gst_caps_replace(&caps, gst_sample_get_caps(sample));
+            gst_app_src_set_caps(GST_APP_SRC(dec->src), caps);
+        }
+        // a flushing bin drops the frame, the workers must keep draining or the input blocks.
+        gst_app_src_push_buffer(GST_APP_SRC(dec->src), gst_buffer_ref(gst_sample_get_buffer(sample)));
+        gst_sample_unref(sample);
+    }
+    gst_caps_replace(&caps, NULL);
+    gst_app_src_end_of_stream(GST_APP_SRC(dec->src));
+    return NULL;
+}
+
+GstElement *mjpeg_decoder_new(guint workers) {
+    MjpegDecoder *dec = g_new0(MjpegDecoder, 1);
+    GstAppSinkCallbacks callbacks = {.eos = on_jpeg_eos, .new_sample = on_jpeg_sample};
+    GstElement *bin;
+    GstPad *pad;
+
+    dec->n_workers = MAX(workers, 1);
+    dec->workers = g_new0(MjpegWorker, dec->n_workers);
+    for (guint i = 0; i < dec->n_workers; i++) {
+        if (!mjpeg_worker_init(dec, &dec->workers[i])) {
+            mjpeg_decoder_free(dec);
+            return NULL;
+        }
+    }
+
+    bin = gst_bin_new(NULL);
+    dec->bin = bin;
+    dec->sink = gst_object_ref(gst_element_factory_make("appsink", NULL));
+    dec->src = gst_object_ref(gst_element_factory_make("appsrc", NULL));
+    g_object_set(dec->sink, "sync", FALSE, "async", FALSE, "enable-last-sample", FALSE, "max-buffers", 2, NULL);
+    g_object_set(dec->src, "format", GST_FORMAT_TIME, "is-live", TRUE, "block", TRUE, NULL);
+    gst_app_sink_set_callbacks(GST_APP_SINK(dec->sink), &callbacks, dec, NULL);
+    gst_bin_add_many(GST_BIN(bin), dec->sink, dec->src, NULL);
+
+    pad = gst_element_get_static_pad(dec->sink, "sink");
+    gst_element_add_pad(bin, gst_ghost_pad_new("sink", pad));
+    gst_object_unref(pad);
+    pad = gst_element_get_static_pad(dec->src, "src");
+    gst_element_add_pad(bin, gst_ghost_pad_new("src", pad));
+    gst_object_unref(pad);
+
+    g_object_set_data_full(G_OBJECT(bin), "mjpeg-decoder", dec, (GDestroyNotify)mjpeg_decoder_free);
+    dec->thread = g_thread_new("mjpeg_output", mjpeg_output_thread, dec);
+    return bin;
+}
+
+static GPtrArray *bench_encode_frames(GstCaps **caps) {
+    GstElement *encpipe, *appsink;
+    GstSample *sample;
+    GError *error = NULL;
+    GPtrArray *frames = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
+    gchar *cmdline = g_strdup_printf("videotestsrc num-buffers=%d pattern=smpte horizontal-speed=4 ! "
+                                     " video/x-raw,width=1920,height=1080,framerate=%d/1 ! jpegenc ! "
+                                     " appsink name=sink sync=false enable-last-sample=false max-buffers=0",
+                                     MJPEG_BENCH_FRAMES, MJPEG_BENCH_FPS);
+    encpipe = gst_parse_launch(cmdline, &error);
+    g_free(cmdline);
+    if (error) {
+        g_printerr("Unable to build bench pipeline: %s\n", error->message);
+        g_error_free(error);
+        return frames;
+    }
+    appsink = gst_bin_get_by_name(GST_BIN(encpipe), "sink");
+    gst_element_set_state(encpipe, GST_STATE_PLAYING);
+    while ((sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink))) != NULL) {
+        if (*caps == NULL)
+            *caps = gst_caps_ref(gst_sample_get_caps(sample));
+        g_ptr_array_add(frames, gst_buffer_ref(gst_sample_get_buffer(sample)));
+        gst_sample_unref(sample);
+    }
+    gst_element_set_state(encpipe, GST_STATE_NULL);
+    gst_object_unref(appsink);
+    gst_object_unref(encpipe);
+    return frames;
+}
+
+typedef struct {
+    GstElement *appsrc;
+    GPtrArray *frames;
+    gint64 *pushed; // monotonic time of every frame into the decoder.
+    gboolean paced;
+} BenchFeed;
+
+static gpointer bench_feed_thread(gpointer user_data) {
+    BenchFeed *feed = (BenchFeed *)user_data;
+    gint64 start = g_get_monotonic_time();
+
+    for (guint i = 0; i < feed->frames->len; i++) {
+        GstBuffer *buffer;
+        if (feed->paced) {
+            gint64 wait = start + i * G_USEC_PER_SEC / MJPEG_BENCH_FPS - g_get_monotonic_time();
+            if (wait > 0)
+                g_usleep(wait);
+        }
+        buffer = gst_buffer_copy(g_ptr_array_index(feed->frames, i));
+        GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(i, GST_SECOND, MJPEG_BENCH_FPS);
+        GST_BUFFER_DURATION(buffer) = GST_SECOND / MJPEG_BENCH_FPS;
+        feed->pushed[i] = g_get_monotonic_time();
+        if (gst_app_src_push_buffer(GST_APP_SRC(feed->appsrc), buffer) != GST_FLOW_OK)
+            break;
+    }
+    gst_app_src_end_of_stream(GST_APP_SRC(feed->appsrc));
+    return NULL;
+}
+
+static gint compare_double(gconstpointer a, gconstpointer b) {
+    gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_run(GPtrArray *frames, GstCaps *caps, guint workers, gboolean paced) {
+    GstElement *decoder = workers > 1 ? mjpeg_decoder_new(workers) : gst_element_factory_make("jpegdec", NULL);
+    GstElement *pipe, *appsrc, *appsink;
+    GArray *latency;
+    BenchFeed feed;
+    gint64 start, end;
+    gdouble cpu, seconds;
+    GstSample *sample;
+    GThread *thread;
+
+    if (decoder == NULL)
+        return;
+    pipe = gst_pipeline_new(NULL);
+    appsrc = gst_element_factory_make("appsrc", NULL);
+    appsink = gst_element_factory_make("appsink", NULL);
+    latency = g_array_new(FALSE, FALSE, sizeof(gdouble));
+    feed = (BenchFeed){appsrc, frames, g_new0(gint64, frames->len), paced};
+    g_object_set(appsrc, "caps", caps, "format", GST_FORMAT_TIME, "block", TRUE, NULL);
+    g_object_set(appsink, "sync", FALSE, "enable-last-sample", FALSE, NULL);
+    gst_bin_add_many(GST_BIN(pipe), appsrc, decoder, appsink, NULL);
+    if (!gst_element_link_many(appsrc, decoder, appsink, NULL)) {
+        g_printerr("Failed to link bench pipeline\n");
+        gst_object_unref(pipe);
+        g_array_unref(latency);
+        g_free(feed.pushed);
+        return;
+    }
+    gst_element_set_state(pipe, GST_STATE_PLAYING);
+
+    cpu = get_process_cpu_seconds();
+    start = end = g_get_monotonic_time();
+    thread = g_thread_new("mjpeg_bench_feed", bench_feed_thread, &feed);
+    while ((sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink))) != NULL) {
+        guint64 index = gst_util_uint64_scale_round(GST_BUFFER_PTS(gst_sample_get_buffer(sample)), MJPEG_BENCH_FPS, GST_SECOND);
+        end = g_get_monotonic_time();
+        if (index < frames->len) {
+            gdouble ms = (end - feed.pushed[index]) / 1000.0;
+            g_array_append_val(latency, ms);
+        }
+        gst_sample_unref(sample);
+    }
+    g_thread_join(thread);
+    cpu = get_process_cpu_seconds() - cpu;
+    seconds = (end - start) / (gdouble)G_USEC_PER_SEC;
+
+    g_array_sort(latency, compare_double);
+    if (latency->len > 0)
+        gst_print("%8s %8s %8u %10.1f %10.2f %10.2f %10.2f %8.1f\n", paced ? "30fps" : "max",
+                  workers > 1 ? "parallel" : "jpegdec", workers, latency->len / seconds,
+                  g_array_index(latency, gdouble, latency->len / 2),
+                  g_array_index(latency, gdouble, latency->len * 99 / 100),
+                  g_array_index(latency, gdouble, latency->len - 1), cpu * 100 / seconds);
+
+    gst_element_set_state(pipe, GST_STATE_NULL);
+    gst_object_unref(pipe);
+    g_array_unref(latency);
+    g_free(feed.pushed);
+}
+
+/**
+ * @brief Decode the jpeg frames of a 1080p videotestsrc clip as fast as possible and at 30 fps,
+ * by jpegdec and by the parallel decoder with 2..max_workers workers. fps of the first run is
+ * the throughput, the latency is from the push into the decoder to the decoded frame.
+ */
+int mjpeg_bench(guint max_workers) {
+    GstCaps *caps = NULL;
+    GPtrArray *frames = bench_encode_frames(&caps);
+    if (frames->len == 0) {
+        g_ptr_array_unref(frames);
+        return -1;
+    }
+    gst_print("mjpeg bench: %u jpeg frames of 1080p videotestsrc, %u cpus\n", frames->len, g_get_num_processors());
+    gst_print("%8s %8s %8s %10s %10s %10s %10s %8s\n", "mode", "decoder", "workers", "fps", "p50(ms)",
+              "p99(ms)", "max(ms)", "cpu%");
+    for (int paced = 0; paced < 2; paced++) {
+        bench_run(frames, caps, 1, paced);
+        for (guint n = 2; n <= max_workers; n++)
+            bench_run(frames, caps, n, paced);
+    }
+    gst_caps_unref(caps);
+    g_ptr_array_unref(frames);
+    return 0;
+}
@@ -0,0 +1,38 @@
+/* gst-webrtc-camera
+ * Copyright (C) 2023 chunyang liu <yjdwbj@gmail.com>
+ *
+ *
+ * mjpegdec.h:  frame-parallel mjpeg decoder for usb cameras
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _MJPEGDEC_H
+#define _MJPEGDEC_H
+#include <glib.h>
+#include <gst/gst.h>
+
+/**
+ * @brief A bin with the pads of jpegdec, image/jpeg in and video/x-raw out. It hands the frames
+ * round robin to its workers, each a jpegdec in its own thread, and puts them out in input order.
+ * A frame lost by its worker is skipped without reordering the others.
+ */
+GstElement *mjpeg_decoder_new(guint workers);
+
+/** decode a 1080p clip by jpegdec and by 2..max_workers workers, print fps and frame latency. */
+int mjpeg_bench(guint max_workers);
+
+#endif // _MJPEGDEC_H
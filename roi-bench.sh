@@ -0,0 +1,103 @@
+#!/bin/bash
+# Measure the bitrate saved by region-of-interest encoding (roi_delta_qp in config.json) on recorded clips.
+# facedetect display=false tags the faces of every frame as GstVideoRegionOfInterestMeta, like the
+# analytics of gwc do for the live encoder. Both runs encode at constant qp:
+#   plain: qp for the whole frame.
+#   roi:   qp + delta for the background, qp inside the faces.
+# The faces keep the quality of the plain run, so the size difference is the saving at equal quality
+# of the regions, psnr and ssim show what the background lost.
+
+export script_name="$(basename "${0}")"
+usage(){
+    echo "Usage:"
+    echo "${script_name} -e [encoder] -q [qp] -d [delta] -f [clip] ..."
+    echo "  e.g. ${script_name} -e vaapih264enc -q 26 -d 8 -f /tmp/door.mp4 -f /tmp/desk.mkv"
+}
+
+clips=()
+while getopts e:q:d:f:h flag
+do
+    case "${flag}" in
+        e) encoder=${OPTARG};;
+        q) qp=${OPTARG};;
+        d) delta=${OPTARG};;
+        f) clips+=("${OPTARG}");;
+        *) usage; exit 1;;
+    esac
+done
+
+for tool in gst-launch-1.0 gst-inspect-1.0 ffmpeg; do
+    if ! command -v ${tool} >/dev/null; then
+        echo "${tool} is required"
+        exit 1
+    fi
+done
+
+encoder=${encoder:-vaapih264enc}
+qp=${qp:-26}
+delta=${delta:-8}
+if [ ${#clips[@]} -eq 0 ]; then
+    usage
+    exit 1
+fi
+# the faces of facedetect carry no qp parameter, only vaapi has a default qp offset for them.
+case ${encoder} in
+    vaapih264enc|vaapih265enc) ;;
+    *) echo "${encoder} has no default-roi-delta-qp"; exit 1;;
+esac
+for element in ${encoder} facedetect; do
+    if ! gst-inspect-1.0 ${element} >/dev/null 2>&1; then
+        echo "${element} is not available"
+        exit 1
+    fi
+done
+
+workdir=$(mktemp -d)
+trap 'rm -rf ${workdir}' EXIT
+
+# $1 base qp, $2 qp offset of the regions.
+encoder_args(){
+    local base=$1 offset=$2
+    case ${encoder} in
+        vaapih26*) echo "${encoder} rate-control=cqp init-qp=${base} default-roi-delta-qp=${offset}";;
+    esac
+}
+
+parser(){
+    case ${encoder} in
+        *h265*) echo "h265parse";;
+        *) echo "h264parse";;
+    esac
+}
+
+printf "%-24s %-5s %4s %10s %8s %8s %8s\n" clip run qp kbytes psnr ssim saving
+for clip in "${clips[@]}"; do
+    ref=${workdir}/ref.y4m
+    gst-launch-1.0 -q filesrc location=${clip} ! decodebin ! videoconvert ! video/x-raw,format=I420 \
+        ! y4menc ! filesink location=${ref} || continue
+
+    plain_size=0
+    for run in plain roi; do
+        out=${workdir}/${run}.mkv
+        if [ ${run} = plain ]; then
+            args=$(encoder_args ${qp} 0)
+        else
+            args=$(encoder_args $((qp + delta)) -${delta})
+        fi
+        gst-launch-1.0 -q filesrc location=${ref} ! y4mdec ! videoconvert ! facedetect display=false \
+            ! videoconvert ! video/x-raw,format=NV12 ! ${args} ! $(parser) ! matroskamux \
+            ! filesink location=${out} >/dev/null 2>&1 || continue
+        log=$(ffmpeg -hide_banner -nostats -i ${out} -i ${ref} \
+            -lavfi "[0:v][1:v]psnr;[0:v][1:v]ssim" -f null - 2>&1)
+        psnr=$(echo "${log}" | sed -n 's/.*PSNR.*average:\([0-9.inf]*\).*/\1/p')
+        ssim=$(echo "${log}" | sed -n 's/.*SSIM.*All:\([0-9.]*\).*/\1/p')
+        size=$(stat -c %s ${out})
+        if [ ${run} = plain ]; then
+            plain_size=${size}
+            saving="-"
+        else
+            saving=$(echo "scale=1; (${plain_size} - ${size}) * 100 / ${plain_size}" | bc)%
+        fi
+        printf "%-24s %-5s %4s %10s %8s %8s %8s\n" "$(basename ${clip})" ${run} ${qp} $((size / 1000)) ${psnr} ${ssim} ${saving}
+    done
+done
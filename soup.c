@@ -25,6 +25,8 @@
 #include "soup_const.h"
 #include "sql.h"
 #include "common_priv.h"
+#include "metrics.h"
+#include "gst-app.h"
 #include <gst/gst.h>
 #include <gst/gstbin.h>
 
@@ -54,6 +56,148 @@ get_string_from_json_object(JsonObject *object) {
     return text;
 }
 
+static const gchar *timeline_names[SESSION_MARK_COUNT] = {
+    "accepted", "built", "offer", "answer", "ice_complete", "connected", "first_rtp"};
+// built in place and taken from the pool, the label of the timeline histograms.
+static const gchar *setup_names[2] = {"built", "pooled"};
+// ms from websocket accept to every mark, over the built and over the pooled sessions.
+static MetricsHistogram *timeline_hist[2][SESSION_MARK_COUNT];
+
+void session_timeline_mark(WebrtcItem *item, SessionMark mark) {
+    gint64 now = g_get_monotonic_time();
+    gdouble ms;
+    gint p;
+
+    // the audio and the video first_rtp_probe race on SESSION_FIRST_RTP.
+    g_mutex_lock(&item->lock);
+    if (item->timeline[mark] != 0) {
+        g_mutex_unlock(&item->lock);
+        return;
+    }
+    item->timeline[mark] = now;
+    g_mutex_unlock(&item->lock);
+    if (mark == SESSION_ACCEPTED)
+        return;
+    ms = (now - item->timeline[SESSION_ACCEPTED]) / 1000.0;
+    p = item->pooled ? 1 : 0;
+    if (timeline_hist[p][mark] != NULL)
+        metrics_histogram_observe(timeline_hist[p][mark], ms);
+    g_print("client: %" G_GUINT64_FORMAT " %s at %.1f ms (%s)\n", item->hash_id, timeline_names[mark], ms, setup_names[p]);
+}
+
+/** @brief "built=3.2,offer=15.0,..." in ms since accept, the marks not reached are left out. */
+static gchar *session_timeline_to_string(WebrtcItem *item) {
+    GString *str = g_string_new(NULL);
+    for (gint i = SESSION_BUILT; i < SESSION_MARK_COUNT; i++) {
+        if (item->timeline[i] == 0)
+            continue;
+        g_string_append_printf(str, "%s%s=%.1f", str->len ? "," : "", timeline_names[i],
+                               (item->timeline[i] - item->timeline[SESSION_ACCEPTED]) / 1000.0);
+    }
+    return g_string_free(str, FALSE);
+}
+
+static void soup_session_stats_handler(G_GNUC_UNUSED SoupServer *soup_server,
+                                       SoupServerMessage *msg, G_GNUC_UNUSED const char *path,
+                                       G_GNUC_UNUSED GHashTable *query, G_GNUC_UNUSED gpointer user_data) {
+    JsonBuilder *builder = json_builder_new();
+    JsonGenerator *gen = json_generator_new();
+    JsonNode *root;
+    gchar *json;
+
+    json_builder_begin_object(builder);
+    for (gint p = 0; p < 2; p++) {
+        json_builder_set_member_name(builder, setup_names[p]);
+        json_builder_begin_object(builder);
+        for (gint i = SESSION_BUILT; i < SESSION_MARK_COUNT; i++)
+            metrics_histogram_to_json(timeline_hist[p][i], builder);
+        json_builder_end_object(builder);
+    }
+    json_builder_end_object(builder);
+
+    root = json_builder_get_root(builder);
+    json_generator_set_root(gen, root);
+    json_generator_set_pretty(gen, TRUE);
+    json = json_generator_to_data(gen, NULL);
+    json_node_free(root);
+    g_object_unref(gen);
+    g_object_unref(builder);
+
+    soup_server_message_set_response(msg, "application/json", SOUP_MEMORY_TAKE, json, strlen(json));
+    soup_server_message_set_status(msg, SOUP_STATUS_OK, NULL);
+}
+
+/** @brief prometheus text of the session setup histograms, the pipeline tracer and the keyframe broker. */
+static void soup_metrics_handler(G_GNUC_UNUSED SoupServer *soup_server,
+                                 SoupServerMessage *msg, G_GNUC_UNUSED const char *path,
+                                 G_GNUC_UNUSED GHashTable *query, G_GNUC_UNUSED gpointer user_data) {
+    GString *out = g_string_new(NULL);
+    gchar *labels;
+    gsize len;
+
+    g_string_append(out, "# TYPE gwc_session_setup_ms histogram\n");
+    for (gint p = 0; p < 2; p++) {
+        for (gint i = SESSION_BUILT; i < SESSION_MARK_COUNT; i++) {
+            labels = g_strdup_printf("mark=\"%s\",session=\"%s\"", timeline_names[i], setup_names[p]);
+            metrics_histogram_to_prometheus(timeline_hist[p][i], out, "gwc_session_setup_ms", labels);
+            g_free(labels);
+        }
+    }
+    metrics_tracer_to_prometheus(out);
+    keyframe_stats_to_prometheus(out);
+
+    len = out->len;
+    soup_server_message_set_response(msg, "text/plain; version=0.0.4", SOUP_MEMORY_TAKE,
+                                     g_string_free(out, FALSE), len);
+    soup_server_message_set_status(msg, SOUP_STATUS_OK, NULL);
+}
+
+/**
+ * @brief GET "/video/mode" is the current mode, POST "/video/mode" with the form "width=640&height=360&framerate=15"
+ * switches the live encoder of every viewer and replies the mode after. Behind the digest auth.
+ */
+static void soup_video_mode_handler(G_GNUC_UNUSED SoupServer *soup_server,
+                                    SoupServerMessage *msg, G_GNUC_UNUSED const char *path,
+                                    G_GNUC_UNUSED GHashTable *query, G_GNUC_UNUSED gpointer user_data) {
+    const char *method = soup_server_message_get_method(msg);
+    guint status = SOUP_STATUS_OK;
+    gint width, height, framerate;
+    gchar *json;
+
+    if (method == SOUP_METHOD_POST) {
+        SoupMessageBody *body = soup_server_message_get_request_body(msg);
+        GBytes *bytes = soup_message_body_flatten(body);
+        gchar *form_string = g_strndup(g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes));
+        GHashTable *form = soup_form_decode(form_string);
+        const gchar *value;
+
+        width = (value = g_hash_table_lookup(form, "width")) ? (gint)g_ascii_strtoll(value, NULL, 10) : 0;
+        height = (value = g_hash_table_lookup(form, "height")) ? (gint)g_ascii_strtoll(value, NULL, 10) : 0;
+        framerate = (value = g_hash_table_lookup(form, "framerate")) ? (gint)g_ascii_strtoll(value, NULL, 10) : 0;
+        if (!set_video_mode(width, height, framerate))
+            status = SOUP_STATUS_BAD_REQUEST;
+        g_hash_table_unref(form);
+        g_free(form_string);
+        g_bytes_unref(bytes);
+    } else if (method != SOUP_METHOD_GET) {
+        soup_server_message_set_status(msg, SOUP_STATUS_METHOD_NOT_ALLOWED, NULL);
+        return;
+    }
+    get_video_mode(&width, &height, &framerate);
+    json = g_strdup_printf("{\"width\": %d, \"height\": %d, \"framerate\": %d}", width, height, framerate);
+    soup_server_message_set_response(msg, "application/json", SOUP_MEMORY_TAKE, json, strlen(json));
+    soup_server_message_set_status(msg, status, NULL);
+}
+
+/** the setup time to the offer of the timeline, split by pooled and built sessions to tune the webrtc pool_size. */
+static void update_session_setup_log(WebrtcItem *webrtc_entry) {
+    gint64 setup_us = webrtc_entry->timeline[SESSION_OFFER] - webrtc_entry->timeline[SESSION_ACCEPTED];
+    gchar *sql = g_strdup_printf("UPDATE webrtc_log SET setup_ms=%" G_GINT64_FORMAT ",pooled=%d WHERE hashid=%" G_GUINT64_FORMAT ";",
+                                 setup_us / 1000, webrtc_entry->pooled ? 1 : 0, webrtc_entry->hash_id);
+    add_webrtc_access_log(sql);
+    g_free(sql);
+}
+
 static void on_offer_created_cb(GstPromise *promise, gpointer user_data) {
     gchar *sdp_string;
     gchar *json_string;
@@ -68,6 +212,8 @@ static void on_offer_created_cb(GstPromise *promise, gpointer user_data) {
     gst_structure_get(reply, "offer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION,
                       &offer, NULL);
     gst_promise_unref(promise);
+    session_timeline_mark(webrtc_entry, SESSION_OFFER);
+    update_session_setup_log(webrtc_entry);
 
     local_desc_promise = gst_promise_new();
     g_signal_emit_by_name(webrtc_entry->sendbin, "set-local-description",
@@ -278,6 +424,9 @@ static void soup_websocket_message_cb(G_GNUC_UNUSED SoupWebsocketConnection *con
                                      json_object_get_string_member(client, "useragent"));
         add_webrtc_access_log(sql);
         g_free(sql);
+        // the offer may be created before the client row exists.
+        if (webrtc_entry->timeline[SESSION_OFFER] != 0)
+            update_session_setup_log(webrtc_entry);
         update_online_users();
         goto cleanup;
     }
@@ -395,9 +544,20 @@ static void soup_websocket_message_cb(G_GNUC_UNUSED SoupWebsocketConnection *con
         gst_promise_interrupt(promise);
         gst_promise_unref(promise);
         gst_webrtc_session_description_free(answer);
+        session_timeline_mark(webrtc_entry, SESSION_ANSWER);
 
         // gst_debug_bin_to_dot_file_with_ts(GST_BIN(webrtc_entry->webrtcbin), GST_DEBUG_GRAPH_SHOW_ALL, "webrtcbin");
 
+    } else if (g_strcmp0(type_string, "ttff") == 0) {
+        // time to first frame, reported by the browser once the first video frame is decoded.
+        gint64 client_ms = json_object_get_int_member(data_json_object, "ms");
+        gint64 server_ms = (g_get_monotonic_time() - webrtc_entry->timeline[SESSION_ACCEPTED]) / 1000;
+        gchar *sql = g_strdup_printf("UPDATE webrtc_log SET ttff=%" G_GINT64_FORMAT " WHERE hashid=%" G_GUINT64_FORMAT ";",
+                                     server_ms, webrtc_entry->hash_id);
+        g_print("client: %" G_GUINT64_FORMAT " ttff: %" G_GINT64_FORMAT " ms since websocket accept, %" G_GINT64_FORMAT " ms reported by client\n",
+                webrtc_entry->hash_id, server_ms, client_ms);
+        add_webrtc_access_log(sql);
+        g_free(sql);
     } else if (g_strcmp0(type_string, "ice") == 0) {
         guint mline_index;
         const gchar *candidate_string;
@@ -506,11 +666,13 @@ static void soup_websocket_handler(G_GNUC_UNUSED SoupServer *server,
     g_signal_connect(G_OBJECT(connection), "closed",
                      G_CALLBACK(soup_websocket_closed_cb), (gpointer)webrtc_connected_table);
     webrtc_entry = g_new0(WebrtcItem, 1);
+    g_mutex_init(&webrtc_entry->lock);
     webrtc_entry->connection = connection;
     // webrtc_entry->client = client_context;
     webrtc_entry->send_channel = NULL;
     webrtc_entry->receive_channel = NULL;
     webrtc_entry->hash_id = (u_long)(webrtc_entry->connection);
+    webrtc_entry->timeline[SESSION_ACCEPTED] = g_get_monotonic_time();
 
     g_object_ref(G_OBJECT(connection));
 
@@ -518,6 +680,7 @@ static void soup_websocket_handler(G_GNUC_UNUSED SoupServer *server,
                      G_CALLBACK(soup_websocket_message_cb), (gpointer)webrtc_entry);
 
     data->fn(webrtc_entry);
+    session_timeline_mark(webrtc_entry, SESSION_BUILT);
 
     g_signal_connect(webrtc_entry->sendbin, "on-negotiation-needed",
                      G_CALLBACK(on_negotiation_needed_cb), (gpointer)webrtc_entry);
@@ -540,6 +703,14 @@ static void destroy_webrtc_table(gpointer entry_ptr) {
                                  webrtc_entry->hash_id);
     add_webrtc_access_log(sql);
     g_free(sql);
+
+    gchar *timeline = session_timeline_to_string(webrtc_entry);
+    g_print("client: %" G_GUINT64_FORMAT " timeline: %s\n", webrtc_entry->hash_id, timeline);
+    sql = g_strdup_printf("UPDATE webrtc_log SET timeline='%s' WHERE hashid=%" G_GUINT64_FORMAT ";",
+                          timeline, webrtc_entry->hash_id);
+    add_webrtc_access_log(sql);
+    g_free(sql);
+    g_free(timeline);
     update_online_users();
 
     if (webrtc_entry->stop_webrtc != NULL) {
@@ -557,6 +728,7 @@ static void destroy_webrtc_table(gpointer entry_ptr) {
     if (webrtc_entry->connection != NULL)
         g_object_unref(G_OBJECT(webrtc_entry->connection));
 
+    g_mutex_clear(&webrtc_entry->lock);
     g_free(webrtc_entry);
 }
 
@@ -920,6 +1092,10 @@ void start_http(webrtc_callback fn, int port, int clients) {
     CustomSoupData *data;
     client_limit = clients;
     data = g_new0(CustomSoupData, 1);
+    for (gint p = 0; p < 2; p++) {
+        for (gint i = SESSION_BUILT; i < SESSION_MARK_COUNT; i++)
+            timeline_hist[p][i] = metrics_histogram_new(timeline_names[i]);
+    }
 
     // create self-signed certificate for local area network access
     // https://stackoverflow.com/questions/66558788/how-to-create-a-self-signed-or-signed-by-own-ca-ssl-certificate-for-ip-address
@@ -954,6 +1130,9 @@ void start_http(webrtc_callback fn, int port, int clients) {
     //                  G_CALLBACK(request_started_callback), webrtc_connected_table);
     gchar *webroot_path = g_strconcat("/home/", g_getenv("USER"), "/.config/gwc/", NULL);
     soup_server_add_handler(soup_server, NULL, soup_http_handler, (gpointer)data, NULL);
+    soup_server_add_handler(soup_server, "/stats/sessions", soup_session_stats_handler, NULL, NULL);
+    soup_server_add_handler(soup_server, "/metrics", soup_metrics_handler, NULL, NULL);
+    soup_server_add_handler(soup_server, "/video/mode", soup_video_mode_handler, NULL, NULL);
     soup_server_add_websocket_handler(soup_server, "/ws", NULL, NULL,
                                       soup_websocket_handler, (gpointer)data, NULL);
 
@@ -965,6 +1144,7 @@ void start_http(webrtc_callback fn, int port, int clients) {
     // soup_auth_domain_add_path(auth_domain, "/Digest");
     // soup_auth_domain_add_path(auth_domain, "/Any");
     soup_auth_domain_add_path(auth_domain, "/webroot");
+    soup_auth_domain_add_path(auth_domain, "/video/mode");
     // soup_auth_domain_remove_path(auth_domain, "/favicon.ico"); // not need to auth path
     soup_server_add_auth_domain(soup_server, auth_domain);
     g_object_unref(auth_domain);
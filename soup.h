@@ -43,8 +43,36 @@ typedef int (*get_state)(void);
 struct _AppsrcAvPair{
     GstElement *video_src;
     GstElement *audio_src;
+    struct _FanoutSub *video_sub;
+    struct _FanoutSub *audio_sub;
+    guint32 video_ssrc; // forward mode ssrc, 0 means the session repays the stream.
+    guint32 audio_ssrc;
+    gint rendition;     // ladder rung of video_sub, 0 is the capture size.
 };
 
+/** bandwidth estimate of a send session from the webrtcbin get-stats. */
+struct _SessionBwe {
+    guint stats_timer;  // get-stats poll source.
+    guint64 bytes_sent; // video outbound-rtp bytes at the last poll.
+    guint send_bps;     // measured video send rate.
+    gdouble loss;       // worst remote fraction lost.
+    guint estimate;     // loss based available bandwidth in bps.
+    gint up_votes;      // polls in a row with room for a higher rung.
+    gboolean pending;   // a get-stats promise is not answered yet.
+};
+
+/** points of the session setup timeline, in the order of a normal join. */
+typedef enum {
+    SESSION_ACCEPTED,     // websocket accepted.
+    SESSION_BUILT,        // send pipeline built or taken from the pool.
+    SESSION_OFFER,        // offer created.
+    SESSION_ANSWER,       // remote answer applied.
+    SESSION_ICE_COMPLETE, // ice gathering complete.
+    SESSION_CONNECTED,    // peer connection state connected.
+    SESSION_FIRST_RTP,    // first rtp packet sent after connected.
+    SESSION_MARK_COUNT
+} SessionMark;
+
 struct _RecordItem {
     GstElement *pipeline;
     user_cb start;
@@ -78,6 +106,11 @@ struct _WebrtcItem {
     appsink_signal_opt signal_add;
     appsink_signal_opt signal_remove;
     guint64 hash_id; // hash value for connection;
+    gboolean pooled;    // the session pipeline came from the pre-warmed pool.
+    gint64 timeline[SESSION_MARK_COUNT]; // monotonic time of every SessionMark, 0 if not reached.
+    GMutex lock;        // timeline marks, and send_avpair subscription against the teardown.
+    gboolean stopping;  // stop_webrtc runs, no more subscriptions.
+    struct _SessionBwe bwe;
     struct _RecordItem record;
     struct _RecvItem recv;
     struct _DcFile dcfile;
@@ -92,5 +125,7 @@ typedef void (*webrtc_callback)(WebrtcItem *item);
 typedef struct _RecordItem RecordItem;
 
 void start_http(webrtc_callback fn, int port, int clients);
+/** records the first time the session reaches mark, thread safe per mark. */
+void session_timeline_mark(WebrtcItem *item, SessionMark mark);
 
 #endif // _SOUP_H
\ No newline at end of file
@@ -85,13 +85,22 @@ int init_db() {
                    "path TEXT,"
                    "useragent text,"
                    "indate TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,"
-                   "outdate TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP);");
+                   "outdate TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,"
+                   "ttff INTEGER,"
+                   "setup_ms INTEGER,"
+                   "pooled INTEGER,"
+                   "timeline TEXT);");
     rc = sqlite3_exec(db, sql, callback, 0, &errMsg);
     g_free(sql);
     if (rc != SQLITE_OK) {
         g_print("create  webrtc_log sql error: %s \n", errMsg);
         goto lret;
     }
+    // upgrade the db created by the older version, fails harmlessly if the column exists.
+    sqlite3_exec(db, "ALTER TABLE webrtc_log ADD COLUMN ttff INTEGER;", NULL, 0, NULL);
+    sqlite3_exec(db, "ALTER TABLE webrtc_log ADD COLUMN setup_ms INTEGER;", NULL, 0, NULL);
+    sqlite3_exec(db, "ALTER TABLE webrtc_log ADD COLUMN pooled INTEGER;", NULL, 0, NULL);
+    sqlite3_exec(db, "ALTER TABLE webrtc_log ADD COLUMN timeline TEXT;", NULL, 0, NULL);
 
     sql = g_strdup("CREATE TABLE IF NOT EXISTS http_log ("
                    "id INTEGER PRIMARY KEY,"
@@ -25,6 +25,7 @@
 #include <json-glib/json-glib.h>
 #include <libudev.h>
 #include <linux/media.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 static int ctrl_list[] = {V4L2_CID_BRIGHTNESS, V4L2_CID_CONTRAST, V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CID_SHARPNESS, V4L2_CID_WHITENESS};
@@ -524,63 +525,6 @@ static void get_capture_fmt_video(_v4l2src_data *data) {
     }
 }
 
-static gboolean get_default_capture_device(_v4l2src_data *data) {
-    // This is used if the wrong video configuration is set but a valid device is found on the system.
-    gboolean match = FALSE;
-    int fd = -1;
-    struct v4l2_fmtdesc fmtdesc;
-    struct v4l2_frmsizeenum frmsize;
-    struct v4l2_frmivalenum frmval;
-    struct v4l2_capability capability;
-
-    memset(&fmtdesc, 0, sizeof(fmtdesc));
-    memset(&frmsize, 0, sizeof(frmsize));
-    memset(&frmval, 0, sizeof(frmval));
-    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmtdesc.index = 0;
-    fmtdesc.mbus_code = 0;
-
-    fd = open(data->device, O_RDWR | O_NONBLOCK);
-    if (fd < 0) {
-        return match;
-    }
-
-    if (0 != device_cap_info(fd, &capability)) {
-        goto invalid_dev;
-    }
-
-    if (g_str_has_prefix((const gchar *)&capability.bus_info, "platform:")) {
-        goto invalid_dev;
-    }
-
-    for (; 0 == ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) && !match; fmtdesc.index++) {
-        frmsize.pixel_format = fmtdesc.pixelformat;
-        frmsize.index = 0;
-        for (; 0 == ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) && !match; frmsize.index++) {
-            if (frmsize.type != V4L2_FRMSIZE_TYPE_DISCRETE)
-                continue;
-            data->width = frmsize.discrete.width;
-            data->height = frmsize.discrete.height;
-            frmval.pixel_format = fmtdesc.pixelformat;
-            frmval.index = 0;
-            frmval.width = frmsize.discrete.width;
-            frmval.height = frmsize.discrete.height;
-            for (; 0 == ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmval); frmval.index++) {
-                gfloat fps = ((1.0 * frmval.discrete.denominator) / frmval.discrete.numerator);
-                data->framerate = (int)fps;
-                match = TRUE;
-                g_warning("!!!found an valid device: %dx%d/%d at %s\n", data->width, data->height, data->framerate, data->device);
-                break;
-            }
-        }
-    }
-
-invalid_dev:
-    g_print("not found current size\n");
-    close(fd);
-    return match;
-}
-
 #if 0
 static int enumerate_entity_desc(int media_fd, struct media_v2_topology *topology) {
     struct media_entity_desc ent_desc;
@@ -1081,8 +1025,183 @@ found_dev:
 }
 #endif
 
+// one discrete capture mode, in the order the driver enumerates them.
+typedef struct {
+    guint32 pixelformat;
+    gint width, height, framerate;
+} CaptureMode;
+
+static GMutex device_cache_lock;
+static GKeyFile *device_cache = NULL;
+static guint devices_cached = 0, devices_probed = 0;
+
+static gchar *get_device_cache_path() {
+    return g_build_filename(g_get_user_config_dir(), "gwc", "devices.ini", NULL);
+}
+
+/** driver, driver version, bus and udev serial: a cached device has not changed while they match. */
+static gchar *get_device_key(int fd, struct v4l2_capability *caps) {
+    struct stat st;
+    struct udev *udev = NULL;
+    struct udev_device *device = NULL;
+    const gchar *serial = NULL;
+    gchar *key;
+
+    if (fstat(fd, &st) == 0 && (udev = udev_new()) != NULL) {
+        device = udev_device_new_from_devnum(udev, 'c', st.st_rdev);
+        if (device)
+            serial = udev_device_get_property_value(device, "ID_SERIAL");
+    }
+    key = g_strdup_printf("%s %u.%u.%u %s %s", (const gchar *)caps->driver,
+                          (caps->version >> 16) & 0xff, (caps->version >> 8) & 0xff, caps->version & 0xff,
+                          (const gchar *)caps->bus_info, serial ? serial : "-");
+    // brackets end a group name of the key file.
+    g_strdelimit(key, "[]\n", '_');
+    if (device)
+        udev_device_unref(device);
+    if (udev)
+        udev_unref(udev);
+    return key;
+}
+
+static void enumerate_capture_modes(int fd, GArray *modes) {
+    struct v4l2_fmtdesc fmtdesc;
+    struct v4l2_frmsizeenum frmsize;
+    struct v4l2_frmivalenum frmval;
+
+    memset(&fmtdesc, 0, sizeof(fmtdesc));
+    memset(&frmsize, 0, sizeof(frmsize));
+    memset(&frmval, 0, sizeof(frmval));
+    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (; 0 == ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc); fmtdesc.index++) {
+        frmsize.pixel_format = fmtdesc.pixelformat;
+        frmsize.index = 0;
+        for (; 0 == ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize); frmsize.index++) {
+            if (frmsize.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+                continue;
+            frmval.pixel_format = fmtdesc.pixelformat;
+            frmval.index = 0;
+            frmval.width = frmsize.discrete.width;
+            frmval.height = frmsize.discrete.height;
+            for (; 0 == ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmval); frmval.index++) {
+                CaptureMode mode = {fmtdesc.pixelformat, frmsize.discrete.width, frmsize.discrete.height, 0};
+                if (frmval.type != V4L2_FRMIVAL_TYPE_DISCRETE || frmval.discrete.numerator == 0)
+                    continue;
+                mode.framerate = (int)((1.0 * frmval.discrete.denominator) / frmval.discrete.numerator);
+                g_array_append_val(modes, mode);
+            }
+        }
+    }
+}
+
+/**
+ * @brief The capture modes of device, from ~/.config/gwc/devices.ini while its key is the same,
+ * otherwise enumerated and cached. NULL for a device that can't be opened or sits on the platform bus.
+ */
+static GArray *get_capture_modes(const gchar *device) {
+    struct v4l2_capability capability;
+    GArray *modes;
+    gchar *key, *path, **cached;
+    int fd;
+
+    fd = open(device, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+        return NULL;
+    if (0 != device_cap_info(fd, &capability) ||
+        g_str_has_prefix((const gchar *)capability.bus_info, "platform:")) {
+        close(fd);
+        return NULL;
+    }
+    g_debug("ioctl: cap info: %s, %s", device, (const gchar *)(capability.bus_info));
+
+    key = get_device_key(fd, &capability);
+    path = get_device_cache_path();
+    modes = g_array_new(FALSE, FALSE, sizeof(CaptureMode));
+    g_mutex_lock(&device_cache_lock);
+    if (device_cache == NULL) {
+        device_cache = g_key_file_new();
+        g_key_file_load_from_file(device_cache, path, G_KEY_FILE_KEEP_COMMENTS, NULL);
+    }
+    // an empty list is not cached, the device may just have been busy.
+    cached = g_key_file_get_string_list(device_cache, key, "modes", NULL, NULL);
+    if (cached != NULL && cached[0] == NULL)
+        g_clear_pointer(&cached, g_strfreev);
+    if (cached != NULL)
+        devices_cached++;
+    g_mutex_unlock(&device_cache_lock);
+
+    if (cached != NULL) {
+        for (gchar **item = cached; *item != NULL; item++) {
+            CaptureMode mode;
+            if (sscanf(*item, "%u:%dx%d@%d", &mode.pixelformat, &mode.width, &mode.height, &mode.framerate) == 4)
+                g_array_append_val(modes, mode);
+        }
+    } else {
+        GPtrArray *items = g_ptr_array_new_with_free_func(g_free);
+        enumerate_capture_modes(fd, modes);
+        for (guint i = 0; i < modes->len; i++) {
+            CaptureMode *mode = &g_array_index(modes, CaptureMode, i);
+            g_ptr_array_add(items, g_strdup_printf("%u:%dx%d@%d", mode->pixelformat, mode->width, mode->height, mode->framerate));
+        }
+        g_mutex_lock(&device_cache_lock);
+        devices_probed++;
+        if (items->len > 0) {
+            g_key_file_set_string_list(device_cache, key, "modes", (const gchar *const *)items->pdata, items->len);
+            g_key_file_set_comment(device_cache, key, NULL, " pixelformat:widthxheight@fps", NULL);
+            gchar *dir = g_path_get_dirname(path);
+            g_mkdir_with_parents(dir, 0755);
+            g_free(dir);
+            if (!g_key_file_save_to_file(device_cache, path, NULL))
+                g_print("failed to save the capture modes to %s\n", path);
+        }
+        g_mutex_unlock(&device_cache_lock);
+        g_ptr_array_unref(items);
+    }
+    close(fd);
+    g_strfreev(cached);
+    g_free(path);
+    g_free(key);
+    return modes;
+}
+
+static gboolean has_capture_mode(GArray *modes, gint width, gint height, gint framerate) {
+    for (guint i = 0; modes != NULL && i < modes->len; i++) {
+        CaptureMode *mode = &g_array_index(modes, CaptureMode, i);
+        if (mode->width == width && mode->height == height && mode->framerate == framerate)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void print_capture_modes(const gchar *device, GArray *modes) {
+    g_print("capture modes of %s:\n", device);
+    for (guint i = 0; modes != NULL && i < modes->len; i++) {
+        CaptureMode *mode = &g_array_index(modes, CaptureMode, i);
+        gchar *tmp = fcc2s(mode->pixelformat);
+        g_print("\t'%s' %dx%d@%d\n", tmp, mode->width, mode->height, mode->framerate);
+        g_free(tmp);
+    }
+}
+
+void get_device_probe_counts(guint *cached, guint *probed) {
+    g_mutex_lock(&device_cache_lock);
+    *cached = devices_cached;
+    *probed = devices_probed;
+    g_mutex_unlock(&device_cache_lock);
+}
+
+static gpointer capture_modes_thread(gpointer data) {
+    return get_capture_modes((const gchar *)data);
+}
+
+static void free_capture_modes(gpointer data) {
+    if (data != NULL)
+        g_array_unref(data);
+}
+
 gboolean get_capture_device(_v4l2src_data *data) {
     GList *videolist = NULL;
+    GPtrArray *threads, *devmodes;
     gboolean found = FALSE;
     DIR *devdir;
 
@@ -1098,15 +1217,19 @@ gboolean get_capture_device(_v4l2src_data *data) {
         closedir(devdir);
     }
 
+    // the devices are probed at the same time, the slow ones don't wait for each other.
+    threads = g_ptr_array_new();
+    devmodes = g_ptr_array_new_with_free_func(free_capture_modes);
+    for (GList *iter = videolist; iter != NULL; iter = iter->next)
+        g_ptr_array_add(threads, g_thread_new("v4l2probe", capture_modes_thread, iter->data));
+    for (guint i = 0; i < threads->len; i++)
+        g_ptr_array_add(devmodes, g_thread_join(g_ptr_array_index(threads, i)));
+    g_ptr_array_free(threads, TRUE);
+
     // find an video capture device.
-    for (GList *iter = videolist; iter != NULL; iter = iter->next) {
-        _v4l2src_data item;
-        item.device = iter->data;
-        item.width = data->width;
-        item.height = data->height;
-        item.format = data->format;
-        item.framerate = data->framerate;
-        if (find_video_device_fmt(&item, FALSE)) {
+    guint index = 0;
+    for (GList *iter = videolist; iter != NULL; iter = iter->next, index++) {
+        if (has_capture_mode(g_ptr_array_index(devmodes, index), data->width, data->height, data->framerate)) {
             g_warning("found video capture : %s, but not match you video capture configuration!!!\n", (const gchar *)(iter->data));
             g_free(data->device);
             data->device = g_strdup(iter->data);
@@ -1115,23 +1238,25 @@ gboolean get_capture_device(_v4l2src_data *data) {
         }
     }
 
-    // find an default video capture settings.
-
-    for (GList *iter = videolist; iter != NULL; iter = iter->next) {
-        _v4l2src_data item;
-        item.device = iter->data;
-        if (get_default_capture_device(&item)) {
+    // find an default video capture settings, the first mode of a device.
+    index = 0;
+    for (GList *iter = videolist; iter != NULL; iter = iter->next, index++) {
+        GArray *modes = g_ptr_array_index(devmodes, index);
+        if (modes != NULL && modes->len > 0) {
+            CaptureMode *mode = &g_array_index(modes, CaptureMode, 0);
             g_free(data->device);
             data->device = g_strdup(iter->data);
-            data->width = item.width;
-            data->height = item.height;
-            data->framerate = item.framerate;
+            data->width = mode->width;
+            data->height = mode->height;
+            data->framerate = mode->framerate;
+            g_warning("!!!found an valid device: %dx%d/%d at %s\n", data->width, data->height, data->framerate, data->device);
             found = TRUE;
             break;
         }
     }
 
 found_dev:
+    g_ptr_array_unref(devmodes);
     g_list_free_full(videolist, g_free);
     if(!found) {
         g_print("Not found , detect csi camera!!!\n");
@@ -1143,72 +1268,12 @@ found_dev:
 }
 
 gboolean find_video_device_fmt(_v4l2src_data *data, const gboolean showdump) {
-    gboolean match = FALSE;
-    int fd = -1;
-    struct v4l2_fmtdesc fmtdesc;
-    struct v4l2_frmsizeenum frmsize;
-    struct v4l2_frmivalenum frmval;
-    struct v4l2_capability capability;
-
-    memset(&fmtdesc, 0, sizeof(fmtdesc));
-    memset(&frmsize, 0, sizeof(frmsize));
-    memset(&frmval, 0, sizeof(frmval));
-    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmtdesc.index = 0;
-    fmtdesc.mbus_code = 0;
-    // Open the device file
-    fd = open(data->device, O_RDWR | O_NONBLOCK);
-    if (fd < 0) {
-        return match;
-    }
+    GArray *modes = get_capture_modes(data->device);
+    gboolean match = has_capture_mode(modes, data->width, data->height, data->framerate);
 
-    if (0 != device_cap_info(fd, &capability)) {
-        goto no_match;
-    }
-    g_print("1ioctl: cap info: %s\n", (const gchar *)(capability.bus_info));
-    if (g_str_has_prefix((const gchar *)&capability.bus_info, "platform:")) {
-        goto no_match;
-    }
-
-#if 0
-    struct media_device_info mdi;
-    if (0 == ioctl(fd, MEDIA_IOC_DEVICE_INFO, &mdi)) {
-        if (mdi.bus_info[0])
-            g_print("ioctl: has bus_info[0]: %s\n", (const gchar *)(mdi.bus_info));
-        else
-            g_print("ioctl: driver info: %s\n", (const gchar *)(mdi.driver));
-    } else {
-        g_print("ioctl: cap info: %s\n", (const gchar *)(capability.bus_info));
-    }
-#endif
-
-    for (; 0 == ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc); fmtdesc.index++) {
-        frmsize.pixel_format = fmtdesc.pixelformat;
-        frmsize.index = 0;
-        for (; 0 == ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize); frmsize.index++) {
-            if (frmsize.type != V4L2_FRMSIZE_TYPE_DISCRETE)
-                continue;
-            if (frmsize.discrete.width == data->width &&
-                frmsize.discrete.height == data->height) {
-                frmval.pixel_format = fmtdesc.pixelformat;
-                frmval.index = 0;
-                frmval.width = frmsize.discrete.width;
-                frmval.height = frmsize.discrete.height;
-                for (; 0 == ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmval); frmval.index++) {
-                    gfloat fps = ((1.0 * frmval.discrete.denominator) / frmval.discrete.numerator);
-                    if (data->framerate == (int)fps) {
-                        match = TRUE;
-                        break;
-                    }
-                }
-                break;
-            }
-        }
-    }
-
-no_match:
-    close(fd);
     if (!match && showdump)
-        dump_video_device_fmt(data->device);
+        print_capture_modes(data->device, modes);
+    if (modes != NULL)
+        g_array_unref(modes);
     return match;
-}
\ No newline at end of file
+}
@@ -41,5 +41,7 @@ int reset_user_ctrls(const gchar *device);
 int dump_video_device_fmt(const gchar *device);
 gboolean find_video_device_fmt(_v4l2src_data *data, const gboolean showdump);
 gboolean get_capture_device(_v4l2src_data *data);
+/** devices whose capture modes came from the cache and devices enumerated since the start. */
+void get_device_probe_counts(guint *cached, guint *probed);
 
 #endif // _V4L2CTL_H
\ No newline at end of file
@@ -11,6 +11,9 @@ var enableTalk;
 var sendVoice;
 
 let reconnectTimerId;
+// time to first frame, from websocket open to the first decoded video frame.
+let wsOpenTime;
+let ttffReported = false;
 let isRecord = false;
 let isTalk = false;
 let isVoiceRecord = false;
@@ -576,6 +579,10 @@ window.onload = function () {
       });
   });
 
+  // used by ttff-test.sh to start watching without click.
+  if (new URLSearchParams(window.location.search).has('autoplay'))
+    startWatch.click();
+
   startRecord.addEventListener('click', (event) => {
     event.preventDefault();
     console.log(startRecord.innerHTML + " on remote !!! " + isRecord);
@@ -838,6 +845,19 @@ function onAddRemoteStream(event) {
     videoSizeDisplay.innerText = `${el.videoWidth}x${el.videoHeight}`;
   });
 
+  if (event.track.kind == 'video' && !ttffReported) {
+    ttffReported = true;
+    const reportTtff = () => {
+      const ms = Math.round(performance.now() - wsOpenTime);
+      console.log(`ttff: ${ms} ms`);
+      websocketConnection.send(JSON.stringify({ type: 'ttff', data: { ms: ms } }));
+    };
+    if ('requestVideoFrameCallback' in el)
+      el.requestVideoFrameCallback(reportTtff);
+    else
+      el.addEventListener('loadeddata', reportTtff, { once: true });
+  }
+
   el.srcObject = event.streams[0]
   el.autoplay = true
   el.controls = true
@@ -923,6 +943,8 @@ function playStream(hostname, port, path) {
       }, 5000);
     });
     websocketConnection.onopen = () => {
+      wsOpenTime = performance.now();
+      ttffReported = false;
       resolve(websocketConnection);
     };
     websocketConnection.onerror = (err) => {